@@ -17,19 +17,198 @@
 #include "threadSvCmd.h"
 
 #include "threadSvListCmd.h"    /* Shared variants of list commands */
+#include "threadSvQueueCmd.h"   /* Shared bounded queues */
+#include "threadSvDictCmd.h"    /* Shared variants of dict commands */
+#include "threadSvSetCmd.h"     /* Shared hash sets */
+#include "threadSvZsetCmd.h"    /* Shared sorted sets */
+#include "threadSvIndex.h"      /* Ordered index of array keys */
 #include "threadSvKeylistCmd.h" /* Shared variants of list commands */
 #include "psGdbm.h"             /* The gdbm persistent store implementation */
 #include "psLmdb.h"             /* The lmdb persistent store implementation */
 
+#if defined(_WIN32)
+#   include <windows.h>            /* For GetSystemInfo */
+#else
+#   include <unistd.h>             /* For sysconf */
+#endif
+
 #define SV_FINALIZE
 
 /*
- * Number of buckets to spread shared arrays into. Each bucket is
- * associated with one mutex so locking a bucket locks all arrays
- * in that bucket as well. The number of buckets should be a prime.
+ * Limits for the number of buckets to spread shared arrays into.
+ * Each bucket is associated with one mutex so locking a bucket locks
+ * all arrays in that bucket as well. The actual number of buckets is
+ * computed once, at first initialization, from the number of online
+ * processors (see SvNumBuckets) and is always a power of two, so the
+ * bucket of an array is selected by masking its name hash.
+ * The TSV_BUCKETS environment variable overrides the computed value.
+ */
+
+#define MINBUCKETS     32
+#define MAXBUCKETS   4096
+#define BUCKETS_PER_CPU 4
+
+/*
+ * Shards of a sharded array are placed in the buckets following
+ * the bucket of the array itself, wrapping around at the end.
+ */
+
+#define SHARD_BUCKET(b, i) \
+    (&buckets[((size_t)((b) - buckets) + (i) + 1) & (numBuckets - 1)])
+
+/*
+ * Plain arrays are treated as arrays with one single shard,
+ * i.e. the array itself, when iterating over array shards.
+ */
+
+#define SHARD_COUNT(a) ((a)->numShards ? (a)->numShards : 1)
+#define SHARD(a, i)    ((a)->numShards ? (a)->shards[(i)] : (a))
+
+/*
+ * Striped counters keep one slot per thread, up to the number of
+ * processors, each in its own cache line so that threads incrementing
+ * the same counter do not invalidate each other's caches.
+ */
+
+#define MAXSLOTS      256
+
+typedef struct StripedSlot {
+    Tcl_WideInt value;
+    char pad[CACHELINE_SIZE - sizeof(Tcl_WideInt)];
+} StripedSlot;
+
+typedef struct StripedCounter {
+    void *memPtr;              /* Allocated memory, for freeing */
+    StripedSlot *slots;        /* The slots, aligned to cache lines */
+} StripedCounter;
+
+/*
+ * Values stored with "tsv::set -frozen" keep their string in one
+ * immutable, reference counted buffer. Objects of the frozen type
+ * merely point to the buffer, so handing out a copy of the value
+ * costs one atomic increment. The string is copied into the object
+ * only when, and in the thread where, it is actually needed.
+ */
+
+typedef struct FrozenValue {
+    Tcl_WideInt refCount;      /* Number of objects using the buffer */
+    Tcl_Size length;           /* Length of the string below */
+    char bytes[1];             /* The string, NUL terminated */
+} FrozenValue;
+
+#define FROZEN_VALUE(objPtr) \
+    ((FrozenValue *)(objPtr)->internalRep.twoPtrValue.ptr1)
+
+static void FreeFrozenInternalRep(Tcl_Obj *);
+static void DupFrozenInternalRep(Tcl_Obj *, Tcl_Obj *);
+static void UpdateStringOfFrozen(Tcl_Obj *);
+static Tcl_Obj* NewFrozenObj(Tcl_Obj *);
+
+static const Tcl_ObjType frozenObjType = {
+    "tsv::frozen",             /* name */
+    FreeFrozenInternalRep,     /* freeIntRepProc */
+    DupFrozenInternalRep,      /* dupIntRepProc */
+    UpdateStringOfFrozen,      /* updateStringProc */
+    NULL,                      /* setFromAnyProc */
+#if TCL_MAJOR_VERSION >= 9
+    TCL_OBJTYPE_V0
+#endif
+};
+
+/*
+ * Iterating a dict modifies its internal reference count, so threads
+ * copying the same shared dict must take turns. The dict objects are
+ * spread over a number of mutexes by their address.
+ */
+
+#define DICT_MUTEXES 16
+
+static Tcl_Mutex dictMutex[DICT_MUTEXES];
+static void DupDictObjShared(Tcl_Obj *, Tcl_Obj *);
+
+/*
+ * Keys with a time to live are deleted by the reaper thread, which
+ * wakes up every REAPER_INTERVAL ms and deletes at most REAPER_BATCH
+ * expired keys per bucket lock. Until then, expired keys are ignored
+ * by readers and dropped by writers when found.
+ */
+
+#define REAPER_INTERVAL 100
+#define REAPER_BATCH     64
+
+#define REAPER_IDLE     0
+#define REAPER_RUNNING  1
+#define REAPER_STOPPING 2
+
+static Tcl_Mutex reaperMutex;
+static Tcl_Condition reaperCond;
+static Tcl_ThreadId reaperId;
+static int reaperState = REAPER_IDLE;
+
+#define SV_EXPIRED(c) ((c)->expires != 0 && (c)->expires <= SvNow())
+
+/*
+ * Keys of arrays with an eviction policy are accounted for in the
+ * global byte counter, which is checked against the global budget
+ * set with "tsv::configure -maxbytes". Each of these arrays, or
+ * shards, is entitled to an even share of the budget. Readers of LRU
+ * arrays move keys around in the eviction order, so they need the
+ * exclusive lock.
+ */
+
+static Tcl_WideInt globalBytes;
+static Tcl_WideInt globalMaxBytes;
+static Tcl_WideInt numEvictArrays; /* Arrays and shards with a policy */
+
+#define SV_LRU_WRITE(a, flags) \
+    (((flags) & FLAGS_READONLY) && (a)->policy == SV_EVICT_LRU)
+
+/*
+ * Length of the key of a container in the array
+ */
+
+#define KEY_LENGTH(c) \
+    ((Tcl_Size)strlen((char *)Tcl_GetHashKey(&(c)->arrayPtr->vars, (c)->entryPtr)))
+
+/*
+ * Threads watching changes of keys register a watch with the array, or
+ * with every shard of a sharded array. Changed keys are collected in
+ * the watch until the event queued to the watching thread delivers
+ * them, so many changes of one key in between are reported once.
+ * Watches of arrays which do not exist yet wait in the idleWatches
+ * table under the name of the array, until it gets created.
+ * All watches are protected by the watchMutex.
  */
 
-#define NUMBUCKETS 31
+typedef struct Watch {
+    Tcl_Size refCount;         /* References of arrays, events and table */
+    int active;                /* Cleared when the watch is cancelled */
+    Tcl_ThreadId threadId;     /* Thread to deliver changes to */
+    Tcl_Interp *interp;        /* Interpreter to run the command in */
+    char *array;               /* Name of the watched array */
+    char *pattern;             /* Pattern of watched keys, or NULL */
+    char *command;             /* Command prefix to run for each change */
+    Tcl_HashEntry *entryPtr;   /* Entry in the table of watches */
+    Tcl_HashTable pending;     /* Changed keys not delivered yet */
+    int queued;                /* Event delivering the keys is queued */
+} Watch;
+
+typedef struct WatchRef {
+    Watch *watchPtr;           /* Watch of the array */
+    struct WatchRef *nextPtr;  /* Next watch of the array */
+} WatchRef;
+
+typedef struct WatchEvent {
+    Tcl_Event event;           /* Must be first */
+    Watch *watchPtr;           /* Watch to deliver changes of */
+} WatchEvent;
+
+static Tcl_Mutex watchMutex;
+static Tcl_HashTable watchTable; /* Watches by name */
+static Tcl_HashTable idleWatches; /* Watches of missing arrays by array */
+static Tcl_WideInt numIdleWatches = 0; /* Arrays in idleWatches */
+static int watchTableInit = 0;
+static size_t watchIds = 0;    /* Last id given to a watch */
 
 /*
  * Number of object containers
@@ -49,6 +228,8 @@ static const Tcl_ObjType* doubleObjTypePtr = 0;
 static const Tcl_ObjType* intObjTypePtr = 0;
 static const Tcl_ObjType* wideIntObjTypePtr = 0;
 static const Tcl_ObjType* stringObjTypePtr = 0;
+static const Tcl_ObjType* listObjTypePtr = 0;
+static const Tcl_ObjType* dictObjTypePtr = 0;
 
 /*
  * In order to be fully stub enabled, a small
@@ -68,7 +249,11 @@ static Tcl_Mutex  nofThreadsMutex; /* Protects the nofThreads variable */
 #endif /* SV_FINALIZE */
 
 static Bucket*    buckets;      /* Array of buckets. */
+static size_t     numBuckets;   /* Number of buckets, a power of two */
+static size_t     numSlots;     /* Slots of striped counters, power of two */
+static unsigned int threadSlots; /* Last slot number given to a thread */
 static Tcl_Mutex  bucketsMutex; /* Protects the array of buckets */
+static size_t     shardIds;     /* Last id given to a sharded array */
 
 static SvCmdInfo* svCmdInfo;    /* Linked list of registered commands */
 static RegType*   regType;      /* Linked list of registered obj types */
@@ -102,6 +287,13 @@ static Tcl_ObjCmdProc2 SvHandlersObjCmd;
 static Tcl_ObjCmdProc2 SvPopObjCmd;
 static Tcl_ObjCmdProc2 SvMoveObjCmd;
 static Tcl_ObjCmdProc2 SvLockObjCmd;
+static Tcl_ObjCmdProc2 SvMGetObjCmd;
+static Tcl_ObjCmdProc2 SvMSetObjCmd;
+static Tcl_ObjCmdProc2 SvCasObjCmd;
+static Tcl_ObjCmdProc2 SvConfigureObjCmd;
+static Tcl_ObjCmdProc2 SvCompactObjCmd;
+static Tcl_ObjCmdProc2 SvWatchObjCmd;
+static Tcl_ObjCmdProc2 SvUnwatchObjCmd;
 
 /*
  * Forward declarations for functions to
@@ -111,15 +303,37 @@ static Tcl_ObjCmdProc2 SvLockObjCmd;
 static Container* CreateContainer(Array*, Tcl_HashEntry*, Tcl_Obj*);
 static Container* AcquireContainer(Array*, const char*, int);
 
+static int SvIsReadable(Container*, int);
+static int PrepareContainer(Container*, int);
+static Tcl_Obj* GetValue(Container*);
+
+static Array* NewArray(Bucket*, Tcl_HashEntry*);
 static Array* CreateArray(Bucket*, const char*);
+static Array* CreateShardedArray(Bucket*, const char*, int);
+static Array* FindArray(Tcl_Interp*, Bucket*, const char*, int);
 static Array* LockArray(Tcl_Interp*, const char*, int);
+static Array* LockShard(Tcl_Interp*, const char*, const char*, int, int*,
+	    int);
+static Array* GetShard(Array*, const char*);
+static void UnlockArray(Array*);
+
+static void LockShards(Bucket*, int, int);
+static void UnlockShards(Bucket*, int);
 
+static int PersistContainer(Tcl_Interp*, Container*);
 static int ReleaseContainer(Tcl_Interp*, Container*, int);
 static int DeleteContainer(Container*);
 static int FlushArray(Array*);
 static int DeleteArray(Tcl_Interp *, Array*);
+static int MoveShardedKey(Tcl_Interp *, Container*, const char*);
 
 static void SvAllocateContainers(Bucket*);
+static Container* AllocContainer(Bucket*);
+static void FreeContainer(Container*);
+static void LinkChunk(Chunk*, Chunk**);
+static void UnlinkChunk(Chunk*, Chunk**);
+static void FreeChunk(Chunk*);
+static Tcl_WideInt CompactBucket(Bucket*);
 static void SvRegisterStdCommands(void);
 
 #ifdef SV_FINALIZE
@@ -129,8 +343,94 @@ static void SvFinalize(void *);
 
 static PsStore* GetPsStore(const char *handle);
 
+static Tcl_WideInt SvNow(void);
+static void SetExpiry(Container*, Tcl_WideInt);
+static void ResetExpiry(Container*);
+static void TtlHeapUp(Bucket*, Tcl_Size);
+static void TtlHeapDown(Bucket*, Tcl_Size);
+static void TtlHeapRemove(Container*);
+static void StartReaper(void);
+static Tcl_ThreadCreateType ReaperThread(void *);
+
+static void LruLink(Array*, Container*);
+static void LruUnlink(Array*, Container*);
+static void TouchContainer(Container*);
+static Tcl_Size SvObjSize(Tcl_Obj*);
+static void AccountContainer(Container*, int);
+static void EvictKeys(Array*, Container*);
+static void SetEviction(Array*, int, Tcl_WideInt, Tcl_WideInt);
+
+static Tcl_Size SvObjRepSize(Tcl_Obj*);
+static void CountValue(Container*, int);
+
+static void NotifyWatches(Container*, const char*);
+static int WatchEventProc(Tcl_Event*, int);
+static void DropWatch(Watch*);
+static void CancelWatch(Watch*);
+static void ReleaseWatches(Array*);
+static void AttachWatches(Array*, const char*);
+static int DeleteWatchEvent(Tcl_Event*, void *);
+static Tcl_InterpDeleteProc WatchInterpDeleted;
+static Bucket* WaitBucket(SvWait*);
+static void WakeWaiters(Bucket*);
+
+static size_t SvNumProcessors(void);
+static size_t SvNumBuckets(void);
+static size_t SvThreadSlot(void);
+static unsigned int SvHashString(const char *);
+static Tcl_Size SvGlobPrefix(const char *);
+static unsigned int SvReverseBits(unsigned int);
+
+static Tcl_Obj* SvTakeVar(Tcl_Interp*, Tcl_Obj*, Tcl_Obj**);
+static int SvStripOption(Tcl_Size*, Tcl_Obj *const**, Tcl_Size,
+	    const char*, Tcl_Obj**);
+static int SvShiftArgs(Tcl_Size*, Tcl_Obj *const**, Tcl_Size, Tcl_Size,
+	    Tcl_Obj**);
+
+static int ScanArray(Tcl_Interp*, Tcl_Size, Tcl_Obj *const[]);
+
 static int SvObjDispatchObjCmd(void *arg,
 	    Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]);
+
+/*
+ * Integer objects incremented with "tsv::incr" are kept as atomic
+ * counters, so that further increments need only the shared lock.
+ */
+
+static void CounterUpdateProc(Container*);
+static void CounterFreeProc(Container*);
+static Tcl_Obj* CounterValueProc(Container*);
+
+static const SvRepType counterRepType = {
+    "counter",
+    CounterUpdateProc,
+    CounterFreeProc,
+    CounterValueProc,
+    NULL
+};
+
+/*
+ * Objects incremented with "tsv::incr -striped" are kept as striped
+ * counters. Each thread increments its own slot, readers sum them up.
+ */
+
+static void StripedUpdateProc(Container*);
+static void StripedFreeProc(Container*);
+static Tcl_Obj* StripedValueProc(Container*);
+
+static const SvRepType stripedRepType = {
+    "striped",
+    StripedUpdateProc,
+    StripedFreeProc,
+    StripedValueProc,
+    NULL
+};
+
+typedef struct {
+    size_t slot;               /* Slot of striped counters, 0 if none yet */
+} ThreadSpecificData;
+
+static Tcl_ThreadDataKey dataKey;
 
 /*
  *-----------------------------------------------------------------------------
@@ -335,30 +635,63 @@ Sv_GetContainer(
 	 * Lock the shared array and locate the shared object
 	 */
 
-	arrayPtr = LockArray(interp, array, flags);
-	if (arrayPtr == NULL) {
-	    return TCL_BREAK;
-	}
-	*retObj = AcquireContainer(arrayPtr, Tcl_GetString(objv[2]), flags);
-	if (*retObj == NULL) {
+	while (1) {
+	    arrayPtr = LockShard(interp, array, key, 0, NULL, flags);
+	    if (arrayPtr == NULL) {
+		return TCL_BREAK;
+	    }
+	    *retObj = AcquireContainer(arrayPtr, key, flags);
+	    if (*retObj == NULL) {
+		UnlockArray(arrayPtr);
+		Tcl_AppendResult(interp, "no key ", array, "(", key, ")", (void *)NULL);
+		return TCL_BREAK;
+	    }
+	    if (PrepareContainer(*retObj, flags)) {
+		break;
+	    }
+
+	    /*
+	     * Readers would need to modify the object. Start over
+	     * holding the exclusive lock.
+	     */
+
 	    UnlockArray(arrayPtr);
-	    Tcl_AppendResult(interp, "no key ", array, "(", key, ")", (void *)NULL);
-	    return TCL_BREAK;
+	    *retObj = NULL;
+	    flags &= ~(FLAGS_READONLY|FLAGS_LISTREP|FLAGS_DICTREP);
 	}
     } else {
-	Tcl_HashTable *handles = &((*retObj)->bucketPtr->handles);
-	LOCK_CONTAINER(*retObj);
-	if (Tcl_FindHashEntry(handles, (char*)(*retObj)) == NULL) {
-	    UNLOCK_CONTAINER(*retObj);
-	    Tcl_SetObjResult(interp, Tcl_NewStringObj("key has been deleted", TCL_INDEX_NONE));
-	    return TCL_BREAK;
-	}
+	Container *svObj = *retObj;
+	Tcl_HashTable *handles = &svObj->bucketPtr->handles;
+
 	*offset = 2; /* Consumed two arguments: object, cmd */
+
+	while (1) {
+	    Sv_LockBucket(svObj->bucketPtr, flags & FLAGS_READONLY);
+	    if (Tcl_FindHashEntry(handles, (char*)svObj) == NULL
+		    || SV_EXPIRED(svObj)) {
+		UNLOCK_CONTAINER(svObj);
+		Tcl_SetObjResult(interp, Tcl_NewStringObj("key has been deleted", TCL_INDEX_NONE));
+		return TCL_BREAK;
+	    }
+	    if (SV_LRU_WRITE(svObj->arrayPtr, flags)) {
+		UNLOCK_CONTAINER(svObj);
+		flags &= ~FLAGS_READONLY;
+		continue;
+	    }
+	    if (PrepareContainer(svObj, flags)) {
+		if (svObj->arrayPtr->policy != SV_EVICT_NONE) {
+		    TouchContainer(svObj);
+		}
+		break;
+	    }
+	    UNLOCK_CONTAINER(svObj);
+	    flags &= ~(FLAGS_READONLY|FLAGS_LISTREP|FLAGS_DICTREP);
+	}
     }
 
     return TCL_OK;
 }
-
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -392,1045 +725,5372 @@ Sv_PutContainer(
 /*
  *-----------------------------------------------------------------------------
  *
- * GetPsStore --
+ * Sv_LockBucket --
  *
- *      Performs a lookup in the list of registered persistent storage
- *      handlers. If the match is found, duplicates the persistent
- *      storage record and passes the copy to the caller.
+ *      Locks the bucket either for reading (shared) or for writing
+ *      (exclusive). The thread holding the write lock may lock the
+ *      bucket again, in any mode. This happens when shared variable
+ *      commands are called from within the tsv::lock script.
  *
  * Results:
- *      Pointer to the newly allocated persistent storage handler. Caller
- *      must free this block when done with it. If none found, returns NULL,
+ *      None.
  *
- * Side effects;
- *      Memory gets allocated. Caller should free the return value of this
- *      function using Tcl_Free().
+ * Side effects:
+ *      Bucket is locked.
  *
  *-----------------------------------------------------------------------------
  */
 
-static PsStore*
-GetPsStore(const char *handle)
+void
+Sv_LockBucket(
+	      Bucket *bucketPtr,                /* Bucket to lock */
+	      int readonly)                     /* Take the shared lock */
 {
-    int i;
-    const char *type = handle;
-    char *addr, *delimiter = (char *)strchr(handle, ':');
-    PsStore *tmpPtr, *psPtr = NULL;
-
-    /*
-     * Expect the handle in the following format: <type>:<address>
-     * where "type" must match one of the registered presistent store
-     * types (gdbm, tcl, whatever) and <address> is what is passed to
-     * the open procedure of the registered store.
-     *
-     * Example: gdbm:/path/to/gdbm/file
-     */
-
-    /*
-     * Try to see wether some array is already bound to the
-     * same persistent storage address.
-     */
-
-    for (i = 0; i < NUMBUCKETS; i++) {
-	Tcl_HashSearch search;
-	Tcl_HashEntry *hPtr;
-	Bucket *bucketPtr = &buckets[i];
-	LOCK_BUCKET(bucketPtr);
-	hPtr = Tcl_FirstHashEntry(&bucketPtr->arrays, &search);
-	while (hPtr) {
-	    Array *arrayPtr = (Array*)Tcl_GetHashValue(hPtr);
-	    if (arrayPtr->bindAddr && arrayPtr->psPtr) {
-		if (strcmp(arrayPtr->bindAddr, handle) == 0) {
-		    UNLOCK_BUCKET(bucketPtr);
-		    return NULL; /* Array already bound */
-		}
-	    }
-	    hPtr = Tcl_NextHashEntry(&search);
-	}
-	UNLOCK_BUCKET(bucketPtr);
-    }
-
-    /*
-     * Split the address and storage handler
-     */
+    int locked;
 
-    if (delimiter == NULL) {
-	addr = NULL;
+    if (readonly) {
+	locked = Sp_ReadWriteMutexRLock(&bucketPtr->lock);
     } else {
-	*delimiter = 0;
-	addr = delimiter + 1;
-    }
-
-    /*
-     * No array was bound to the same persistent storage.
-     * Lookup the persistent storage to bind to.
-     */
-
-    Tcl_MutexLock(&svMutex);
-    for (tmpPtr = psStore; tmpPtr; tmpPtr = tmpPtr->nextPtr) {
-	if (strcmp(tmpPtr->type, type) == 0) {
-	    tmpPtr->psHandle = tmpPtr->psOpen(addr);
-	    if (tmpPtr->psHandle) {
-		psPtr = (PsStore *)Tcl_Alloc(sizeof(PsStore));
-		*psPtr = *tmpPtr;
-		psPtr->nextPtr = NULL;
-	    }
-	    break;
-	}
+	locked = Sp_ReadWriteMutexWLock(&bucketPtr->lock);
     }
-    Tcl_MutexUnlock(&svMutex);
-
-    if (delimiter) {
-	*delimiter = ':';
+    if (!locked) {
+	bucketPtr->nested++; /* We already hold the write lock */
     }
-
-    return psPtr;
 }
-
+
 /*
  *-----------------------------------------------------------------------------
  *
- * AcquireContainer --
+ * Sv_UnlockBucket --
  *
- *      Finds a variable within an array and returns it's container.
+ *      Unlocks the bucket locked with Sv_LockBucket.
  *
  * Results:
- *      Pointer to variable object.
+ *      None.
  *
- * Side effects;
- *      New variable may be created. For bound arrays, try to locate
- *      the key in the persistent storage as well.
+ * Side effects:
+ *      Bucket may be unlocked.
  *
  *-----------------------------------------------------------------------------
  */
 
-static Container *
-AcquireContainer(
-		 Array *arrayPtr,
-		 const char *key,
-		 int flags)
+void
+Sv_UnlockBucket(
+		Bucket *bucketPtr)              /* Bucket to unlock */
 {
-    int isNew;
-    Tcl_Obj *tclObj = NULL;
-    Tcl_HashEntry *hPtr = Tcl_FindHashEntry(&arrayPtr->vars, key);
+    /*
+     * Only the writer ever increments the nesting count,
+     * so readers always see zero here.
+     */
 
-    if (hPtr == NULL) {
-	PsStore *psPtr = arrayPtr->psPtr;
-	if (psPtr) {
-	    char *val = NULL;
-	    Tcl_Size len = 0;
-	    if (psPtr->psGet(psPtr->psHandle, key, &val, &len) == 0) {
-		tclObj = Tcl_NewStringObj(val, len);
-		psPtr->psFree(psPtr->psHandle, val);
-	    }
-	}
-	if (!(flags & FLAGS_CREATEVAR) && tclObj == NULL) {
-	    return NULL;
-	}
-	if (tclObj == NULL) {
-	    tclObj = Tcl_NewObj();
-	}
-	hPtr = Tcl_CreateHashEntry(&arrayPtr->vars, key, &isNew);
-	Tcl_SetHashValue(hPtr, CreateContainer(arrayPtr, hPtr, tclObj));
+    if (bucketPtr->nested > 0) {
+	bucketPtr->nested--;
+    } else {
+	Sp_ReadWriteMutexUnlock(&bucketPtr->lock);
     }
-
-    return (Container*)Tcl_GetHashValue(hPtr);
 }
-
+
 /*
  *-----------------------------------------------------------------------------
  *
- * ReleaseContainer --
+ * Sv_WaitOptions --
  *
- *      Does some post-processing on the used container. This is mostly
- *      needed when the container has been modified and needs to be
- *      saved in the bound persistent storage.
+ *      Parses the leading -wait and -timeout options of commands which
+ *      may wait for a key to change and removes them from the argument
+ *      list. For object commands the options follow the method name.
+ *      The shortened argument list is built in the given buffer, which
+ *      must hold at least SV_MAXARGS elements.
  *
  * Results:
- *      A standard Tcl result
+ *      A standard Tcl result. The deadline is set to 0 if the command
+ *      should not wait, -1 if it should wait forever, or to the time
+ *      in milliseconds at which the wait ends.
  *
  * Side effects:
- *      Persistent storage, if bound, might be modified.
+ *      Argument count and list may be replaced.
  *
  *-----------------------------------------------------------------------------
  */
 
-static int
-ReleaseContainer(
-		 Tcl_Interp *interp,
-		 Container *svObj,
-		 int mode)
+int
+Sv_WaitOptions(
+	       Tcl_Interp *interp,            /* Current interpreter. */
+	       Tcl_Size *objcPtr,             /* IN/OUT: number of arguments */
+	       Tcl_Obj *const **objvPtr,      /* IN/OUT: argument objects */
+	       Tcl_Size first,                /* Index of the first argument */
+	       Tcl_Obj **buffer,              /* Space for the new arguments */
+	       Tcl_WideInt *deadlinePtr)      /* OUT: end of the wait */
 {
-    const PsStore *psPtr = svObj->arrayPtr->psPtr;
-    Tcl_Size len;
-    char *key, *val;
+    Tcl_WideInt timeout;
+    const char *opt;
 
-    switch (mode) {
-    case SV_UNCHANGED: return TCL_OK;
-    case SV_ERROR:     return TCL_ERROR;
-    case SV_CHANGED:
-	if (psPtr) {
-	    key = (char *)Tcl_GetHashKey(&svObj->arrayPtr->vars, svObj->entryPtr);
-	    val = Tcl_GetStringFromObj(svObj->tclObj, &len);
-	    if (psPtr->psPut(psPtr->psHandle, key, val, len) == -1) {
-		const char *err = psPtr->psError(psPtr->psHandle);
-		Tcl_SetObjResult(interp, Tcl_NewStringObj(err, TCL_INDEX_NONE));
+    *deadlinePtr = 0;
+
+    while (*objcPtr > first) {
+	opt = Tcl_GetString((*objvPtr)[first]);
+	if (!strcmp(opt, "-wait")) {
+	    if (*deadlinePtr == 0) {
+		*deadlinePtr = -1;
+	    }
+	    if (SvShiftArgs(objcPtr, objvPtr, first, 1, buffer) != TCL_OK) {
+		goto toomany;
+	    }
+	} else if (!strcmp(opt, "-timeout")) {
+	    if (*objcPtr < first + 2) {
+		Tcl_SetObjResult(interp, Tcl_NewStringObj(
+			"missing value for -timeout", TCL_INDEX_NONE));
+		return TCL_ERROR;
+	    }
+	    if (Tcl_GetWideIntFromObj(interp, (*objvPtr)[first + 1],
+		    &timeout) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if (timeout < 0) {
+		Tcl_SetObjResult(interp, Tcl_NewStringObj(
+			"timeout must be non-negative", TCL_INDEX_NONE));
 		return TCL_ERROR;
 	    }
+	    *deadlinePtr = SvNow() + timeout;
+	    if (SvShiftArgs(objcPtr, objvPtr, first, 2, buffer) != TCL_OK) {
+		goto toomany;
+	    }
+	} else {
+	    break;
 	}
-	return TCL_OK;
     }
 
-    return TCL_ERROR; /* Should never be reached */
+    return TCL_OK;
+
+ toomany:
+    Tcl_SetObjResult(interp, Tcl_NewStringObj("too many arguments",
+	    TCL_INDEX_NONE));
+    return TCL_ERROR;
 }
-
+
 /*
  *-----------------------------------------------------------------------------
  *
- * CreateContainer --
+ * Sv_WaitBegin, Sv_WaitChange, Sv_WaitEnd --
  *
- *      Creates new shared container holding Tcl object to be stored
- *      in the shared array
+ *      Let a command wait for changes of a key. The caller registers
+ *      with Sv_WaitBegin, giving either the container of a handle or
+ *      the arguments naming the array and key, before checking its
+ *      key, holding the lock of the key's bucket during the check. If
+ *      it has to wait, it calls Sv_WaitChange and checks again. Since
+ *      changes made by others after the check see the registered
+ *      waiter, none of them can get lost. Each Sv_WaitBegin must be
+ *      paired with a Sv_WaitEnd.
+ *
+ *      Waiters register with the bucket of their key, which is the
+ *      bucket of the shard holding the key for sharded arrays, and
+ *      only changes made in that bucket wake them up. Creating and
+ *      deleting arrays wakes waiters as well, so that they can find
+ *      the bucket anew.
  *
  * Results:
- *      The container pointer.
+ *      Sv_WaitChange returns 1 once a change has been made, or 0 if
+ *      the deadline passed first.
  *
  * Side effects:
- *      Memory gets allocated.
+ *      The calling thread may block.
  *
  *-----------------------------------------------------------------------------
  */
 
-static Container *
-CreateContainer(
-		Array *arrayPtr,
-		Tcl_HashEntry *entryPtr,
-		Tcl_Obj *tclObj)
+void
+Sv_WaitBegin(
+	     SvWait *waitPtr,                 /* Wait to register */
+	     Tcl_Size objc,                   /* Number of arguments */
+	     Tcl_Obj *const objv[],           /* Arguments: cmd array key ... */
+	     Container *svObj)                /* Container of handle, or NULL */
 {
-    Container *svObj;
-
-    if (arrayPtr->bucketPtr->freeCt == NULL) {
-	SvAllocateContainers(arrayPtr->bucketPtr);
+    waitPtr->array = NULL;
+    waitPtr->key = NULL;
+    waitPtr->bucketPtr = NULL;
+    waitPtr->gen = 0;
+
+    if (svObj != NULL) {
+	waitPtr->bucketPtr = svObj->bucketPtr;
+	Tcl_MutexLock(&svObj->bucketPtr->waitMutex);
+	SvAtomicAdd(&svObj->bucketPtr->numWaiters, 1);
+	waitPtr->gen = svObj->bucketPtr->waitGen;
+	Tcl_MutexUnlock(&svObj->bucketPtr->waitMutex);
+    } else if (objc >= 3) {
+	waitPtr->array = Tcl_GetString(objv[1]);
+	waitPtr->key = Tcl_GetString(objv[2]);
+	WaitBucket(waitPtr);
     }
+}
 
-    svObj = arrayPtr->bucketPtr->freeCt;
-    arrayPtr->bucketPtr->freeCt = svObj->nextPtr;
+int
+Sv_WaitChange(
+	      SvWait *waitPtr,                /* Registered wait */
+	      Tcl_WideInt deadline)           /* End of the wait or -1 */
+{
+    Bucket *bucketPtr = waitPtr->bucketPtr;
+    Tcl_WideInt left;
+    Tcl_Time timeout;
+    int changed = 1;
 
-    svObj->arrayPtr  = arrayPtr;
-    svObj->bucketPtr = arrayPtr->bucketPtr;
-    svObj->tclObj    = tclObj;
-    svObj->entryPtr  = entryPtr;
-    svObj->handlePtr = NULL;
+    if (bucketPtr == NULL) {
+	return 0;
+    }
+    Tcl_MutexLock(&bucketPtr->waitMutex);
+    while (bucketPtr->waitGen == waitPtr->gen) {
+	if (deadline < 0) {
+	    Tcl_ConditionWait(&bucketPtr->waitCond, &bucketPtr->waitMutex, NULL);
+	    continue;
+	}
+	left = deadline - SvNow();
+	if (left <= 0) {
+	    changed = 0;
+	    break;
+	}
+	timeout.sec  = (long)(left / 1000);
+	timeout.usec = (long)(left % 1000) * 1000;
+	Tcl_ConditionWait(&bucketPtr->waitCond, &bucketPtr->waitMutex, &timeout);
+    }
+    waitPtr->gen = bucketPtr->waitGen;
+    Tcl_MutexUnlock(&bucketPtr->waitMutex);
 
-    if (svObj->tclObj) {
-	Tcl_IncrRefCount(svObj->tclObj);
+    /*
+     * The array may have been created or deleted meanwhile, moving
+     * the key to another bucket.
+     */
+
+    if (changed && waitPtr->array != NULL) {
+	WaitBucket(waitPtr);
     }
 
-    return svObj;
+    return changed;
 }
-
+
+void
+Sv_WaitEnd(
+	   SvWait *waitPtr)                   /* Registered wait */
+{
+    if (waitPtr->bucketPtr != NULL) {
+	SvAtomicAdd(&waitPtr->bucketPtr->numWaiters, -1);
+	waitPtr->bucketPtr = NULL;
+    }
+}
+
 /*
  *-----------------------------------------------------------------------------
  *
- * DeleteContainer --
+ * WaitBucket --
  *
- *      Destroys the container and the Tcl object within it. For bound
- *      shared arrays, the underlying persistent store is updated as well.
+ *      Registers the wait with the bucket currently holding its key,
+ *      moving it from the bucket it was registered with before. The
+ *      bucket of the array is locked while looking, so that the array
+ *      can not be created or deleted unnoticed.
  *
  * Results:
- *      None.
+ *      The bucket registered with.
  *
  * Side effects:
- *      Memory gets reclaimed. If the shared array was bound to persistent
- *      storage, it removes the corresponding record.
+ *      Waiter counts of buckets change.
  *
  *-----------------------------------------------------------------------------
  */
 
-static int
-DeleteContainer(
-		Container *svObj)
+static Bucket *
+WaitBucket(
+	   SvWait *waitPtr)                   /* Wait naming array and key */
 {
-    if (svObj->tclObj) {
-	Tcl_DecrRefCount(svObj->tclObj);
-    }
-    if (svObj->handlePtr) {
-	Tcl_DeleteHashEntry(svObj->handlePtr);
-    }
-    if (svObj->entryPtr) {
-	PsStore *psPtr = svObj->arrayPtr->psPtr;
-	if (psPtr) {
-	    char *key = (char *)Tcl_GetHashKey(&svObj->arrayPtr->vars,svObj->entryPtr);
-	    if (psPtr->psDelete(psPtr->psHandle, key) == -1) {
-		return TCL_ERROR;
-	    }
-	}
-	Tcl_DeleteHashEntry(svObj->entryPtr);
-    }
+    Bucket *bucketPtr, *keyBucketPtr;
+    Tcl_HashEntry *hPtr;
+    Array *arrayPtr;
 
-    svObj->arrayPtr  = NULL;
-    svObj->entryPtr  = NULL;
-    svObj->handlePtr = NULL;
-    svObj->tclObj    = NULL;
+    bucketPtr = &buckets[SvHashString(waitPtr->array) & (numBuckets - 1)];
+    keyBucketPtr = bucketPtr;
 
-    svObj->nextPtr = svObj->bucketPtr->freeCt;
-    svObj->bucketPtr->freeCt = svObj;
+    Sv_LockBucket(bucketPtr, 1);
+    hPtr = Tcl_FindHashEntry(&bucketPtr->arrays, waitPtr->array);
+    if (hPtr != NULL) {
+	arrayPtr = (Array *)Tcl_GetHashValue(hPtr);
+	if (arrayPtr->numShards) {
+	    keyBucketPtr = SHARD_BUCKET(bucketPtr, (int)(SvHashString(
+		    waitPtr->key) % (unsigned int)arrayPtr->numShards));
+	}
+    }
+    if (keyBucketPtr != waitPtr->bucketPtr) {
+	Sv_WaitEnd(waitPtr);
+	waitPtr->bucketPtr = keyBucketPtr;
+	Tcl_MutexLock(&keyBucketPtr->waitMutex);
+	SvAtomicAdd(&keyBucketPtr->numWaiters, 1);
+	waitPtr->gen = keyBucketPtr->waitGen;
+	Tcl_MutexUnlock(&keyBucketPtr->waitMutex);
+    }
+    UNLOCK_BUCKET(bucketPtr);
 
-    return TCL_OK;
+    return keyBucketPtr;
 }
-
+
 /*
  *-----------------------------------------------------------------------------
  *
- * LockArray --
+ * WakeWaiters --
  *
- *      Find (or create) the array structure for shared array and lock it.
- *      Array structure must be later unlocked with UnlockArray.
+ *      Wakes all threads waiting in Sv_WaitChange for changes in the
+ *      bucket. Called after a key has been changed, or an array has
+ *      been created or deleted, with the lock of the bucket still held.
  *
  * Results:
- *      TCL_OK or TCL_ERROR if no such array.
+ *      None.
  *
  * Side effects:
- *      Sets *arrayPtrPtr with Array pointer or leave error in given interp.
+ *      Waiting threads are woken up.
  *
  *-----------------------------------------------------------------------------
  */
 
-static Array *
-LockArray(
-	  Tcl_Interp *interp,                 /* Interpreter to leave result. */
-	  const char *array,                  /* Name of array to lock */
-	  int flags)                          /* FLAGS_CREATEARRAY/FLAGS_NOERRMSG*/
+static void
+WakeWaiters(
+	    Bucket *bucketPtr)
 {
-    const char *p;
-    size_t result, i;
-    Bucket *bucketPtr;
-    Array *arrayPtr;
-
-    /*
-     * Compute a hash to map an array to a bucket.
-     */
-
-    p = array;
-    result = 0;
-    while (*p++) {
-	i = (unsigned char)*p;
-	result += (result << 3) + i;
-    }
-    i = (result % NUMBUCKETS);
-    bucketPtr = &buckets[i];
-
-    /*
-     * Lock the bucket and find the array, or create a new one.
-     * The bucket will be left locked on success.
-     */
-
-    LOCK_BUCKET(bucketPtr); /* Note: no matching unlock below ! */
-    if (flags & FLAGS_CREATEARRAY) {
-	arrayPtr = CreateArray(bucketPtr, array);
-    } else {
-	Tcl_HashEntry *hPtr = Tcl_FindHashEntry(&bucketPtr->arrays, array);
-	if (hPtr == NULL) {
-	    UNLOCK_BUCKET(bucketPtr);
-	    if (!(flags & FLAGS_NOERRMSG)) {
-		Tcl_AppendResult(interp, "\"", array,
-				 "\" is not a thread shared array", (void *)NULL);
-	    }
-	    return NULL;
-	}
-	arrayPtr = (Array*)Tcl_GetHashValue(hPtr);
-    }
-
-    return arrayPtr;
+    Tcl_MutexLock(&bucketPtr->waitMutex);
+    bucketPtr->waitGen++;
+    Tcl_ConditionNotify(&bucketPtr->waitCond);
+    Tcl_MutexUnlock(&bucketPtr->waitMutex);
 }
+
 /*
  *-----------------------------------------------------------------------------
  *
- * FlushArray --
+ * PrepareContainer --
  *
- *      Unset all keys in an array.
+ *      Makes the container found by Sv_GetContainer ready for use by the
+ *      caller. Unless the caller handles alternative representations,
+ *      the Tcl object of the container is brought up to date.
  *
  * Results:
- *      None.
+ *      1 if the container may be used with the lock held, 0 if the
+ *      caller must start over with the exclusive lock.
  *
  * Side effects:
- *      Array is cleaned but it's variable hash-hable still lives.
- *      For bound arrays, the persistent store is updated accordingly.
+ *      Alternative representation of the object may be dropped.
  *
  *-----------------------------------------------------------------------------
  */
 
 static int
-FlushArray(Array *arrayPtr)                    /* Name of array to flush */
+PrepareContainer(
+		 Container *svObj,              /* Shared object container */
+		 int flags)                     /* FLAGS_READONLY/LISTREP/DICTREP/KEEPREP */
 {
-    Tcl_HashEntry *hPtr;
-    Tcl_HashSearch search;
-
-    for (hPtr = Tcl_FirstHashEntry(&arrayPtr->vars, &search); hPtr;
-	 hPtr = Tcl_NextHashEntry(&search)) {
-	if (DeleteContainer((Container*)Tcl_GetHashValue(hPtr)) != TCL_OK) {
-	    return TCL_ERROR;
+    if (svObj->repTypePtr && !(flags & FLAGS_KEEPREP)) {
+	if (flags & FLAGS_READONLY) {
+	    return 0;
 	}
+	Sv_UpdateContainer(svObj);
     }
 
-    return TCL_OK;
+    return !(flags & FLAGS_READONLY) || SvIsReadable(svObj, flags);
 }
-
+
 /*
  *-----------------------------------------------------------------------------
  *
- * CreateArray --
+ * Sv_UpdateContainer --
  *
- *      Creates new shared array instance.
+ *      Updates the Tcl object of the container from its alternative
+ *      representation and drops the representation. The container
+ *      must be locked for writing.
  *
  * Results:
- *      Pointer to the newly created array
+ *      None.
  *
  * Side effects:
- *      Memory gets allocated
+ *      Memory may be freed.
  *
  *-----------------------------------------------------------------------------
  */
 
-static Array *
-CreateArray(
-	    Bucket *bucketPtr,
-	    const char *arrayName)
+void
+Sv_UpdateContainer(
+		Container *svObj)               /* Shared object container */
 {
-    int isNew;
-    Array *arrayPtr;
-    Tcl_HashEntry *hPtr;
-
-    hPtr = Tcl_CreateHashEntry(&bucketPtr->arrays, arrayName, &isNew);
-    if (!isNew) {
-	return (Array*)Tcl_GetHashValue(hPtr);
+    if (svObj->repTypePtr) {
+	svObj->repTypePtr->updateProc(svObj);
+	svObj->repTypePtr->freeProc(svObj);
+	svObj->repTypePtr = NULL;
+	svObj->repPtr = NULL;
     }
-
-    arrayPtr = (Array *)Tcl_Alloc(sizeof(Array));
-    arrayPtr->bucketPtr = bucketPtr;
-    arrayPtr->entryPtr  = hPtr;
-    arrayPtr->psPtr     = NULL;
-    arrayPtr->bindAddr  = NULL;
-
-    Tcl_InitHashTable(&arrayPtr->vars, TCL_STRING_KEYS);
-    Tcl_SetHashValue(hPtr, arrayPtr);
-
-    return arrayPtr;
 }
-
+
 /*
  *-----------------------------------------------------------------------------
  *
- * DeleteArray --
+ * GetValue --
  *
- *      Deletes the shared array.
+ *      Returns a copy of the value of the shared object, suitable
+ *      to be handed out to the caller interpreter. This can be used
+ *      under the shared lock.
  *
  * Results:
- *      A standard Tcl result.
+ *      New Tcl object with reference count 0.
  *
  * Side effects:
- *      Memory gets reclaimed.
+ *      None.
  *
  *-----------------------------------------------------------------------------
  */
 
-static int
-UnbindArray(Tcl_Interp *interp, Array *arrayPtr)
-{
-    PsStore *psPtr = arrayPtr->psPtr;
-    if (arrayPtr->bindAddr) {
-	Tcl_Free(arrayPtr->bindAddr);
-	arrayPtr->bindAddr = NULL;
-    }
-    if (psPtr) {
-	if (psPtr->psClose(psPtr->psHandle) == -1) {
-	    if (interp) {
-		const char *err = psPtr->psError(psPtr->psHandle);
-		Tcl_SetObjResult(interp, Tcl_NewStringObj(err, TCL_INDEX_NONE));
-	    }
-	    return TCL_ERROR;
-	}
-	Tcl_Free(arrayPtr->psPtr), arrayPtr->psPtr = NULL;
-	arrayPtr->psPtr = NULL;
-    }
-    return TCL_OK;
-}
-
-static int
-DeleteArray(Tcl_Interp *interp, Array *arrayPtr)
+static Tcl_Obj *
+GetValue(
+	 Container *svObj)                      /* Shared object container */
 {
-    if (FlushArray(arrayPtr) == -1) {
-	return TCL_ERROR;
-    }
-    if (arrayPtr->psPtr) {
-	if (UnbindArray(interp, arrayPtr) != TCL_OK) {
-	    return TCL_ERROR;
-	};
-    }
-    if (arrayPtr->entryPtr) {
-	Tcl_DeleteHashEntry(arrayPtr->entryPtr);
+    if (svObj->repTypePtr) {
+	return svObj->repTypePtr->valueProc(svObj);
     }
 
-    Tcl_DeleteHashTable(&arrayPtr->vars);
-    Tcl_Free(arrayPtr);
-
-    return TCL_OK;
+    return Sv_DuplicateObj(svObj->tclObj);
 }
-
+
 /*
  *-----------------------------------------------------------------------------
  *
- * SvAllocateContainers --
+ * SvIsReadable --
  *
- *      Any similarity with the Tcl AllocateFreeObj function is purely
- *      coincidental... Just joking; this is (almost) 100% copy of it! :-)
+ *      Checks whether the shared object can be used by many readers at
+ *      the same time. This is true as long as reading the object does
+ *      not change it, i.e. does not generate a string rep or convert
+ *      it to another type.
  *
  * Results:
- *      None.
+ *      1 if the object may be used under the shared lock, 0 otherwise.
  *
  * Side effects:
- *      Allocates memory for many containers at the same time
+ *      None.
  *
  *-----------------------------------------------------------------------------
  */
 
-static void
-SvAllocateContainers(Bucket *bucketPtr)
+static int
+SvIsReadable(
+	     Container *svObj,                  /* Shared object container */
+	     int flags)                         /* FLAGS_READONLY/LISTREP/DICTREP */
 {
-    Container tmp[2];
-    size_t objSizePlusPadding = (size_t)(((char*)(tmp+1))-(char*)tmp);
-    size_t bytesToAlloc = (OBJS_TO_ALLOC_EACH_TIME * objSizePlusPadding);
-    char *basePtr;
-    Container *prevPtr = NULL, *objPtr = NULL;
-    int i;
+    Tcl_Obj *objPtr = svObj->tclObj;
+    RegType *regPtr;
 
-    basePtr = (char *)Tcl_Alloc(bytesToAlloc);
-    memset(basePtr, 0, bytesToAlloc);
+    if (svObj->repTypePtr) {
+	return 1; /* Read through GetValue */
+    }
+    if (flags & FLAGS_LISTREP) {
+	return objPtr->typePtr == listObjTypePtr;
+    }
+    if (flags & FLAGS_DICTREP) {
+	return objPtr->typePtr == dictObjTypePtr;
+    }
 
-    objPtr = (Container*)basePtr;
-    objPtr->chunkAddr = basePtr; /* Mark chunk address for reclaim */
+    /*
+     * Sv_DuplicateObj only ever generates the string rep of object
+     * types without custom duplicators; all others are only read.
+     */
 
-    for (i = 0; i < OBJS_TO_ALLOC_EACH_TIME; i++) {
-	objPtr->nextPtr = prevPtr;
-	prevPtr = objPtr;
-	objPtr = (Container*)(((char*)objPtr) + objSizePlusPadding);
+    if (objPtr->bytes != NULL || objPtr->typePtr == NULL
+	    || objPtr->typePtr->dupIntRepProc == NULL
+	    || objPtr->typePtr == booleanObjTypePtr
+	    || objPtr->typePtr == byteArrayObjTypePtr
+	    || objPtr->typePtr == doubleObjTypePtr
+	    || objPtr->typePtr == intObjTypePtr
+	    || objPtr->typePtr == wideIntObjTypePtr
+	    || objPtr->typePtr == stringObjTypePtr) {
+	return 1;
+    }
+    for (regPtr = regType; regPtr; regPtr = regPtr->nextPtr) {
+	if (objPtr->typePtr == regPtr->typePtr) {
+	    return 1;
+	}
     }
-    bucketPtr->freeCt = prevPtr;
+
+    return 0;
 }
-
-#ifdef SV_FINALIZE
+
 /*
  *-----------------------------------------------------------------------------
  *
- * SvFinalizeContainers --
+ * GetPsStore --
  *
- *    Reclaim memory for free object containers per bucket.
+ *      Performs a lookup in the list of registered persistent storage
+ *      handlers. If the match is found, duplicates the persistent
+ *      storage record and passes the copy to the caller.
  *
  * Results:
- *    None.
+ *      Pointer to the newly allocated persistent storage handler. Caller
+ *      must free this block when done with it. If none found, returns NULL,
  *
- * Side effects:
- *    Memory gets reclaimed
+ * Side effects;
+ *      Memory gets allocated. Caller should free the return value of this
+ *      function using Tcl_Free().
  *
  *-----------------------------------------------------------------------------
  */
 
-static void
-SvFinalizeContainers(Bucket *bucketPtr)
+static PsStore*
+GetPsStore(const char *handle)
 {
-   Container *tmpPtr, *objPtr = bucketPtr->freeCt;
+    size_t i;
+    const char *type = handle;
+    char *addr, *delimiter = (char *)strchr(handle, ':');
+    PsStore *tmpPtr, *psPtr = NULL;
 
-    while (objPtr) {
-	if (objPtr->chunkAddr == (char*)objPtr) {
-	    tmpPtr = objPtr->nextPtr;
-	    Tcl_Free(objPtr);
-	    objPtr = tmpPtr;
-	} else {
-	    objPtr = objPtr->nextPtr;
+    /*
+     * Expect the handle in the following format: <type>:<address>
+     * where "type" must match one of the registered presistent store
+     * types (gdbm, tcl, whatever) and <address> is what is passed to
+     * the open procedure of the registered store.
+     *
+     * Example: gdbm:/path/to/gdbm/file
+     */
+
+    /*
+     * Try to see wether some array is already bound to the
+     * same persistent storage address.
+     */
+
+    for (i = 0; i < numBuckets; i++) {
+	Tcl_HashSearch search;
+	Tcl_HashEntry *hPtr;
+	Bucket *bucketPtr = &buckets[i];
+	RLOCK_BUCKET(bucketPtr);
+	hPtr = Tcl_FirstHashEntry(&bucketPtr->arrays, &search);
+	while (hPtr) {
+	    Array *arrayPtr = (Array*)Tcl_GetHashValue(hPtr);
+	    if (arrayPtr->bindAddr && arrayPtr->psPtr) {
+		if (strcmp(arrayPtr->bindAddr, handle) == 0) {
+		    UNLOCK_BUCKET(bucketPtr);
+		    return NULL; /* Array already bound */
+		}
+	    }
+	    hPtr = Tcl_NextHashEntry(&search);
 	}
+	UNLOCK_BUCKET(bucketPtr);
     }
+
+    /*
+     * Split the address and storage handler
+     */
+
+    if (delimiter == NULL) {
+	addr = NULL;
+    } else {
+	*delimiter = 0;
+	addr = delimiter + 1;
+    }
+
+    /*
+     * No array was bound to the same persistent storage.
+     * Lookup the persistent storage to bind to.
+     */
+
+    Tcl_MutexLock(&svMutex);
+    for (tmpPtr = psStore; tmpPtr; tmpPtr = tmpPtr->nextPtr) {
+	if (strcmp(tmpPtr->type, type) == 0) {
+	    tmpPtr->psHandle = tmpPtr->psOpen(addr);
+	    if (tmpPtr->psHandle) {
+		psPtr = (PsStore *)Tcl_Alloc(sizeof(PsStore));
+		*psPtr = *tmpPtr;
+		psPtr->nextPtr = NULL;
+	    }
+	    break;
+	}
+    }
+    Tcl_MutexUnlock(&svMutex);
+
+    if (delimiter) {
+	*delimiter = ':';
+    }
+
+    return psPtr;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * AcquireContainer --
+ *
+ *      Finds a variable within an array and returns it's container.
+ *
+ * Results:
+ *      Pointer to variable object.
+ *
+ * Side effects;
+ *      New variable may be created. For bound arrays, try to locate
+ *      the key in the persistent storage as well. Expired variables
+ *      are deleted, unless the array is locked for reading only.
+ *      Existing variables are marked as used for the eviction policy.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Container *
+AcquireContainer(
+		 Array *arrayPtr,
+		 const char *key,
+		 int flags)
+{
+    int isNew;
+    Tcl_Obj *tclObj = NULL;
+    Tcl_HashEntry *hPtr = Tcl_FindHashEntry(&arrayPtr->vars, key);
+
+    if (hPtr != NULL && SV_EXPIRED((Container*)Tcl_GetHashValue(hPtr))) {
+	if (flags & FLAGS_READONLY) {
+	    return NULL;
+	}
+	DeleteContainer((Container*)Tcl_GetHashValue(hPtr));
+	hPtr = NULL;
+    }
+    if (hPtr == NULL) {
+	PsStore *psPtr = arrayPtr->psPtr;
+	if (psPtr) {
+	    char *val = NULL;
+	    Tcl_Size len = 0;
+	    if (psPtr->psGet(psPtr->psHandle, key, &val, &len) == 0) {
+		tclObj = Tcl_NewStringObj(val, len);
+		psPtr->psFree(psPtr->psHandle, val);
+	    }
+	}
+	if (!(flags & FLAGS_CREATEVAR) && tclObj == NULL) {
+	    return NULL;
+	}
+	if (tclObj == NULL) {
+	    tclObj = Tcl_NewObj();
+	}
+	hPtr = Tcl_CreateHashEntry(&arrayPtr->vars, key, &isNew);
+	Tcl_SetHashValue(hPtr, CreateContainer(arrayPtr, hPtr, tclObj));
+    } else if (arrayPtr->policy != SV_EVICT_NONE) {
+	TouchContainer((Container*)Tcl_GetHashValue(hPtr));
+    }
+
+    return (Container*)Tcl_GetHashValue(hPtr);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * ReleaseContainer --
+ *
+ *      Does some post-processing on the used container. This is mostly
+ *      needed when the container has been modified and needs to be
+ *      saved in the bound persistent storage.
+ *
+ * Results:
+ *      A standard Tcl result
+ *
+ * Side effects:
+ *      Persistent storage, if bound, might be modified. Keys of arrays
+ *      with an eviction policy might be evicted.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+ReleaseContainer(
+		 Tcl_Interp *interp,
+		 Container *svObj,
+		 int mode)
+{
+    const PsStore *psPtr = svObj->arrayPtr->psPtr;
+
+    switch (mode) {
+    case SV_UNCHANGED: return TCL_OK;
+    case SV_ERROR:     return TCL_ERROR;
+    case SV_CHANGED:
+	svObj->epoch++;
+	CountValue(svObj, 0);
+	if (svObj->arrayPtr->policy != SV_EVICT_NONE) {
+	    AccountContainer(svObj, 1);
+	    EvictKeys(svObj->arrayPtr, svObj);
+	}
+	if (psPtr && PersistContainer(interp, svObj) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if (svObj->arrayPtr->watches) {
+	    NotifyWatches(svObj, "set");
+	}
+	if (SvAtomicGet(&svObj->bucketPtr->numWaiters)) {
+	    WakeWaiters(svObj->bucketPtr);
+	}
+	return TCL_OK;
+    }
+
+    return TCL_ERROR; /* Should never be reached */
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * PersistContainer --
+ *
+ *      Saves the value of the container in the persistent storage
+ *      its array is bound to.
+ *
+ * Results:
+ *      A standard Tcl result
+ *
+ * Side effects:
+ *      Persistent storage is modified.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+PersistContainer(
+		 Tcl_Interp *interp,
+		 Container *svObj)
+{
+    const PsStore *psPtr = svObj->arrayPtr->psPtr;
+    Tcl_Size len;
+    char *key, *val;
+
+    key = (char *)Tcl_GetHashKey(&svObj->arrayPtr->vars, svObj->entryPtr);
+    val = Tcl_GetStringFromObj(svObj->tclObj, &len);
+    if (psPtr->psPut(psPtr->psHandle, key, val, len) == -1) {
+	const char *err = psPtr->psError(psPtr->psHandle);
+	Tcl_SetObjResult(interp, Tcl_NewStringObj(err, TCL_INDEX_NONE));
+	return TCL_ERROR;
+    }
+
+    return TCL_OK;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * CreateContainer --
+ *
+ *      Creates new shared container holding Tcl object to be stored
+ *      in the shared array
+ *
+ * Results:
+ *      The container pointer.
+ *
+ * Side effects:
+ *      Memory gets allocated.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Container *
+CreateContainer(
+		Array *arrayPtr,
+		Tcl_HashEntry *entryPtr,
+		Tcl_Obj *tclObj)
+{
+    Container *svObj;
+
+    svObj = AllocContainer(arrayPtr->bucketPtr);
+    svObj->arrayPtr  = arrayPtr;
+    svObj->bucketPtr = arrayPtr->bucketPtr;
+    svObj->tclObj    = tclObj;
+    svObj->entryPtr  = entryPtr;
+    svObj->handlePtr = NULL;
+    svObj->repTypePtr = NULL;
+    svObj->repPtr    = NULL;
+    svObj->epoch     = 1;
+    svObj->expires   = 0;
+    svObj->ttlIndex  = -1;
+    svObj->size      = 0;
+    svObj->referenced = 0;
+    svObj->strBytes  = 0;
+    svObj->repBytes  = 0;
+
+    LruLink(arrayPtr, svObj);
+    if (svObj->tclObj) {
+	Tcl_IncrRefCount(svObj->tclObj);
+    }
+    arrayPtr->keyBytes += KEY_LENGTH(svObj);
+    if (arrayPtr->indexPtr) {
+	Sv_IndexInsert(arrayPtr->indexPtr,
+		(char *)Tcl_GetHashKey(&arrayPtr->vars, entryPtr), svObj);
+    }
+    CountValue(svObj, 0);
+    if (arrayPtr->ttl) {
+	SetExpiry(svObj, SvNow() + arrayPtr->ttl);
+    }
+
+    return svObj;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * DeleteContainer --
+ *
+ *      Destroys the container and the Tcl object within it. For bound
+ *      shared arrays, the underlying persistent store is updated as well.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Memory gets reclaimed. If the shared array was bound to persistent
+ *      storage, it removes the corresponding record.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+DeleteContainer(
+		Container *svObj)
+{
+    if (svObj->ttlIndex >= 0) {
+	TtlHeapRemove(svObj);
+    }
+    if (svObj->arrayPtr) {
+	AccountContainer(svObj, 0);
+	LruUnlink(svObj->arrayPtr, svObj);
+	CountValue(svObj, 1);
+	if (svObj->entryPtr) {
+	    svObj->arrayPtr->keyBytes -= KEY_LENGTH(svObj);
+	}
+    }
+    if (svObj->repTypePtr) {
+	svObj->repTypePtr->freeProc(svObj);
+	svObj->repTypePtr = NULL;
+	svObj->repPtr = NULL;
+    }
+    if (svObj->tclObj) {
+	Tcl_DecrRefCount(svObj->tclObj);
+    }
+    if (svObj->handlePtr) {
+	Tcl_DeleteHashEntry(svObj->handlePtr);
+    }
+    if (svObj->entryPtr) {
+	PsStore *psPtr = svObj->arrayPtr->psPtr;
+	if (svObj->arrayPtr->watches) {
+	    NotifyWatches(svObj, "unset");
+	}
+	if (psPtr) {
+	    char *key = (char *)Tcl_GetHashKey(&svObj->arrayPtr->vars,svObj->entryPtr);
+	    if (psPtr->psDelete(psPtr->psHandle, key) == -1) {
+		return TCL_ERROR;
+	    }
+	}
+	if (svObj->arrayPtr->indexPtr) {
+	    Sv_IndexRemove(svObj->arrayPtr->indexPtr, (char *)Tcl_GetHashKey(
+		    &svObj->arrayPtr->vars, svObj->entryPtr));
+	}
+	Tcl_DeleteHashEntry(svObj->entryPtr);
+    }
+
+    svObj->arrayPtr  = NULL;
+    svObj->entryPtr  = NULL;
+    svObj->handlePtr = NULL;
+    svObj->tclObj    = NULL;
+
+    FreeContainer(svObj);
+
+    return TCL_OK;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * FindArray --
+ *
+ *      Find (or create) the array structure for shared array in the
+ *      given bucket and lock the bucket. Shards of a sharded array are
+ *      not locked.
+ *
+ * Results:
+ *      Pointer to the array or NULL if no such array.
+ *
+ * Side effects:
+ *      Bucket is left locked if the array was found. Otherwise leaves
+ *      the error message in the given interp, unless told not to.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Array *
+FindArray(
+	  Tcl_Interp *interp,                 /* Interpreter to leave result. */
+	  Bucket *bucketPtr,                  /* Bucket of the array */
+	  const char *array,                  /* Name of array to lock */
+	  int flags)                          /* FLAGS_CREATEARRAY/NOERRMSG/READONLY */
+{
+    Array *arrayPtr;
+
+    while (1) {
+	if (flags & FLAGS_CREATEARRAY) {
+	    LOCK_BUCKET(bucketPtr); /* Note: no matching unlock below ! */
+	    arrayPtr = CreateArray(bucketPtr, array);
+	} else {
+	    Tcl_HashEntry *hPtr;
+	    Sv_LockBucket(bucketPtr, flags & FLAGS_READONLY);
+	    hPtr = Tcl_FindHashEntry(&bucketPtr->arrays, array);
+	    if (hPtr == NULL) {
+		UNLOCK_BUCKET(bucketPtr);
+		if (!(flags & FLAGS_NOERRMSG)) {
+		    Tcl_AppendResult(interp, "\"", array,
+				     "\" is not a thread shared array", (void *)NULL);
+		}
+		return NULL;
+	    }
+	    arrayPtr = (Array*)Tcl_GetHashValue(hPtr);
+	    if ((flags & FLAGS_READONLY)
+		    && (arrayPtr->psPtr || arrayPtr->policy == SV_EVICT_LRU)) {
+
+		/*
+		 * Readers of bound arrays may load keys from the
+		 * persistent store and readers of LRU arrays reorder
+		 * the keys, so they need the exclusive lock.
+		 */
+
+		UNLOCK_BUCKET(bucketPtr);
+		flags &= ~FLAGS_READONLY;
+		continue;
+	    }
+	}
+	break;
+    }
+
+    return arrayPtr;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * LockArray --
+ *
+ *      Find (or create) the array structure for shared array and lock it.
+ *      For sharded arrays, all shards are locked as well. Array structure
+ *      must be later unlocked with UnlockArray.
+ *
+ * Results:
+ *      Pointer to the array or NULL if no such array.
+ *
+ * Side effects:
+ *      Leaves the error message in the given interp if no array found,
+ *      unless told not to.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Array *
+LockArray(
+	  Tcl_Interp *interp,                 /* Interpreter to leave result. */
+	  const char *array,                  /* Name of array to lock */
+	  int flags)                          /* FLAGS_CREATEARRAY/NOERRMSG/READONLY */
+{
+    Bucket *bucketPtr;
+    Array *arrayPtr;
+    Tcl_HashEntry *hPtr;
+    size_t shardId;
+    int numShards;
+
+    /*
+     * Compute a hash to map an array to a bucket.
+     */
+
+    bucketPtr = &buckets[SvHashString(array) & (numBuckets - 1)];
+
+    while (1) {
+	arrayPtr = FindArray(interp, bucketPtr, array, flags);
+	if (arrayPtr == NULL || arrayPtr->numShards == 0) {
+	    return arrayPtr;
+	}
+
+	/*
+	 * Buckets of a sharded array must be locked in the bucket
+	 * order, so let the array go and lock all of them at once.
+	 * Then make sure the array has not been replaced meanwhile.
+	 */
+
+	shardId   = arrayPtr->shardId;
+	numShards = arrayPtr->numShards;
+	if (SV_LRU_WRITE(arrayPtr, flags)) {
+	    flags &= ~FLAGS_READONLY;
+	}
+	UNLOCK_BUCKET(bucketPtr);
+
+	LockShards(bucketPtr, numShards, flags & FLAGS_READONLY);
+	hPtr = Tcl_FindHashEntry(&bucketPtr->arrays, array);
+	if (hPtr != NULL) {
+	    arrayPtr = (Array*)Tcl_GetHashValue(hPtr);
+	    if (arrayPtr->shardId == shardId) {
+		return arrayPtr;
+	    }
+	}
+	UnlockShards(bucketPtr, numShards);
+    }
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * LockShard --
+ *
+ *      Find (or create) the array structure for shared array and lock
+ *      the part of it holding the given key. For plain arrays this is
+ *      the array itself, for sharded arrays the shard of the key. Only
+ *      the bucket of that part is locked, so operations on keys living
+ *      in different shards can run in parallel. Without a key, the
+ *      shard is chosen by its number instead.
+ *
+ * Results:
+ *      Pointer to the array or shard, NULL if no such array. The number
+ *      of shards, 1 for plain arrays, is stored if asked for.
+ *
+ * Side effects:
+ *      Leaves the error message in the given interp if no array found,
+ *      unless told not to.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Array *
+LockShard(
+	  Tcl_Interp *interp,                 /* Interpreter to leave result. */
+	  const char *array,                  /* Name of array to lock */
+	  const char *key,                    /* Key to locate the shard, or NULL */
+	  int shard,                          /* Shard to lock if no key */
+	  int *numShardsPtr,                  /* Gets the number of shards */
+	  int flags)                          /* FLAGS_CREATEARRAY/NOERRMSG/READONLY */
+{
+    Bucket *bucketPtr, *shardBucketPtr;
+    Array *arrayPtr;
+    Tcl_HashEntry *hPtr;
+    size_t shardId;
+
+    bucketPtr = &buckets[SvHashString(array) & (numBuckets - 1)];
+
+    while (1) {
+	arrayPtr = FindArray(interp, bucketPtr, array, flags);
+	if (numShardsPtr && arrayPtr) {
+	    *numShardsPtr = SHARD_COUNT(arrayPtr);
+	}
+	if (arrayPtr == NULL || arrayPtr->numShards == 0) {
+	    return arrayPtr;
+	}
+	if (key) {
+	    shard = (int)(SvHashString(key) % (unsigned int)arrayPtr->numShards);
+	} else {
+	    shard %= arrayPtr->numShards;
+	}
+
+	/*
+	 * Never hold two bucket locks at once; locate the shard by
+	 * name in its own bucket instead and check that it still
+	 * belongs to the same array.
+	 */
+
+	shardId = arrayPtr->shardId;
+	shardBucketPtr = SHARD_BUCKET(bucketPtr, shard);
+	if (SV_LRU_WRITE(arrayPtr, flags)) {
+	    flags &= ~FLAGS_READONLY;
+	}
+	UNLOCK_BUCKET(bucketPtr);
+
+	Sv_LockBucket(shardBucketPtr, flags & FLAGS_READONLY);
+	hPtr = Tcl_FindHashEntry(&shardBucketPtr->shards, array);
+	if (hPtr != NULL) {
+	    arrayPtr = (Array*)Tcl_GetHashValue(hPtr);
+	    if (arrayPtr->shardId == shardId) {
+		return arrayPtr;
+	    }
+	}
+	UNLOCK_BUCKET(shardBucketPtr);
+    }
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * GetShard --
+ *
+ *      Returns the shard of the locked array holding the given key.
+ *
+ * Results:
+ *      Pointer to the shard or the array itself, if not sharded.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Array *
+GetShard(
+	 Array *arrayPtr,                     /* Array locked with LockArray */
+	 const char *key)                     /* Key to locate the shard */
+{
+    if (arrayPtr->numShards == 0) {
+	return arrayPtr;
+    }
+
+    return arrayPtr->shards[SvHashString(key) % (unsigned int)arrayPtr->numShards];
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * UnlockArray --
+ *
+ *      Unlocks the array locked with LockArray or the array part
+ *      locked with LockShard.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Array buckets are unlocked.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+UnlockArray(
+	    Array *arrayPtr)                  /* Array to unlock */
+{
+    UnlockShards(arrayPtr->bucketPtr, arrayPtr->numShards);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * LockShards --
+ *
+ *      Locks the bucket of a sharded array along with the buckets of
+ *      all of its shards. The buckets are always locked in the order
+ *      of their index, so that two threads locking overlapping sets
+ *      of buckets can not deadlock.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Buckets are locked.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+LockShards(
+	   Bucket *bucketPtr,                 /* Bucket of the array */
+	   int numShards,                     /* Number of array shards */
+	   int readonly)                      /* Take the shared locks */
+{
+    size_t i, first = (size_t)(bucketPtr - buckets);
+    size_t last = first + (size_t)numShards;
+
+    if (last >= numBuckets) {
+	for (i = 0; i <= last - numBuckets; i++) {
+	    Sv_LockBucket(&buckets[i], readonly);
+	}
+	last = numBuckets - 1;
+    }
+    for (i = first; i <= last; i++) {
+	Sv_LockBucket(&buckets[i], readonly);
+    }
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * UnlockShards --
+ *
+ *      Unlocks the buckets locked with LockShards.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Buckets are unlocked.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+UnlockShards(
+	     Bucket *bucketPtr,               /* Bucket of the array */
+	     int numShards)                   /* Number of array shards */
+{
+    int i;
+
+    for (i = numShards - 1; i >= 0; i--) {
+	UNLOCK_BUCKET(SHARD_BUCKET(bucketPtr, i));
+    }
+    UNLOCK_BUCKET(bucketPtr);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * FlushArray --
+ *
+ *      Unset all keys in an array.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Array is cleaned but it's variable hash-hable still lives.
+ *      For bound arrays, the persistent store is updated accordingly.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+FlushArray(Array *arrayPtr)                    /* Name of array to flush */
+{
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+    int i;
+
+    for (i = 0; i < arrayPtr->numShards; i++) {
+	if (FlushArray(arrayPtr->shards[i]) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+    }
+    for (hPtr = Tcl_FirstHashEntry(&arrayPtr->vars, &search); hPtr;
+	 hPtr = Tcl_NextHashEntry(&search)) {
+	if (DeleteContainer((Container*)Tcl_GetHashValue(hPtr)) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+    }
+
+    return TCL_OK;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * NewArray --
+ *
+ *      Allocates and initializes new array structure and stores it
+ *      in the given hash table entry.
+ *
+ * Results:
+ *      Pointer to the newly created array
+ *
+ * Side effects:
+ *      Memory gets allocated
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Array *
+NewArray(
+	 Bucket *bucketPtr,
+	 Tcl_HashEntry *hPtr)
+{
+    Array *arrayPtr = (Array *)Tcl_Alloc(sizeof(Array));
+
+    arrayPtr->bucketPtr = bucketPtr;
+    arrayPtr->entryPtr  = hPtr;
+    arrayPtr->psPtr     = NULL;
+    arrayPtr->bindAddr  = NULL;
+    arrayPtr->ttl       = 0;
+    arrayPtr->policy    = SV_EVICT_NONE;
+    arrayPtr->maxKeys   = 0;
+    arrayPtr->maxBytes  = 0;
+    arrayPtr->numBytes  = 0;
+    arrayPtr->lruHead   = NULL;
+    arrayPtr->lruTail   = NULL;
+    arrayPtr->keyBytes  = 0;
+    arrayPtr->stringBytes = 0;
+    arrayPtr->repBytes  = 0;
+    arrayPtr->watches   = NULL;
+    arrayPtr->numShards = 0;
+    arrayPtr->shardId   = 0;
+    arrayPtr->shards    = NULL;
+    arrayPtr->indexPtr  = NULL;
+
+    Tcl_InitHashTable(&arrayPtr->vars, TCL_STRING_KEYS);
+    Tcl_SetHashValue(hPtr, arrayPtr);
+
+    return arrayPtr;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * CreateArray --
+ *
+ *      Creates new shared array instance.
+ *
+ * Results:
+ *      Pointer to the newly created array
+ *
+ * Side effects:
+ *      Memory gets allocated. Watches waiting for the array are
+ *      attached to it.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Array *
+CreateArray(
+	    Bucket *bucketPtr,
+	    const char *arrayName)
+{
+    int isNew;
+    Tcl_HashEntry *hPtr;
+    Array *arrayPtr;
+
+    hPtr = Tcl_CreateHashEntry(&bucketPtr->arrays, arrayName, &isNew);
+    if (!isNew) {
+	return (Array*)Tcl_GetHashValue(hPtr);
+    }
+    arrayPtr = NewArray(bucketPtr, hPtr);
+    AttachWatches(arrayPtr, arrayName);
+    if (SvAtomicGet(&bucketPtr->numWaiters)) {
+	WakeWaiters(bucketPtr);
+    }
+
+    return arrayPtr;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * CreateShardedArray --
+ *
+ *      Creates new shared array instance whose keys are spread over the
+ *      given number of shards. Each shard lives in its own bucket, so
+ *      threads working on keys in different shards do not contend for
+ *      the same lock.
+ *
+ * Results:
+ *      Pointer to the newly created array, locked as with LockArray,
+ *      or NULL if the array already exists.
+ *
+ * Side effects:
+ *      Memory gets allocated. Watches waiting for the array are
+ *      attached to it.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Array *
+CreateShardedArray(
+		   Bucket *bucketPtr,
+		   const char *arrayName,
+		   int numShards)
+{
+    int i, isNew;
+    Array *arrayPtr;
+    Tcl_HashEntry *hPtr;
+
+    LockShards(bucketPtr, numShards, 0);
+
+    hPtr = Tcl_CreateHashEntry(&bucketPtr->arrays, arrayName, &isNew);
+    if (!isNew) {
+	UnlockShards(bucketPtr, numShards);
+	return NULL;
+    }
+    arrayPtr = NewArray(bucketPtr, hPtr);
+    if (SvAtomicGet(&bucketPtr->numWaiters)) {
+	WakeWaiters(bucketPtr);
+    }
+    if (numShards == 0) {
+	AttachWatches(arrayPtr, arrayName);
+	return arrayPtr;
+    }
+
+    Tcl_MutexLock(&svMutex);
+    arrayPtr->shardId = ++shardIds;
+    Tcl_MutexUnlock(&svMutex);
+
+    arrayPtr->numShards = numShards;
+    arrayPtr->shards = (Array **)Tcl_Alloc(numShards * sizeof(Array *));
+
+    for (i = 0; i < numShards; i++) {
+	Bucket *shardBucketPtr = SHARD_BUCKET(bucketPtr, i);
+	hPtr = Tcl_CreateHashEntry(&shardBucketPtr->shards, arrayName, &isNew);
+	arrayPtr->shards[i] = NewArray(shardBucketPtr, hPtr);
+	arrayPtr->shards[i]->shardId = arrayPtr->shardId;
+    }
+    AttachWatches(arrayPtr, arrayName);
+
+    return arrayPtr;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * DeleteArray --
+ *
+ *      Deletes the shared array.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      Memory gets reclaimed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+UnbindArray(Tcl_Interp *interp, Array *arrayPtr)
+{
+    PsStore *psPtr = arrayPtr->psPtr;
+    if (arrayPtr->bindAddr) {
+	Tcl_Free(arrayPtr->bindAddr);
+	arrayPtr->bindAddr = NULL;
+    }
+    if (psPtr) {
+	if (psPtr->psClose(psPtr->psHandle) == -1) {
+	    if (interp) {
+		const char *err = psPtr->psError(psPtr->psHandle);
+		Tcl_SetObjResult(interp, Tcl_NewStringObj(err, TCL_INDEX_NONE));
+	    }
+	    return TCL_ERROR;
+	}
+	Tcl_Free(arrayPtr->psPtr), arrayPtr->psPtr = NULL;
+	arrayPtr->psPtr = NULL;
+    }
+    return TCL_OK;
+}
+
+static int
+DeleteArray(Tcl_Interp *interp, Array *arrayPtr)
+{
+    if (arrayPtr->numShards == 0 && arrayPtr->policy != SV_EVICT_NONE) {
+	SvAtomicAdd(&numEvictArrays, -1);
+    }
+    while (arrayPtr->numShards > 0) {
+	if (DeleteArray(interp, arrayPtr->shards[--arrayPtr->numShards])
+		!= TCL_OK) {
+	    return TCL_ERROR;
+	}
+    }
+    if (arrayPtr->shards) {
+	Tcl_Free(arrayPtr->shards);
+	arrayPtr->shards = NULL;
+    }
+    if (FlushArray(arrayPtr) == -1) {
+	return TCL_ERROR;
+    }
+    if (arrayPtr->watches) {
+	ReleaseWatches(arrayPtr);
+    }
+    if (SvAtomicGet(&arrayPtr->bucketPtr->numWaiters)) {
+	WakeWaiters(arrayPtr->bucketPtr);
+    }
+    if (arrayPtr->psPtr) {
+	if (UnbindArray(interp, arrayPtr) != TCL_OK) {
+	    return TCL_ERROR;
+	};
+    }
+    if (arrayPtr->entryPtr) {
+	Tcl_DeleteHashEntry(arrayPtr->entryPtr);
+    }
+
+    if (arrayPtr->indexPtr) {
+	Sv_IndexFree(arrayPtr->indexPtr);
+    }
+    Tcl_DeleteHashTable(&arrayPtr->vars);
+    Tcl_Free(arrayPtr);
+
+    return TCL_OK;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvAllocateContainers --
+ *
+ *      Any similarity with the Tcl AllocateFreeObj function is purely
+ *      coincidental... Just joking; this is (almost) 100% copy of it! :-)
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Allocates memory for a chunk of many containers at the same
+ *      time and adds it to the chunks of the bucket.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+SvAllocateContainers(Bucket *bucketPtr)
+{
+    size_t bytesToAlloc = sizeof(Chunk)
+	    + OBJS_TO_ALLOC_EACH_TIME * sizeof(Container);
+    Chunk *chunkPtr;
+    Container *prevPtr = NULL, *objPtr = NULL;
+    int i;
+
+    chunkPtr = (Chunk *)Tcl_Alloc(bytesToAlloc);
+    memset(chunkPtr, 0, bytesToAlloc);
+
+    objPtr = (Container*)(chunkPtr + 1);
+    for (i = 0; i < OBJS_TO_ALLOC_EACH_TIME; i++) {
+	objPtr->chunkPtr = chunkPtr;
+	objPtr->nextPtr = prevPtr;
+	prevPtr = objPtr++;
+    }
+    chunkPtr->bucketPtr = bucketPtr;
+    chunkPtr->freeCt = prevPtr;
+    chunkPtr->numFree = OBJS_TO_ALLOC_EACH_TIME;
+    chunkPtr->pinned = 0;
+    LinkChunk(chunkPtr, &bucketPtr->chunks);
+    bucketPtr->numContainers += OBJS_TO_ALLOC_EACH_TIME;
+    bucketPtr->numFree += OBJS_TO_ALLOC_EACH_TIME;
+    bucketPtr->numEmpty++;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * AllocContainer --
+ *
+ *      Takes a free container from the first chunk of the bucket
+ *      having one.
+ *
+ * Results:
+ *      The container.
+ *
+ * Side effects:
+ *      New chunk may be allocated. Chunks getting full are moved
+ *      to the list of full chunks of the bucket.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Container *
+AllocContainer(Bucket *bucketPtr)
+{
+    Chunk *chunkPtr = bucketPtr->chunks;
+    Container *svObj;
+
+    if (chunkPtr == NULL) {
+	SvAllocateContainers(bucketPtr);
+	chunkPtr = bucketPtr->chunks;
+    }
+    if (chunkPtr->numFree == OBJS_TO_ALLOC_EACH_TIME) {
+	bucketPtr->numEmpty--;
+    }
+
+    svObj = chunkPtr->freeCt;
+    chunkPtr->freeCt = svObj->nextPtr;
+    chunkPtr->numFree--;
+    bucketPtr->numFree--;
+
+    if (chunkPtr->numFree == 0) {
+	UnlinkChunk(chunkPtr, &bucketPtr->chunks);
+	LinkChunk(chunkPtr, &bucketPtr->fullChunks);
+    }
+
+    return svObj;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * FreeContainer --
+ *
+ *      Puts the container back into its chunk. A chunk no longer full
+ *      is moved back to the chunks with free containers. A chunk no
+ *      longer used is freed, unless it is the only empty chunk of the
+ *      bucket, which is kept to absorb keys coming and going, or it is
+ *      pinned by tsv::object handles.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Memory of the chunk may be freed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+FreeContainer(Container *svObj)
+{
+    Chunk *chunkPtr = svObj->chunkPtr;
+    Bucket *bucketPtr = chunkPtr->bucketPtr;
+
+    svObj->nextPtr = chunkPtr->freeCt;
+    chunkPtr->freeCt = svObj;
+    chunkPtr->numFree++;
+    bucketPtr->numFree++;
+
+    if (chunkPtr->numFree == 1) {
+	UnlinkChunk(chunkPtr, &bucketPtr->fullChunks);
+	LinkChunk(chunkPtr, &bucketPtr->chunks);
+    } else if (chunkPtr->numFree == OBJS_TO_ALLOC_EACH_TIME) {
+	if (bucketPtr->numEmpty > 0 && !chunkPtr->pinned) {
+	    FreeChunk(chunkPtr);
+	} else {
+	    bucketPtr->numEmpty++;
+	}
+    }
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * LinkChunk, UnlinkChunk --
+ *
+ *      Puts the chunk first in the given list of chunks of its bucket,
+ *      or takes it out of there.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      List of chunks is changed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+LinkChunk(Chunk *chunkPtr, Chunk **listPtr)
+{
+    chunkPtr->prevPtr = NULL;
+    chunkPtr->nextPtr = *listPtr;
+    if (*listPtr) {
+	(*listPtr)->prevPtr = chunkPtr;
+    }
+    *listPtr = chunkPtr;
+}
+
+static void
+UnlinkChunk(Chunk *chunkPtr, Chunk **listPtr)
+{
+    if (chunkPtr->prevPtr) {
+	chunkPtr->prevPtr->nextPtr = chunkPtr->nextPtr;
+    } else {
+	*listPtr = chunkPtr->nextPtr;
+    }
+    if (chunkPtr->nextPtr) {
+	chunkPtr->nextPtr->prevPtr = chunkPtr->prevPtr;
+    }
+    chunkPtr->prevPtr = chunkPtr->nextPtr = NULL;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * FreeChunk --
+ *
+ *      Releases the memory of a chunk of containers, which must not
+ *      be in use anymore.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Memory gets reclaimed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+FreeChunk(Chunk *chunkPtr)
+{
+    Bucket *bucketPtr = chunkPtr->bucketPtr;
+
+    UnlinkChunk(chunkPtr, chunkPtr->numFree ? &bucketPtr->chunks
+	    : &bucketPtr->fullChunks);
+    bucketPtr->numContainers -= OBJS_TO_ALLOC_EACH_TIME;
+    bucketPtr->numFree -= chunkPtr->numFree;
+    Tcl_Free(chunkPtr);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * CompactBucket --
+ *
+ *      Releases memory the bucket holds on to after many keys have been
+ *      deleted: empty chunks of containers, the unused part of the heap
+ *      of expiry times and sparse hash tables of arrays in the bucket.
+ *      The bucket must be locked exclusively.
+ *
+ * Results:
+ *      Approximate number of bytes released.
+ *
+ * Side effects:
+ *      Memory gets reclaimed. Hash entries of keys are recreated.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Tcl_WideInt
+CompactBucket(Bucket *bucketPtr)
+{
+    Tcl_WideInt released = 0;
+    Chunk *chunkPtr, *nextPtr;
+    Tcl_HashTable *tablePtr, tmpTable;
+    Tcl_HashSearch search, varSearch;
+    Tcl_HashEntry *hPtr, *varPtr, *newPtr;
+    Container *svObj;
+    Tcl_Size size;
+    int isNew, i;
+
+    bucketPtr->numEmpty = 0;
+    for (chunkPtr = bucketPtr->chunks; chunkPtr; chunkPtr = nextPtr) {
+	nextPtr = chunkPtr->nextPtr;
+	if (chunkPtr->numFree != OBJS_TO_ALLOC_EACH_TIME) {
+	    continue;
+	}
+	if (chunkPtr->pinned) {
+	    bucketPtr->numEmpty++;
+	} else {
+	    FreeChunk(chunkPtr);
+	    released += sizeof(Chunk) + OBJS_TO_ALLOC_EACH_TIME * sizeof(Container);
+	}
+    }
+
+    if (bucketPtr->ttlSize > 16 && bucketPtr->ttlCount < bucketPtr->ttlSize / 4) {
+	size = bucketPtr->ttlCount < 8 ? 16 : 2 * bucketPtr->ttlCount;
+	released += (bucketPtr->ttlSize - size) * sizeof(Container *);
+	bucketPtr->ttlSize = size;
+	bucketPtr->ttlHeap = (Container **)Tcl_Realloc(bucketPtr->ttlHeap,
+		bucketPtr->ttlSize * sizeof(Container *));
+    }
+
+    /*
+     * Tcl hash tables never shrink, so rebuild the tables of keys far
+     * sparser than Tcl would make them. Tables can not be copied, so
+     * the keys are moved out and back in again.
+     */
+
+    for (i = 0; i < 2; i++) {
+	tablePtr = i ? &bucketPtr->shards : &bucketPtr->arrays;
+	for (hPtr = Tcl_FirstHashEntry(tablePtr, &search); hPtr;
+		hPtr = Tcl_NextHashEntry(&search)) {
+	    Array *arrayPtr = (Array *)Tcl_GetHashValue(hPtr);
+	    Tcl_HashTable *varsPtr = &arrayPtr->vars;
+
+	    if (varsPtr->numBuckets <= TCL_SMALL_HASH_TABLE
+		    || varsPtr->numEntries >= varsPtr->numBuckets / 4) {
+		continue;
+	    }
+	    size = varsPtr->numBuckets;
+	    Tcl_InitHashTable(&tmpTable, TCL_STRING_KEYS);
+	    for (varPtr = Tcl_FirstHashEntry(varsPtr, &varSearch); varPtr;
+		    varPtr = Tcl_NextHashEntry(&varSearch)) {
+		newPtr = Tcl_CreateHashEntry(&tmpTable,
+			Tcl_GetHashKey(varsPtr, varPtr), &isNew);
+		Tcl_SetHashValue(newPtr, Tcl_GetHashValue(varPtr));
+	    }
+	    Tcl_DeleteHashTable(varsPtr);
+	    Tcl_InitHashTable(varsPtr, TCL_STRING_KEYS);
+	    for (varPtr = Tcl_FirstHashEntry(&tmpTable, &varSearch); varPtr;
+		    varPtr = Tcl_NextHashEntry(&varSearch)) {
+		svObj = (Container *)Tcl_GetHashValue(varPtr);
+		svObj->entryPtr = Tcl_CreateHashEntry(varsPtr,
+			Tcl_GetHashKey(&tmpTable, varPtr), &isNew);
+		Tcl_SetHashValue(svObj->entryPtr, svObj);
+	    }
+	    Tcl_DeleteHashTable(&tmpTable);
+	    released += (size - varsPtr->numBuckets) * sizeof(Tcl_HashEntry *);
+	}
+    }
+
+    return released;
+}
+
+#ifdef SV_FINALIZE
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvFinalizeContainers --
+ *
+ *    Reclaim memory for object containers per bucket.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Memory gets reclaimed
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+SvFinalizeContainers(Bucket *bucketPtr)
+{
+    while (bucketPtr->chunks) {
+	FreeChunk(bucketPtr->chunks);
+    }
+    while (bucketPtr->fullChunks) {
+	FreeChunk(bucketPtr->fullChunks);
+    }
+    bucketPtr->numEmpty = 0;
+}
+#endif /* SV_FINALIZE */
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvNow --
+ *
+ *      Returns the current time in milliseconds, as used for the
+ *      expiry times of shared objects.
+ *
+ * Results:
+ *      Current time in milliseconds.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Tcl_WideInt
+SvNow(void)
+{
+    Tcl_Time now;
+
+    Tcl_GetTime(&now);
+
+    return (Tcl_WideInt)now.sec * 1000 + now.usec / 1000;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SetExpiry --
+ *
+ *      Sets the expiry time of the shared object. Objects with expiry
+ *      time are kept in a min-heap of their bucket, ordered by the
+ *      time, where the reaper thread finds them. The container must be
+ *      locked for writing.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The bucket heap is updated, the reaper thread may be started.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+SetExpiry(
+	  Container *svObj,                   /* Shared object container */
+	  Tcl_WideInt expires)                /* Time in ms, 0 for none */
+{
+    Bucket *bucketPtr = svObj->bucketPtr;
+
+    if (expires == 0) {
+	if (svObj->ttlIndex >= 0) {
+	    TtlHeapRemove(svObj);
+	}
+	svObj->expires = 0;
+	return;
+    }
+
+    if (svObj->ttlIndex < 0) {
+	if (bucketPtr->ttlCount == bucketPtr->ttlSize) {
+	    bucketPtr->ttlSize = bucketPtr->ttlSize ? 2 * bucketPtr->ttlSize : 16;
+	    bucketPtr->ttlHeap = (Container **)Tcl_Realloc(bucketPtr->ttlHeap,
+		    bucketPtr->ttlSize * sizeof(Container *));
+	}
+	svObj->ttlIndex = bucketPtr->ttlCount++;
+	bucketPtr->ttlHeap[svObj->ttlIndex] = svObj;
+    }
+    svObj->expires = expires;
+    TtlHeapUp(bucketPtr, svObj->ttlIndex);
+    TtlHeapDown(bucketPtr, svObj->ttlIndex);
+
+    if (reaperState == REAPER_IDLE) {
+	StartReaper();
+    }
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * ResetExpiry --
+ *
+ *      Sets the expiry time of the shared object which has just been
+ *      given a new value to the default of its array.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      See SetExpiry.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+ResetExpiry(
+	    Container *svObj)                 /* Shared object container */
+{
+    Tcl_WideInt ttl = svObj->arrayPtr->ttl;
+
+    if (ttl || svObj->expires) {
+	SetExpiry(svObj, ttl ? SvNow() + ttl : 0);
+    }
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TtlHeapUp, TtlHeapDown, TtlHeapRemove --
+ *
+ *      Maintain the heap of the shared objects with expiry time.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Containers are moved within the heap.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TtlHeapUp(
+	  Bucket *bucketPtr,
+	  Tcl_Size i)
+{
+    Container **heap = bucketPtr->ttlHeap, *svObj = heap[i];
+
+    while (i > 0) {
+	Tcl_Size parent = (i - 1) / 2;
+	if (heap[parent]->expires <= svObj->expires) {
+	    break;
+	}
+	heap[i] = heap[parent];
+	heap[i]->ttlIndex = i;
+	i = parent;
+    }
+    heap[i] = svObj;
+    svObj->ttlIndex = i;
+}
+
+static void
+TtlHeapDown(
+	    Bucket *bucketPtr,
+	    Tcl_Size i)
+{
+    Container **heap = bucketPtr->ttlHeap, *svObj = heap[i];
+    Tcl_Size child, count = bucketPtr->ttlCount;
+
+    while ((child = 2 * i + 1) < count) {
+	if (child + 1 < count && heap[child + 1]->expires < heap[child]->expires) {
+	    child++;
+	}
+	if (svObj->expires <= heap[child]->expires) {
+	    break;
+	}
+	heap[i] = heap[child];
+	heap[i]->ttlIndex = i;
+	i = child;
+    }
+    heap[i] = svObj;
+    svObj->ttlIndex = i;
+}
+
+static void
+TtlHeapRemove(
+	      Container *svObj)
+{
+    Bucket *bucketPtr = svObj->bucketPtr;
+    Tcl_Size i = svObj->ttlIndex;
+    Container *lastPtr = bucketPtr->ttlHeap[--bucketPtr->ttlCount];
+
+    svObj->ttlIndex = -1;
+    if (lastPtr != svObj) {
+	bucketPtr->ttlHeap[i] = lastPtr;
+	lastPtr->ttlIndex = i;
+	TtlHeapUp(bucketPtr, i);
+	TtlHeapDown(bucketPtr, lastPtr->ttlIndex);
+    }
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * StartReaper --
+ *
+ *      Starts the reaper thread, unless already running.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      New thread may be created.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+StartReaper(void)
+{
+    Tcl_MutexLock(&reaperMutex);
+    if (reaperState == REAPER_IDLE) {
+	if (Tcl_CreateThread(&reaperId, ReaperThread, NULL,
+		TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) == TCL_OK) {
+	    reaperState = REAPER_RUNNING;
+	}
+    }
+    Tcl_MutexUnlock(&reaperMutex);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * ReaperThread --
+ *
+ *      Body of the thread deleting expired shared objects. It wakes up
+ *      every REAPER_INTERVAL milliseconds and walks all buckets. Each
+ *      bucket is locked for at most REAPER_BATCH deletions at a time,
+ *      so other threads are never held up for long.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Expired shared objects are deleted.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Tcl_ThreadCreateType
+ReaperThread(
+	     TCL_UNUSED(void *))
+{
+    size_t i;
+    int n;
+    Tcl_WideInt now;
+    Tcl_Time wait;
+
+    wait.sec  = REAPER_INTERVAL / 1000;
+    wait.usec = (REAPER_INTERVAL % 1000) * 1000;
+
+    Tcl_MutexLock(&reaperMutex);
+    while (reaperState == REAPER_RUNNING) {
+	Tcl_ConditionWait(&reaperCond, &reaperMutex, &wait);
+	if (reaperState != REAPER_RUNNING) {
+	    break;
+	}
+	Tcl_MutexUnlock(&reaperMutex);
+
+	for (i = 0; i < numBuckets; i++) {
+	    Bucket *bucketPtr = &buckets[i];
+
+	    /*
+	     * Peek at the heap without the lock, to skip buckets which
+	     * have nothing to expire. This is checked again below.
+	     */
+
+	    if (bucketPtr->ttlCount == 0) {
+		continue;
+	    }
+	    do {
+		Sv_LockBucket(bucketPtr, 0);
+		now = SvNow();
+		for (n = 0; n < REAPER_BATCH && bucketPtr->ttlCount > 0
+			 && bucketPtr->ttlHeap[0]->expires <= now; n++) {
+		    DeleteContainer(bucketPtr->ttlHeap[0]);
+		}
+		Sv_UnlockBucket(bucketPtr);
+	    } while (n == REAPER_BATCH);
+	}
+
+	Tcl_MutexLock(&reaperMutex);
+    }
+    Tcl_MutexUnlock(&reaperMutex);
+
+    Tcl_ExitThread(0);
+
+    TCL_THREAD_CREATE_RETURN;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * LruLink, LruUnlink --
+ *
+ *      Append the container at the end of the eviction order of the
+ *      array, or take it out of there.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Eviction order of the array is changed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+LruLink(
+	Array *arrayPtr,
+	Container *svObj)
+{
+    svObj->lruNext = NULL;
+    svObj->lruPrev = arrayPtr->lruTail;
+    if (arrayPtr->lruTail) {
+	arrayPtr->lruTail->lruNext = svObj;
+    } else {
+	arrayPtr->lruHead = svObj;
+    }
+    arrayPtr->lruTail = svObj;
+}
+
+static void
+LruUnlink(
+	  Array *arrayPtr,
+	  Container *svObj)
+{
+    if (svObj->lruPrev) {
+	svObj->lruPrev->lruNext = svObj->lruNext;
+    } else {
+	arrayPtr->lruHead = svObj->lruNext;
+    }
+    if (svObj->lruNext) {
+	svObj->lruNext->lruPrev = svObj->lruPrev;
+    } else {
+	arrayPtr->lruTail = svObj->lruPrev;
+    }
+    svObj->lruPrev = svObj->lruNext = NULL;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TouchContainer --
+ *
+ *      Marks the container as used for the eviction policy of its
+ *      array. LRU moves the container to the end of the eviction
+ *      order and must be called with the bucket locked exclusively.
+ *      CLOCK only sets the referenced bit, which is safe to do with
+ *      the shared lock, as all readers store the same value.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Eviction order may be changed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TouchContainer(
+	       Container *svObj)
+{
+    Array *arrayPtr = svObj->arrayPtr;
+
+    if (arrayPtr->policy == SV_EVICT_LRU) {
+	if (arrayPtr->lruTail != svObj) {
+	    LruUnlink(arrayPtr, svObj);
+	    LruLink(arrayPtr, svObj);
+	}
+    } else if (!svObj->referenced) {
+	svObj->referenced = 1;
+    }
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvObjSize --
+ *
+ *      Estimates the memory used by the value of a shared object. This
+ *      is the length of the string representation, where available,
+ *      or the sum over the elements of lists and dicts. No string
+ *      representation is generated.
+ *
+ * Results:
+ *      Size of the object in bytes.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Tcl_Size
+SvObjSize(
+	  Tcl_Obj *objPtr)
+{
+    Tcl_Size i, objc, size = 0;
+    Tcl_Obj **objv, *keyPtr, *valuePtr;
+    Tcl_DictSearch search;
+    int done;
+
+    if (objPtr == NULL) {
+	return 0;
+    }
+    if (objPtr->typePtr == &frozenObjType) {
+	return FROZEN_VALUE(objPtr)->length;
+    }
+    if (objPtr->bytes != NULL) {
+	return objPtr->length;
+    }
+    if (objPtr->typePtr == listObjTypePtr) {
+	Tcl_ListObjGetElements(NULL, objPtr, &objc, &objv);
+	for (i = 0; i < objc; i++) {
+	    size += SvObjSize(objv[i]) + 1;
+	}
+    } else if (objPtr->typePtr == dictObjTypePtr) {
+	Tcl_DictObjFirst(NULL, objPtr, &search, &keyPtr, &valuePtr, &done);
+	for (; !done; Tcl_DictObjNext(&search, &keyPtr, &valuePtr, &done)) {
+	    size += SvObjSize(keyPtr) + SvObjSize(valuePtr) + 2;
+	}
+	Tcl_DictObjDone(&search);
+    } else {
+	size = sizeof(Tcl_WideInt);
+    }
+
+    return size;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * AccountContainer --
+ *
+ *      Updates the size of the container in the byte counters of its
+ *      array and the global one. The size is either recomputed, if the
+ *      array has an eviction policy, or dropped.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Byte counters are updated, alternative representation of the
+ *      object may be dropped.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+AccountContainer(
+		 Container *svObj,
+		 int recompute)
+{
+    Array *arrayPtr = svObj->arrayPtr;
+    Tcl_Size size = 0;
+
+    if (recompute && arrayPtr->policy != SV_EVICT_NONE) {
+
+	/*
+	 * Representations holding data of their own are not kept
+	 * with eviction, their size is only known from the object.
+	 */
+
+	if (svObj->repTypePtr && svObj->repTypePtr->sizeProc) {
+	    Sv_UpdateContainer(svObj);
+	    CountValue(svObj, 0);
+	}
+	size = SvObjSize(svObj->tclObj) + KEY_LENGTH(svObj);
+    }
+    if (size != svObj->size) {
+	arrayPtr->numBytes += size - svObj->size;
+	SvAtomicAdd(&globalBytes, size - svObj->size);
+	svObj->size = size;
+    }
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * EvictKeys --
+ *
+ *      Deletes keys of the array, in the order given by its eviction
+ *      policy, until the array is within its limits and either the
+ *      global budget is met or the array is down to its share of it.
+ *      The given container is never evicted.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Keys of the array may be deleted.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+EvictKeys(
+	  Array *arrayPtr,                    /* Array locked exclusively */
+	  Container *keepPtr)                 /* Container to keep, or NULL */
+{
+    Container *svObj;
+    Tcl_WideInt maxBytes = SvAtomicGet(&globalMaxBytes);
+    Tcl_WideInt numArrays = SvAtomicGet(&numEvictArrays), share;
+
+    /*
+     * Over the global budget, the array only gives up keys above its
+     * share, so that one array growing can not wipe out the others.
+     */
+
+    share = maxBytes / (numArrays > 0 ? numArrays : 1);
+    while (arrayPtr->policy != SV_EVICT_NONE) {
+	if (!(arrayPtr->maxKeys && arrayPtr->vars.numEntries > arrayPtr->maxKeys)
+		&& !(arrayPtr->maxBytes && arrayPtr->numBytes > arrayPtr->maxBytes)
+		&& !(maxBytes && arrayPtr->numBytes > share
+		     && SvAtomicGet(&globalBytes) > maxBytes)) {
+	    break;
+	}
+	svObj = arrayPtr->lruHead;
+	if (svObj == NULL || (svObj == keepPtr && svObj->lruNext == NULL)) {
+	    break;
+	}
+	if (svObj == keepPtr
+		|| (arrayPtr->policy == SV_EVICT_CLOCK && svObj->referenced)) {
+
+	    /*
+	     * Give the key a second chance at the end of the order.
+	     */
+
+	    svObj->referenced = 0;
+	    LruUnlink(arrayPtr, svObj);
+	    LruLink(arrayPtr, svObj);
+	    continue;
+	}
+	DeleteContainer(svObj);
+    }
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SetEviction --
+ *
+ *      Sets the eviction policy and the limits of an array or shard.
+ *      Sizes of existing keys are computed when a policy is set on
+ *      the array for the first time, and dropped when it is reset.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Keys above the new limits are evicted right away.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+SetEviction(
+	    Array *arrayPtr,                  /* Array locked exclusively */
+	    int policy,                       /* One of SV_EVICT_* */
+	    Tcl_WideInt maxKeys,              /* Limit of keys or 0 */
+	    Tcl_WideInt maxBytes)             /* Limit of bytes or 0 */
+{
+    Container *svObj;
+    int recompute = (arrayPtr->policy == SV_EVICT_NONE);
+
+    /*
+     * Sharded arrays keep their keys in the shards, which are counted
+     * on their own.
+     */
+
+    if (arrayPtr->numShards == 0 && recompute != (policy == SV_EVICT_NONE)) {
+	SvAtomicAdd(&numEvictArrays, recompute ? 1 : -1);
+    }
+    arrayPtr->policy   = policy;
+    arrayPtr->maxKeys  = maxKeys;
+    arrayPtr->maxBytes = maxBytes;
+
+    if (recompute || policy == SV_EVICT_NONE) {
+	for (svObj = arrayPtr->lruHead; svObj; svObj = svObj->lruNext) {
+	    AccountContainer(svObj, 1);
+	    svObj->referenced = 0;
+	}
+    }
+    EvictKeys(arrayPtr, NULL);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvObjRepSize --
+ *
+ *      Estimates the memory used by a shared object apart from its
+ *      string representation. Elements of lists and dicts are counted
+ *      by their object structures only, so the estimate is cheap to
+ *      compute whatever the size of the object.
+ *
+ * Results:
+ *      Size of the object in bytes.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Tcl_Size
+SvObjRepSize(
+	     Tcl_Obj *objPtr)
+{
+    Tcl_Size size = sizeof(Tcl_Obj), length;
+
+    if (objPtr->typePtr == &frozenObjType) {
+	size += sizeof(FrozenValue) + FROZEN_VALUE(objPtr)->length;
+    } else if (objPtr->typePtr == listObjTypePtr) {
+	Tcl_ListObjLength(NULL, objPtr, &length);
+	size += length * (sizeof(Tcl_Obj *) + sizeof(Tcl_Obj));
+    } else if (objPtr->typePtr == dictObjTypePtr) {
+	Tcl_DictObjSize(NULL, objPtr, &length);
+	size += length * (sizeof(Tcl_HashEntry) + 2 * sizeof(Tcl_Obj));
+    } else if (objPtr->typePtr == byteArrayObjTypePtr) {
+	Tcl_GetByteArrayFromObj(objPtr, &length);
+	size += length;
+    }
+
+    return size;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * CountValue --
+ *
+ *      Updates the memory statistics of the array of the container with
+ *      the current size of its value, or drops the value from them.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Statistics of the array are updated.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+CountValue(
+	   Container *svObj,
+	   int drop)
+{
+    Array *arrayPtr = svObj->arrayPtr;
+    Tcl_Size strBytes = 0, repBytes = 0;
+
+    if (!drop && svObj->tclObj) {
+	if (svObj->tclObj->bytes != NULL) {
+	    strBytes = svObj->tclObj->length;
+	}
+	repBytes = SvObjRepSize(svObj->tclObj);
+	if (svObj->repTypePtr && svObj->repTypePtr->sizeProc) {
+	    repBytes += svObj->repTypePtr->sizeProc(svObj);
+	}
+    }
+    arrayPtr->stringBytes += strBytes - svObj->strBytes;
+    arrayPtr->repBytes += repBytes - svObj->repBytes;
+    svObj->strBytes = strBytes;
+    svObj->repBytes = repBytes;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * NotifyWatches --
+ *
+ *      Records the change of the key of the container with all watches
+ *      of its array matching the key. Watches not having an event
+ *      queued to their thread yet get one.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Events may be queued to watching threads.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+NotifyWatches(
+	      Container *svObj,               /* Container of changed key */
+	      const char *op)                 /* Either "set" or "unset" */
+{
+    const char *key = (char *)Tcl_GetHashKey(&svObj->arrayPtr->vars,
+	    svObj->entryPtr);
+    WatchRef *refPtr;
+    Watch *watchPtr;
+    WatchEvent *evPtr;
+    Tcl_HashEntry *hPtr;
+    int isNew;
+
+    Tcl_MutexLock(&watchMutex);
+    for (refPtr = svObj->arrayPtr->watches; refPtr; refPtr = refPtr->nextPtr) {
+	watchPtr = refPtr->watchPtr;
+	if (!watchPtr->active || (watchPtr->pattern
+		&& !Tcl_StringCaseMatch(key, watchPtr->pattern, 0))) {
+	    continue;
+	}
+	hPtr = Tcl_CreateHashEntry(&watchPtr->pending, key, &isNew);
+	Tcl_SetHashValue(hPtr, (void *)op);
+	if (!watchPtr->queued) {
+	    evPtr = (WatchEvent *)Tcl_Alloc(sizeof(WatchEvent));
+	    evPtr->event.proc = WatchEventProc;
+	    evPtr->watchPtr = watchPtr;
+	    watchPtr->queued = 1;
+	    watchPtr->refCount++;
+	    ThreadQueueEvent(watchPtr->threadId, (Tcl_Event *)evPtr,
+		    TCL_QUEUE_TAIL);
+	}
+    }
+    Tcl_MutexUnlock(&watchMutex);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * WatchEventProc --
+ *
+ *      Runs in the watching thread and calls the command of the watch
+ *      for every key changed since the last time.
+ *
+ * Results:
+ *      1, the event is always processed.
+ *
+ * Side effects:
+ *      Whatever the command does. Errors are reported as background
+ *      errors.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+WatchEventProc(
+	       Tcl_Event *evPtr,              /* Really WatchEvent */
+	       TCL_UNUSED(int))
+{
+    Watch *watchPtr = ((WatchEvent *)evPtr)->watchPtr;
+    Tcl_Interp *interp = watchPtr->interp;
+    Tcl_Obj *changesObj = Tcl_NewListObj(0, NULL), **changes, *cmdObj;
+    Tcl_HashSearch search;
+    Tcl_HashEntry *hPtr;
+    Tcl_Size i, numChanges;
+    int ret;
+
+    Tcl_IncrRefCount(changesObj);
+    Tcl_MutexLock(&watchMutex);
+    watchPtr->queued = 0;
+    for (hPtr = Tcl_FirstHashEntry(&watchPtr->pending, &search); hPtr;
+	    hPtr = Tcl_NextHashEntry(&search)) {
+	Tcl_ListObjAppendElement(NULL, changesObj, Tcl_NewStringObj(
+		(char *)Tcl_GetHashKey(&watchPtr->pending, hPtr), TCL_INDEX_NONE));
+	Tcl_ListObjAppendElement(NULL, changesObj, Tcl_NewStringObj(
+		(char *)Tcl_GetHashValue(hPtr), TCL_INDEX_NONE));
+    }
+    Tcl_DeleteHashTable(&watchPtr->pending);
+    Tcl_InitHashTable(&watchPtr->pending, TCL_STRING_KEYS);
+    Tcl_MutexUnlock(&watchMutex);
+
+    /*
+     * The watch may be cancelled by the command itself, or by
+     * the deletion of the interpreter.
+     */
+
+    Tcl_ListObjGetElements(NULL, changesObj, &numChanges, &changes);
+    if (watchPtr->active && numChanges) {
+	Tcl_Preserve(interp);
+	for (i = 0; i < numChanges && watchPtr->active; i += 2) {
+	    cmdObj = Tcl_NewStringObj(watchPtr->command, TCL_INDEX_NONE);
+	    Tcl_IncrRefCount(cmdObj);
+	    Tcl_ListObjAppendElement(NULL, cmdObj,
+		    Tcl_NewStringObj(watchPtr->array, TCL_INDEX_NONE));
+	    Tcl_ListObjAppendElement(NULL, cmdObj, changes[i]);
+	    Tcl_ListObjAppendElement(NULL, cmdObj, changes[i+1]);
+	    ret = Tcl_EvalObjEx(interp, cmdObj, TCL_EVAL_GLOBAL);
+	    if (ret == TCL_ERROR) {
+		Tcl_BackgroundException(interp, ret);
+	    }
+	    Tcl_DecrRefCount(cmdObj);
+	}
+	Tcl_Release(interp);
+    }
+    Tcl_DecrRefCount(changesObj);
+
+    Tcl_MutexLock(&watchMutex);
+    DropWatch(watchPtr);
+    Tcl_MutexUnlock(&watchMutex);
+
+    return 1;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * DropWatch --
+ *
+ *      Drops one reference to the watch and frees it when it was the
+ *      last one. Must be called with the watchMutex held.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Memory may be reclaimed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+DropWatch(
+	  Watch *watchPtr)
+{
+    if (--watchPtr->refCount > 0) {
+	return;
+    }
+    Tcl_DeleteHashTable(&watchPtr->pending);
+    Tcl_Free(watchPtr->array);
+    if (watchPtr->pattern) {
+	Tcl_Free(watchPtr->pattern);
+    }
+    Tcl_Free(watchPtr->command);
+    Tcl_Free(watchPtr);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * CancelWatch --
+ *
+ *      Cancels the watch and removes it from the watched array, if
+ *      that still exists.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Watch may be freed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+CancelWatch(
+	    Watch *watchPtr)
+{
+    Array *arrayPtr;
+    WatchRef **refPtrPtr, *refPtr, *idlePtr;
+    Tcl_HashEntry *hPtr;
+    Tcl_Size i, numRefs = 0;
+
+    Tcl_MutexLock(&watchMutex);
+    watchPtr->active = 0;
+    Tcl_DeleteHashEntry(watchPtr->entryPtr);
+    hPtr = Tcl_FindHashEntry(&idleWatches, watchPtr->array);
+    if (hPtr != NULL) {
+	idlePtr = (WatchRef *)Tcl_GetHashValue(hPtr);
+	refPtrPtr = &idlePtr;
+	while ((refPtr = *refPtrPtr) != NULL) {
+	    if (refPtr->watchPtr == watchPtr) {
+		*refPtrPtr = refPtr->nextPtr;
+		Tcl_Free(refPtr);
+		numRefs++;
+	    } else {
+		refPtrPtr = &refPtr->nextPtr;
+	    }
+	}
+	if (idlePtr == NULL) {
+	    Tcl_DeleteHashEntry(hPtr);
+	    SvAtomicAdd(&numIdleWatches, -1);
+	} else {
+	    Tcl_SetHashValue(hPtr, idlePtr);
+	}
+    }
+    Tcl_MutexUnlock(&watchMutex);
+
+    /*
+     * Watches are cancelled in the watching thread, also when it exits,
+     * so the event still queued to it, if any, can be taken back here.
+     * Once the watch is inactive, no new one gets queued.
+     */
+
+    Tcl_DeleteEvents(DeleteWatchEvent, watchPtr);
+
+    /*
+     * Arrays are locked before the watchMutex, never the other way.
+     */
+
+    arrayPtr = LockArray(NULL, watchPtr->array, FLAGS_NOERRMSG);
+    if (arrayPtr != NULL) {
+	for (i = 0; i < SHARD_COUNT(arrayPtr); i++) {
+	    refPtrPtr = &SHARD(arrayPtr, i)->watches;
+	    while ((refPtr = *refPtrPtr) != NULL) {
+		if (refPtr->watchPtr == watchPtr) {
+		    *refPtrPtr = refPtr->nextPtr;
+		    Tcl_Free(refPtr);
+		    numRefs++;
+		} else {
+		    refPtrPtr = &refPtr->nextPtr;
+		}
+	    }
+	}
+	UnlockArray(arrayPtr);
+    }
+
+    Tcl_MutexLock(&watchMutex);
+    if (watchPtr->queued) {
+	watchPtr->queued = 0;
+	numRefs++;
+    }
+    watchPtr->refCount -= numRefs;
+    DropWatch(watchPtr);
+    Tcl_MutexUnlock(&watchMutex);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * DeleteWatchEvent --
+ *
+ *      Selects the event delivering changes of the given watch for
+ *      deletion from the event queue. This is called with the queue
+ *      locked, so it does not touch the watch itself.
+ *
+ * Results:
+ *      1 if the event is to be deleted, 0 otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+DeleteWatchEvent(
+		 Tcl_Event *evPtr,
+		 void *clientData)            /* The watch */
+{
+    return evPtr->proc == WatchEventProc
+	    && ((WatchEvent *)evPtr)->watchPtr == (Watch *)clientData;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * ReleaseWatches --
+ *
+ *      Removes all watches from the array about to be deleted.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Watches may be freed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+ReleaseWatches(
+	       Array *arrayPtr)
+{
+    WatchRef *refPtr;
+
+    Tcl_MutexLock(&watchMutex);
+    while ((refPtr = arrayPtr->watches) != NULL) {
+	arrayPtr->watches = refPtr->nextPtr;
+	DropWatch(refPtr->watchPtr);
+	Tcl_Free(refPtr);
+    }
+    Tcl_MutexUnlock(&watchMutex);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * AttachWatches --
+ *
+ *      Moves the watches waiting for the array to be created to the
+ *      array, or to every shard of a sharded array. The array must be
+ *      locked as with LockArray.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Watches start reporting changes of the array.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+AttachWatches(
+	      Array *arrayPtr,
+	      const char *arrayName)
+{
+    Tcl_HashEntry *hPtr;
+    WatchRef *idlePtr, *refPtr;
+    Tcl_Size i;
+
+    /*
+     * Whoever parks a watch locks the array afterwards, and attaches
+     * it then, so a count missed here is not a watch missed.
+     */
+
+    if (SvAtomicGet(&numIdleWatches) == 0) {
+	return;
+    }
+    Tcl_MutexLock(&watchMutex);
+    hPtr = Tcl_FindHashEntry(&idleWatches, arrayName);
+    if (hPtr != NULL) {
+	idlePtr = (WatchRef *)Tcl_GetHashValue(hPtr);
+	Tcl_DeleteHashEntry(hPtr);
+	SvAtomicAdd(&numIdleWatches, -1);
+	while (idlePtr != NULL) {
+	    for (i = 0; i < SHARD_COUNT(arrayPtr); i++) {
+		refPtr = (WatchRef *)Tcl_Alloc(sizeof(WatchRef));
+		refPtr->watchPtr = idlePtr->watchPtr;
+		refPtr->nextPtr = SHARD(arrayPtr, i)->watches;
+		SHARD(arrayPtr, i)->watches = refPtr;
+		idlePtr->watchPtr->refCount++;
+	    }
+	    refPtr = idlePtr->nextPtr;
+	    DropWatch(idlePtr->watchPtr);
+	    Tcl_Free(idlePtr);
+	    idlePtr = refPtr;
+	}
+    }
+    Tcl_MutexUnlock(&watchMutex);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * WatchInterpDeleted --
+ *
+ *      Cancels the watch of the interpreter being deleted.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      See CancelWatch.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+WatchInterpDeleted(
+		   void *clientData,          /* The watch */
+		   TCL_UNUSED(Tcl_Interp *))
+{
+    CancelWatch((Watch *)clientData);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvNumProcessors --
+ *
+ *      Returns the number of online processors.
+ *
+ * Results:
+ *      Number of processors, 1 if unknown.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static size_t
+SvNumProcessors(void)
+{
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    if (info.dwNumberOfProcessors > 0) {
+	return (size_t)info.dwNumberOfProcessors;
+    }
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu > 0) {
+	return (size_t)ncpu;
+    }
+#endif
+    return 1;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvThreadSlot --
+ *
+ *      Returns the slot of striped counters used by the current thread.
+ *      Threads get their slots in turn, so that up to the number of
+ *      slots threads never share one.
+ *
+ * Results:
+ *      Slot index.
+ *
+ * Side effects:
+ *      The slot is assigned on the first call in the thread.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static size_t
+SvThreadSlot(void)
+{
+    ThreadSpecificData *tsdPtr = (ThreadSpecificData *)
+	    Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
+
+    if (tsdPtr->slot == 0) {
+	Tcl_MutexLock(&svMutex);
+	tsdPtr->slot = ++threadSlots;
+	Tcl_MutexUnlock(&svMutex);
+    }
+
+    return tsdPtr->slot & (numSlots - 1);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvNumBuckets --
+ *
+ *      Computes the number of buckets to spread shared arrays into.
+ *      We take a few buckets per online processor so that threads
+ *      working on unrelated arrays seldom meet on the same lock.
+ *
+ * Results:
+ *      Number of buckets, a power of two between MINBUCKETS and
+ *      MAXBUCKETS.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static size_t
+SvNumBuckets(void)
+{
+    size_t num = 0, want = 0;
+    const char *env = getenv("TSV_BUCKETS");
+
+    if (env != NULL) {
+	want = (size_t)strtoul(env, NULL, 10);
+    }
+    if (want == 0) {
+	want = SvNumProcessors() * BUCKETS_PER_CPU;
+    }
+    for (num = MINBUCKETS; num < want && num < MAXBUCKETS; num <<= 1) {
+	/* Round up to the next power of two */
+    }
+
+    return num;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvHashString --
+ *
+ *      Computes the hash used to map names onto buckets. This is the
+ *      FNV-1a string hash followed by the MurmurHash3 finalizer, so
+ *      that names differing only in their last characters (foo1, foo2,
+ *      ...) still end up in different buckets after masking.
+ *
+ * Results:
+ *      The hash value.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static unsigned int
+SvHashString(const char *string)
+{
+    const unsigned char *p = (const unsigned char *)string;
+    unsigned int hash = 2166136261U;
+
+    while (*p) {
+	hash ^= *p++;
+	hash *= 16777619U;
+    }
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bU;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35U;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvGlobPrefix --
+ *
+ *      Finds the literal prefix of a glob pattern, before the first
+ *      character with a special meaning.
+ *
+ * Results:
+ *      Length of the prefix in bytes.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Tcl_Size
+SvGlobPrefix(
+	     const char *pattern)             /* Glob pattern */
+{
+    Tcl_Size len = 0;
+
+    while (pattern[len] && !strchr("*?[\\", pattern[len])) {
+	len++;
+    }
+
+    return len;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * Sv_PatternInit, Sv_PatternMatch --
+ *
+ *      Match strings against a glob pattern, or against a plain string
+ *      if told so by the last argument of Sv_PatternInit. Most patterns
+ *      used to search lists and names are plain strings, prefixes or
+ *      suffixes, which are found with memcmp() much faster than with
+ *      Tcl_StringCaseMatch, character by character. The C library
+ *      compares bytes with vector instructions where available.
+ *
+ * Results:
+ *      Sv_PatternMatch returns 1 if the string matches, 0 otherwise.
+ *      The length of the string may be given as TCL_INDEX_NONE if not
+ *      known.
+ *
+ * Side effects:
+ *      None. The pattern must outlive its SvPattern.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+Sv_PatternInit(
+	       SvPattern *patPtr,             /* Prepared pattern */
+	       const char *pattern,           /* Pattern, or NULL to match all */
+	       int exact)                     /* Match as a plain string */
+{
+    Tcl_Size len;
+
+    patPtr->pattern = pattern;
+    patPtr->literal = pattern;
+    patPtr->length  = 0;
+    patPtr->type    = SV_MATCH_ALL;
+
+    if (pattern == NULL) {
+	return;
+    }
+    if (exact) {
+	patPtr->length = (Tcl_Size)strlen(pattern);
+	patPtr->type = SV_MATCH_EXACT;
+	return;
+    }
+
+    len = SvGlobPrefix(pattern);
+    if (pattern[len] == '\0') {
+	patPtr->length = len;
+	patPtr->type = SV_MATCH_EXACT;
+    } else if (pattern[len] == '*' && pattern[len+1] == '\0') {
+	patPtr->length = len;
+	patPtr->type = len ? SV_MATCH_PREFIX : SV_MATCH_ALL;
+    } else if (len == 0 && pattern[0] == '*'
+	    && pattern[1 + SvGlobPrefix(pattern + 1)] == '\0') {
+	patPtr->literal = pattern + 1;
+	patPtr->length = (Tcl_Size)strlen(pattern + 1);
+	patPtr->type = SV_MATCH_SUFFIX;
+    } else {
+	patPtr->type = SV_MATCH_GLOB;
+    }
+}
+
+int
+Sv_PatternMatch(
+		const SvPattern *patPtr,      /* Pattern prepared by Sv_PatternInit */
+		const char *string,           /* String to match */
+		Tcl_Size length)              /* Length of string, or TCL_INDEX_NONE */
+{
+    switch (patPtr->type) {
+    case SV_MATCH_ALL:
+	return 1;
+
+    case SV_MATCH_EXACT:
+	if (length < 0) {
+	    return *string == *patPtr->literal
+		    && !strcmp(string, patPtr->literal);
+	}
+	return length == patPtr->length
+		&& !memcmp(string, patPtr->literal, length);
+
+    case SV_MATCH_PREFIX:
+	if (length < 0) {
+	    return !strncmp(string, patPtr->literal, patPtr->length);
+	}
+	return length >= patPtr->length
+		&& !memcmp(string, patPtr->literal, patPtr->length);
+
+    case SV_MATCH_SUFFIX:
+	if (length < 0) {
+	    length = (Tcl_Size)strlen(string);
+	}
+	return length >= patPtr->length
+		&& !memcmp(string + length - patPtr->length, patPtr->literal,
+			patPtr->length);
+    }
+
+    return Tcl_StringCaseMatch(string, patPtr->pattern, 0);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvReverseBits --
+ *
+ *      Reverses the order of the bits of an integer.
+ *
+ * Results:
+ *      The reversed integer.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static unsigned int
+SvReverseBits(
+	      unsigned int v)                 /* Bits to reverse */
+{
+    v = ((v >> 1) & 0x55555555U) | ((v & 0x55555555U) << 1);
+    v = ((v >> 2) & 0x33333333U) | ((v & 0x33333333U) << 2);
+    v = ((v >> 4) & 0x0F0F0F0FU) | ((v & 0x0F0F0F0FU) << 4);
+    v = ((v >> 8) & 0x00FF00FFU) | ((v & 0x00FF00FFU) << 8);
+
+    return (v >> 16) | (v << 16);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * CounterUpdateProc, CounterFreeProc, CounterValueProc --
+ *
+ *      Procedures of the counter representation. The counter is a
+ *      Tcl_WideInt, updated with atomic instructions by the readers
+ *      of the container.
+ *
+ * Results:
+ *      CounterValueProc returns new integer object with the current
+ *      value of the counter.
+ *
+ * Side effects:
+ *      CounterUpdateProc stores the value in the Tcl object of the
+ *      container. CounterFreeProc frees the counter.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+CounterUpdateProc(
+		  Container *svObj)
+{
+    Tcl_SetWideIntObj(svObj->tclObj, *(Tcl_WideInt *)svObj->repPtr);
+}
+
+static void
+CounterFreeProc(
+		Container *svObj)
+{
+    Tcl_Free(svObj->repPtr);
+}
+
+static Tcl_Obj *
+CounterValueProc(
+		 Container *svObj)
+{
+    return Tcl_NewWideIntObj(SvAtomicGet((Tcl_WideInt *)svObj->repPtr));
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * StripedUpdateProc, StripedFreeProc, StripedValueProc --
+ *
+ *      Procedures of the striped counter representation.
+ *
+ * Results:
+ *      StripedValueProc returns new integer object with the sum of
+ *      all counter slots.
+ *
+ * Side effects:
+ *      StripedUpdateProc stores the sum in the Tcl object of the
+ *      container. StripedFreeProc frees the counter.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+StripedUpdateProc(
+		  Container *svObj)
+{
+    Tcl_Obj *valObj = StripedValueProc(svObj);
+    Tcl_WideInt value;
+
+    Tcl_GetWideIntFromObj(NULL, valObj, &value);
+    Tcl_DecrRefCount(valObj);
+    Tcl_SetWideIntObj(svObj->tclObj, value);
+}
+
+static void
+StripedFreeProc(
+		Container *svObj)
+{
+    Tcl_Free(((StripedCounter *)svObj->repPtr)->memPtr);
+    Tcl_Free(svObj->repPtr);
+}
+
+static Tcl_Obj *
+StripedValueProc(
+		 Container *svObj)
+{
+    StripedSlot *slots = ((StripedCounter *)svObj->repPtr)->slots;
+    Tcl_WideInt value = 0;
+    size_t i;
+
+    for (i = 0; i < numSlots; i++) {
+	value += SvAtomicGet(&slots[i].value);
+    }
+
+    return Tcl_NewWideIntObj(value);
+}
+
+#ifdef SV_ATOMIC_MUTEX
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvAtomicAdd, SvAtomicGet, SvAtomicSet --
+ *
+ *      Fallback for platforms without atomic instructions.
+ *
+ * Results:
+ *      The new, respectively current value of the counter.
+ *
+ * Side effects:
+ *      SvAtomicAdd increments the counter, SvAtomicSet stores a value.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Tcl_Mutex atomicMutex;
+
+Tcl_WideInt
+SvAtomicAdd(
+	    Tcl_WideInt *counterPtr,
+	    Tcl_WideInt incr)
+{
+    Tcl_MutexLock(&atomicMutex);
+    incr = (*counterPtr += incr);
+    Tcl_MutexUnlock(&atomicMutex);
+
+    return incr;
+}
+
+Tcl_WideInt
+SvAtomicGet(
+	    Tcl_WideInt *counterPtr)
+{
+    Tcl_WideInt value;
+
+    Tcl_MutexLock(&atomicMutex);
+    value = *counterPtr;
+    Tcl_MutexUnlock(&atomicMutex);
+
+    return value;
+}
+
+void
+SvAtomicSet(
+	    Tcl_WideInt *counterPtr,
+	    Tcl_WideInt value)
+{
+    Tcl_MutexLock(&atomicMutex);
+    *counterPtr = value;
+    Tcl_MutexUnlock(&atomicMutex);
+}
+#endif /* SV_ATOMIC_MUTEX */
+
+#ifdef SV_ATOMIC_CAS
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvAtomicCas --
+ *
+ *      Compare-and-swap for platforms where it is not a builtin.
+ *
+ * Results:
+ *      1 if the value was replaced, 0 otherwise.
+ *
+ * Side effects:
+ *      Stores the new value if the current one is the expected one,
+ *      else stores the current one as the expected one.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+int
+SvAtomicCas(
+	    Tcl_WideInt *valuePtr,
+	    Tcl_WideInt *expectedPtr,
+	    Tcl_WideInt newValue)
+{
+    Tcl_WideInt old;
+
+#ifdef SV_ATOMIC_MUTEX
+    Tcl_MutexLock(&atomicMutex);
+    old = *valuePtr;
+    if (old == *expectedPtr) {
+	*valuePtr = newValue;
+    }
+    Tcl_MutexUnlock(&atomicMutex);
+#else
+    old = InterlockedCompareExchange64((volatile LONG64 *)valuePtr,
+	    newValue, *expectedPtr);
+#endif
+    if (old == *expectedPtr) {
+	return 1;
+    }
+    *expectedPtr = old;
+    return 0;
+}
+#endif /* SV_ATOMIC_CAS */
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * NewFrozenObj --
+ *
+ *      Creates a frozen object holding the string of the given object.
+ *
+ * Results:
+ *      New Tcl object with reference count 0.
+ *
+ * Side effects:
+ *      Memory gets allocated.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+NewFrozenObj(
+	     Tcl_Obj *objPtr)                   /* Value to freeze */
+{
+    Tcl_Size length;
+    const char *bytes = Tcl_GetStringFromObj(objPtr, &length);
+    FrozenValue *valuePtr;
+    Tcl_Obj *frozenPtr = Tcl_NewObj();
+
+    valuePtr = (FrozenValue *)Tcl_Alloc(sizeof(FrozenValue) + length);
+    valuePtr->refCount = 1;
+    valuePtr->length = length;
+    memcpy(valuePtr->bytes, bytes, length + 1);
+
+    Tcl_InvalidateStringRep(frozenPtr);
+    frozenPtr->internalRep.twoPtrValue.ptr1 = valuePtr;
+    frozenPtr->internalRep.twoPtrValue.ptr2 = NULL;
+    frozenPtr->typePtr = &frozenObjType;
+
+    return frozenPtr;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * FreeFrozenInternalRep, DupFrozenInternalRep, UpdateStringOfFrozen --
+ *
+ *      Implement the frozen object type. Objects share the buffer
+ *      holding the string, which is freed with the last of them.
+ *      These may be called by any thread.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Reference count of the buffer changes, memory may be freed or
+ *      allocated.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+FreeFrozenInternalRep(
+		      Tcl_Obj *objPtr)
+{
+    FrozenValue *valuePtr = FROZEN_VALUE(objPtr);
+
+    /*
+     * The decrement orders the accesses of this thread before it, so
+     * that the thread dropping the last reference frees the buffer
+     * only when all others are done with it.
+     */
+
+    if (SvAtomicAddSync(&valuePtr->refCount, -1) == 0) {
+	Tcl_Free(valuePtr);
+    }
+    objPtr->typePtr = NULL;
+}
+
+static void
+DupFrozenInternalRep(
+		     Tcl_Obj *srcPtr,
+		     Tcl_Obj *dupPtr)
+{
+    FrozenValue *valuePtr = FROZEN_VALUE(srcPtr);
+
+    SvAtomicAdd(&valuePtr->refCount, 1);
+    dupPtr->internalRep.twoPtrValue.ptr1 = valuePtr;
+    dupPtr->internalRep.twoPtrValue.ptr2 = NULL;
+    dupPtr->typePtr = &frozenObjType;
+}
+
+static void
+UpdateStringOfFrozen(
+		     Tcl_Obj *objPtr)
+{
+    FrozenValue *valuePtr = FROZEN_VALUE(objPtr);
+
+    objPtr->bytes = (char *)Tcl_Alloc(valuePtr->length + 1);
+    memcpy(objPtr->bytes, valuePtr->bytes, valuePtr->length + 1);
+    objPtr->length = valuePtr->length;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * DupDictObjShared --
+ *
+ *      Makes a deep copy of the dict object, duplicating keys and values
+ *      with Sv_DuplicateObj, so that nested dicts and lists are copied
+ *      as well. Used in place of the native DupInternalRep function of
+ *      dicts, which shares the keys and values with the original.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Memory gets allocated.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+DupDictObjShared(
+		 Tcl_Obj *srcPtr,       /* Object with internal rep to copy. */
+		 Tcl_Obj *copyPtr)      /* Object with internal rep to set. */
+{
+    int done;
+    Tcl_Size i, size;
+    Tcl_DictSearch search;
+    Tcl_Obj *keyObj, *valObj, **objs;
+    Tcl_Obj *buf[32];
+    Tcl_Mutex *mutexPtr =
+	    &dictMutex[((size_t)srcPtr / sizeof(Tcl_Obj)) % DICT_MUTEXES];
+
+    /*
+     * Collect the keys and values first. The dict is iterated holding
+     * the mutex only; the copies are made after it has been released,
+     * since nested dicts may need the very same mutex.
+     */
+
+    Tcl_MutexLock(mutexPtr);
+    Tcl_DictObjSize(NULL, srcPtr, &size);
+    objs = (size > 16) ? (Tcl_Obj**)Tcl_Alloc(2*size*sizeof(Tcl_Obj *)) : &buf[0];
+    Tcl_DictObjFirst(NULL, srcPtr, &search, &keyObj, &valObj, &done);
+    for (i = 0; !done; i += 2) {
+	objs[i]   = keyObj;
+	objs[i+1] = valObj;
+	Tcl_DictObjNext(&search, &keyObj, &valObj, &done);
+    }
+    Tcl_DictObjDone(&search);
+    Tcl_MutexUnlock(mutexPtr);
+
+    /*
+     * Build the copy as a key/value list first; Tcl turns such lists
+     * into dicts directly, without going through the string rep.
+     */
+
+    for (i = 0; i < 2*size; i++) {
+	objs[i] = Sv_DuplicateObj(objs[i]);
+    }
+    Tcl_SetListObj(copyPtr, 2*size, objs);
+    Tcl_DictObjSize(NULL, copyPtr, &size);
+
+    if (objs != &buf[0]) {
+	Tcl_Free(objs);
+    }
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * Sv_DuplicateObj --
+ *
+ *  Create and return a new object that is (mostly) a duplicate of the
+ *  argument object. We take care that the duplicate object is either
+ *  a proper object copy, i.e. w/o hidden references to original object
+ *  elements or a plain string object, i.e one w/o internal representation.
+ *
+ *  Decision about whether to produce a real duplicate or a string object
+ *  is done as follows:
+ *
+ *     1) Scalar Tcl object types are properly copied by default;
+ *        these include: boolean, int double, string and byteArray types.
+ *     2) Object registered with Sv_RegisterObjType are duplicated
+ *        using custom duplicator function which is guaranteed to
+ *        produce a proper deep copy of the object in question.
+ *     3) All other object types are stringified; these include
+ *        miscelaneous Tcl objects (cmdName, nsName, bytecode, etc, etc)
+ *        and all user-defined objects.
+ *
+ * Results:
+ *      The return value is a pointer to a newly created Tcl_Obj. This
+ *      object has reference count 0 and the same type, if any, as the
+ *      source object objPtr. Also:
+ *
+ *        1) If the source object has a valid string rep, we copy it;
+ *           otherwise, the new string rep is marked invalid.
+ *        2) If the source object has an internal representation (i.e. its
+ *           typePtr is non-NULL), the new object's internal rep is set to
+ *           a copy; otherwise the new internal rep is marked invalid.
+ *
+ * Side effects:
+ *  Some object may, when copied, loose their type, i.e. will become
+ *  just plain string objects.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Tcl_Obj *
+Sv_DuplicateObj(
+    Tcl_Obj *objPtr        /* The object to duplicate. */
+) {
+    Tcl_Obj *dupPtr = Tcl_NewObj();
+
+    /*
+     * Handle the internal rep
+     */
+
+    if (objPtr->typePtr != NULL) {
+	if (objPtr->typePtr->dupIntRepProc == NULL) {
+	    dupPtr->internalRep = objPtr->internalRep;
+	    dupPtr->typePtr = objPtr->typePtr;
+	    Tcl_InvalidateStringRep(dupPtr);
+	} else {
+	    if (   objPtr->typePtr == booleanObjTypePtr    \
+		|| objPtr->typePtr == byteArrayObjTypePtr  \
+		|| objPtr->typePtr == doubleObjTypePtr     \
+		|| objPtr->typePtr == intObjTypePtr        \
+		|| objPtr->typePtr == wideIntObjTypePtr    \
+		|| objPtr->typePtr == stringObjTypePtr) {
+	       /*
+		* Cover all "safe" obj types (see header comment)
+		*/
+	      (*objPtr->typePtr->dupIntRepProc)(objPtr, dupPtr);
+	      if (dupPtr->typePtr != NULL) {
+		  Tcl_InvalidateStringRep(dupPtr);
+	      }
+	    } else {
+		int found = 0;
+		RegType *regPtr;
+	       /*
+		* Cover special registered types. Assume not
+		* very many of those, so this sequential walk
+		* should be fast enough.
+		*/
+		for (regPtr = regType; regPtr; regPtr = regPtr->nextPtr) {
+		    if (objPtr->typePtr == regPtr->typePtr) {
+			(*regPtr->dupIntRepProc)(objPtr, dupPtr);
+			if (dupPtr->typePtr != NULL) {
+			    Tcl_InvalidateStringRep(dupPtr);
+			}
+			found = 1;
+			break;
+		    }
+		}
+	       /*
+		* Assure at least string rep of the source
+		* is present, which will be copied below.
+		*/
+		if (found == 0 && objPtr->bytes == NULL
+		    && objPtr->typePtr->updateStringProc != NULL) {
+		    (*objPtr->typePtr->updateStringProc)(objPtr);
+		}
+	    }
+	}
+    }
+
+    /*
+     * Handle the string rep
+     */
+
+    if (objPtr->bytes == NULL) {
+	if (dupPtr->bytes != Sv_tclEmptyStringRep) {
+	    dupPtr->bytes = NULL;
+	}
+    } else if (objPtr->bytes != Sv_tclEmptyStringRep) {
+	/* A copy of TclInitStringRep macro */
+	dupPtr->bytes = (char *)Tcl_Alloc(objPtr->length + 1);
+	if (objPtr->length > 0) {
+	    memcpy(dupPtr->bytes, objPtr->bytes,
+		    objPtr->length);
+	}
+	dupPtr->length = objPtr->length;
+	dupPtr->bytes[objPtr->length] = '\0';
+    }
+
+    return dupPtr;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvStripOption --
+ *
+ *      Checks whether the first argument of the command is the given
+ *      option and removes it from the argument list if so. For object
+ *      commands the first argument follows the method name. The
+ *      shortened argument list is built in the given buffer, which
+ *      must hold at least SV_MAXARGS elements.
+ *
+ * Results:
+ *      1 if the option was found, 0 if not, -1 if there are too many
+ *      arguments.
+ *
+ * Side effects:
+ *      Argument count and list may be replaced.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SvStripOption(
+	      Tcl_Size *objcPtr,              /* IN/OUT: number of arguments */
+	      Tcl_Obj *const **objvPtr,       /* IN/OUT: argument objects */
+	      Tcl_Size first,                 /* Index of the first argument */
+	      const char *option,             /* Option to look for */
+	      Tcl_Obj **buffer)               /* Space for the new arguments */
+{
+    Tcl_Size objc = *objcPtr;
+    Tcl_Obj *const *objv = *objvPtr;
+
+    if (objc <= first || strcmp(Tcl_GetString(objv[first]), option)) {
+	return 0;
+    }
+
+    return SvShiftArgs(objcPtr, objvPtr, first, 1, buffer) == TCL_OK ? 1 : -1;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvShiftArgs --
+ *
+ *      Removes the given number of arguments, starting at the given
+ *      index, from the argument list. The shortened argument list is
+ *      built in the given buffer, which must hold at least SV_MAXARGS
+ *      elements.
+ *
+ * Results:
+ *      TCL_OK, or TCL_ERROR if there would be too many arguments left.
+ *
+ * Side effects:
+ *      Argument count and list may be replaced.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SvShiftArgs(
+	    Tcl_Size *objcPtr,                /* IN/OUT: number of arguments */
+	    Tcl_Obj *const **objvPtr,         /* IN/OUT: argument objects */
+	    Tcl_Size first,                   /* Index of the first to remove */
+	    Tcl_Size count,                   /* Number of arguments to remove */
+	    Tcl_Obj **buffer)                 /* Space for the new arguments */
+{
+    Tcl_Size objc = *objcPtr;
+    Tcl_Obj *const *objv = *objvPtr;
+
+    if (count == 0) {
+	return TCL_OK;
+    }
+    if (objc - count > SV_MAXARGS) {
+	return TCL_ERROR;
+    }
+
+    memcpy(buffer, objv, first * sizeof(Tcl_Obj *));
+    memcpy(buffer + first, objv + first + count,
+	    (objc - first - count) * sizeof(Tcl_Obj *));
+    *objcPtr = objc - count;
+    *objvPtr = buffer;
+
+    return TCL_OK;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvObjDispatchObjCmd --
+ *
+ *      The method command for dispatching sub-commands of the shared
+ *      object.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      Depends on the dispatched command
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SvObjDispatchObjCmd(
+		    void *arg,                     /* Pointer to object container. */
+		    Tcl_Interp *interp,                 /* Current interpreter. */
+		    Tcl_Size objc,                           /* Number of arguments. */
+		    Tcl_Obj *const objv[])              /* Argument objects. */
+{
+    const char *cmdName;
+    SvCmdInfo *cmdPtr;
+
+    if (objc < 2) {
+	Tcl_WrongNumArgs(interp, 1, objv, "args");
+	return TCL_ERROR;
+    }
+
+    cmdName = Tcl_GetString(objv[1]);
+
+    /*
+     * Do simple linear search. We may later replace this list
+     * with the hash table to gain speed. Currently, the list
+     * of registered commands is so small, so this will work
+     * fast enough.
+     */
+
+    for (cmdPtr = svCmdInfo; cmdPtr; cmdPtr = cmdPtr->nextPtr) {
+	if (!strcmp(cmdPtr->name, cmdName)) {
+	    return (*cmdPtr->objProcPtr)(arg, interp, objc, objv);
+	}
+    }
+
+    Tcl_AppendResult(interp, "invalid command name \"", cmdName, "\"", (void *)NULL);
+    return TCL_ERROR;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvObjObjCmd --
+ *
+ *      Creates the object command for a shared array.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      New Tcl command gets created.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SvObjObjCmd(
+	    void *arg,                     /* != NULL if aolSpecial */
+	    Tcl_Interp *interp,                 /* Current interpreter. */
+	    Tcl_Size objc,                   /* Number of arguments. */
+	    Tcl_Obj *const objv[])              /* Argument objects. */
+{
+    int isNew, ret, flg;
+    Tcl_Size off;
+    char buf[128];
+    Tcl_Obj *val = NULL;
+    Container *svObj = NULL;
+
+    /*
+     * Syntax: sv::object array key ?var?
+     */
+
+    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, 0);
+    switch (ret) {
+    case TCL_BREAK: /* Shared array was not found */
+	if (objc != off) {
+	    val = objv[off];
+	}
+	Tcl_ResetResult(interp);
+	flg = FLAGS_CREATEARRAY | FLAGS_CREATEVAR;
+	ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, flg);
+	if (ret != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	Tcl_DecrRefCount(svObj->tclObj);
+	svObj->tclObj = Sv_DuplicateObj(val ? val : Tcl_NewObj());
+	Tcl_IncrRefCount(svObj->tclObj);
+	break;
+    case TCL_ERROR:
+	return TCL_ERROR;
+    }
+
+    if (svObj->handlePtr == NULL) {
+	Tcl_HashTable *handles = &svObj->arrayPtr->bucketPtr->handles;
+	svObj->handlePtr = Tcl_CreateHashEntry(handles, (char*)svObj, &isNew);
+    }
+
+    /*
+     * The handle command keeps the container pointer for as long as
+     * it exists, and checks it against the handles of the bucket of
+     * the container, so the memory of the container must stay.
+     */
+
+    svObj->chunkPtr->pinned = 1;
+
+    /*
+     * Format the command name
+     */
+
+    snprintf(buf, sizeof(buf), "::%p", svObj);
+    svObj->aolSpecial = (arg != NULL);
+    Tcl_CreateObjCommand2(interp, buf, SvObjDispatchObjCmd, svObj, NULL);
+    Tcl_ResetResult(interp);
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(buf, TCL_INDEX_NONE));
+
+    return Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvArrayObjCmd --
+ *
+ *      This procedure is invoked to process the "tsv::array" command.
+ *      See the user documentation for details on what it does.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      See the user documentation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SvArrayObjCmd(
+	      void *arg,                     /* Pointer to object container. */
+	      Tcl_Interp *interp,                 /* Current interpreter. */
+	      Tcl_Size objc,                   /* Number of arguments. */
+	      Tcl_Obj *const objv[])              /* Argument objects. */
+{
+    int ret = TCL_OK;
+    Tcl_Size i, argx = 0, lobjc = 0;
+    const char *arrayName = NULL;
+    Array *arrayPtr = NULL;
+    Tcl_Obj **lobjv = NULL;
+    Container *svObj, *elObj = NULL;
+
+    static const char *const opts[] = {
+	"set",  "reset", "get", "names", "size", "exists", "isbound",
+	"bind", "unbind", "create", "configure", "stats", "range", "scan",
+	"query", NULL
+    };
+    enum options {
+	ASET,   ARESET,  AGET,  ANAMES,  ASIZE,  AEXISTS, AISBOUND,
+	ABIND,  AUNBIND, ACREATE, ACONFIGURE, ASTATS, ARANGE, ASCAN,
+	AQUERY
+    };
+    int index, flags = FLAGS_NOERRMSG;
+
+    svObj = (Container*)arg;
+
+    if (objc < 3) {
+	Tcl_WrongNumArgs(interp, 1, objv, "option array");
+	return TCL_ERROR;
+    }
+
+    if (Tcl_GetIndexFromObjStruct(interp,objv[1],opts, sizeof(char *),"option",0,&index) != TCL_OK) {
+	return TCL_ERROR;
+    }
+
+    /*
+     * Scans lock one shard at a time, not the whole array.
+     */
+
+    if (index == ASCAN) {
+	return ScanArray(interp, objc, objv);
+    }
+
+    /*
+     * Options which do not modify the array need only the shared lock.
+     */
+
+    switch (index) {
+    case AGET: case ANAMES: case ASIZE: case AEXISTS: case AISBOUND:
+    case ASTATS: case ARANGE: case AQUERY:
+	flags |= FLAGS_READONLY;
+	break;
+    }
+
+    arrayName = Tcl_GetString(objv[2]);
+
+ relock:
+    arrayPtr  = LockArray(interp, arrayName, flags);
+
+    if (objc > 3) {
+	argx = 3;
+    }
+
+    Tcl_ResetResult(interp);
+
+    if (index == AEXISTS) {
+	Tcl_SetIntObj(Tcl_GetObjResult(interp), arrayPtr!=0);
+
+    } else if (index == AISBOUND) {
+	if (arrayPtr == NULL) {
+	    Tcl_SetIntObj(Tcl_GetObjResult(interp), 0);
+	} else {
+	    Tcl_SetIntObj(Tcl_GetObjResult(interp), arrayPtr->psPtr!=0);
+	}
+
+    } else if (index == ASIZE) {
+	if (arrayPtr == NULL) {
+	    Tcl_SetIntObj(Tcl_GetObjResult(interp), 0);
+	} else {
+	    Tcl_WideInt size = 0;
+	    for (i = 0; i < SHARD_COUNT(arrayPtr); i++) {
+		size += (Tcl_WideInt)SHARD(arrayPtr, i)->vars.numEntries;
+	    }
+	    Tcl_SetWideIntObj(Tcl_GetObjResult(interp), size);
+	}
+
+    } else if (index == ASTATS) {
+	Tcl_WideInt stats[6] = {0, 0, 0, 0, 0, 0}, indexBytes = 0;
+	Tcl_Obj *resObj, *bucketsObj;
+	static const char *const statNames[] = {
+	    "keys", "keybytes", "stringbytes", "internalbytes",
+	    "bucketcontainers", "bucketfree"
+	};
+
+	if (arrayPtr == NULL) {
+	    Tcl_AppendResult(interp, "\"", arrayName,
+		    "\" is not a thread shared array", (void *)NULL);
+	    ret = TCL_ERROR;
+	    goto cmdExit;
+	}
+
+	/*
+	 * All counters are maintained as keys change, so this does
+	 * not depend on the number of keys. Shards of one array never
+	 * share a bucket, so buckets are not counted twice.
+	 */
+
+	bucketsObj = Tcl_NewListObj(0, NULL);
+	for (i = 0; i < SHARD_COUNT(arrayPtr); i++) {
+	    Array *shardPtr = SHARD(arrayPtr, i);
+	    stats[0] += (Tcl_WideInt)shardPtr->vars.numEntries;
+	    stats[1] += shardPtr->keyBytes;
+	    stats[2] += shardPtr->stringBytes;
+	    stats[3] += shardPtr->repBytes;
+	    stats[4] += shardPtr->bucketPtr->numContainers;
+	    stats[5] += shardPtr->bucketPtr->numFree;
+	    if (shardPtr->indexPtr) {
+		indexBytes += shardPtr->indexPtr->numBytes;
+	    }
+	    Tcl_ListObjAppendElement(NULL, bucketsObj,
+		    Tcl_NewWideIntObj(shardPtr->bucketPtr - buckets));
+	}
+	resObj = Tcl_NewListObj(0, NULL);
+	for (i = 0; i < 4; i++) {
+	    Tcl_ListObjAppendElement(NULL, resObj,
+		    Tcl_NewStringObj(statNames[i], TCL_INDEX_NONE));
+	    Tcl_ListObjAppendElement(NULL, resObj, Tcl_NewWideIntObj(stats[i]));
+	}
+	Tcl_ListObjAppendElement(NULL, resObj,
+		Tcl_NewStringObj("containerbytes", TCL_INDEX_NONE));
+	Tcl_ListObjAppendElement(NULL, resObj,
+		Tcl_NewWideIntObj(stats[0] * (Tcl_WideInt)sizeof(Container)));
+	Tcl_ListObjAppendElement(NULL, resObj,
+		Tcl_NewStringObj("indexbytes", TCL_INDEX_NONE));
+	Tcl_ListObjAppendElement(NULL, resObj, Tcl_NewWideIntObj(indexBytes));
+	Tcl_ListObjAppendElement(NULL, resObj,
+		Tcl_NewStringObj("buckets", TCL_INDEX_NONE));
+	Tcl_ListObjAppendElement(NULL, resObj, bucketsObj);
+	for (i = 4; i < 6; i++) {
+	    Tcl_ListObjAppendElement(NULL, resObj,
+		    Tcl_NewStringObj(statNames[i], TCL_INDEX_NONE));
+	    Tcl_ListObjAppendElement(NULL, resObj, Tcl_NewWideIntObj(stats[i]));
+	}
+	Tcl_SetObjResult(interp, resObj);
+
+    } else if (index == ASET || index == ARESET) {
+	if (argx == (objc - 1)) {
+	    if (argx && Tcl_ListObjGetElements(interp, objv[argx], &lobjc,
+		    &lobjv) != TCL_OK) {
+		ret = TCL_ERROR;
+		goto cmdExit;
+	    }
+	} else {
+	    lobjc = objc - 3;
+	    lobjv = (Tcl_Obj**)objv + 3;
+	}
+	if (lobjc & 1) {
+	    Tcl_AppendResult(interp, "list must have an even number"
+		    " of elements", (void *)NULL);
+	    ret = TCL_ERROR;
+	    goto cmdExit;
+	}
+	if (arrayPtr == NULL) {
+	    arrayPtr = LockArray(interp, arrayName, FLAGS_CREATEARRAY);
+	}
+	if (index == ARESET) {
+	    ret = FlushArray(arrayPtr);
+	    if (ret != TCL_OK) {
+		if (arrayPtr->psPtr) {
+		    PsStore *psPtr = arrayPtr->psPtr;
+		    const char *err = psPtr->psError(psPtr->psHandle);
+		    Tcl_SetObjResult(interp, Tcl_NewStringObj(err, TCL_INDEX_NONE));
+		}
+		goto cmdExit;
+	    }
+	}
+	for (i = 0; i < lobjc; i += 2) {
+	    const char *key = Tcl_GetString(lobjv[i]);
+	    elObj = AcquireContainer(GetShard(arrayPtr, key), key,
+		    FLAGS_CREATEVAR);
+	    Sv_UpdateContainer(elObj);
+	    Tcl_DecrRefCount(elObj->tclObj);
+	    elObj->tclObj = Sv_DuplicateObj(lobjv[i+1]);
+	    Tcl_IncrRefCount(elObj->tclObj);
+	    ResetExpiry(elObj);
+	    if (ReleaseContainer(interp, elObj, SV_CHANGED) != TCL_OK) {
+		ret = TCL_ERROR;
+		goto cmdExit;
+	    }
+	}
+
+    } else if (index == AGET || index == ANAMES || index == AQUERY) {
+	static const char *const queryOpts[] = {
+	    "-count", "-key", "-keysonly", "-limit", "-max", "-min",
+	    "-regexp", "-value", NULL
+	};
+	enum queryOpts {
+	    QCOUNT, QKEY, QKEYSONLY, QLIMIT, QMAX, QMIN, QREGEXP, QVALUE
+	};
+	Tcl_HashSearch search;
+	Tcl_DString prefix;
+	SvPattern keyPattern, valueMatch;
+	Tcl_Size length;
+	Tcl_Obj *resObj, *valueObj;
+	Tcl_RegExp regExp = NULL;
+	Tcl_WideInt limit = -1, found = 0;
+	const char *pattern = NULL, *valuePattern = NULL, *string;
+	double min = 0.0, max = 0.0, number;
+	int opt, keysOnly = (index == ANAMES), countOnly = 0, byValue;
+	int hasMin = 0, hasMax = 0, match;
+
+	if (index != AQUERY) {
+	    pattern = (argx == 0) ? NULL : Tcl_GetString(objv[argx]);
+	}
+	for (i = 3; index == AQUERY && i < objc; i++) {
+	    if (Tcl_GetIndexFromObjStruct(interp, objv[i], queryOpts,
+		    sizeof(char *), "option", 0, &opt) != TCL_OK) {
+		ret = TCL_ERROR;
+		goto cmdExit;
+	    }
+	    if (opt == QCOUNT) {
+		countOnly = 1;
+		continue;
+	    } else if (opt == QKEYSONLY) {
+		keysOnly = 1;
+		continue;
+	    }
+	    if (++i == objc) {
+		Tcl_AppendResult(interp, "missing value for option \"",
+			Tcl_GetString(objv[i-1]), "\"", (void *)NULL);
+		ret = TCL_ERROR;
+		goto cmdExit;
+	    }
+	    switch (opt) {
+	    case QKEY:
+		pattern = Tcl_GetString(objv[i]);
+		break;
+	    case QVALUE:
+		valuePattern = Tcl_GetString(objv[i]);
+		break;
+	    case QREGEXP:
+		regExp = Tcl_GetRegExpFromObj(interp, objv[i], TCL_REG_ADVANCED);
+		if (regExp == NULL) {
+		    ret = TCL_ERROR;
+		    goto cmdExit;
+		}
+		break;
+	    case QLIMIT:
+		if (Tcl_GetWideIntFromObj(interp, objv[i], &limit) != TCL_OK) {
+		    ret = TCL_ERROR;
+		    goto cmdExit;
+		}
+		if (limit < 0) {
+		    Tcl_AppendResult(interp, "expected non-negative limit but"
+			    " got \"", Tcl_GetString(objv[i]), "\"", (void *)NULL);
+		    ret = TCL_ERROR;
+		    goto cmdExit;
+		}
+		break;
+	    case QMIN:
+		if (Tcl_GetDoubleFromObj(interp, objv[i], &min) != TCL_OK) {
+		    ret = TCL_ERROR;
+		    goto cmdExit;
+		}
+		hasMin = 1;
+		break;
+	    case QMAX:
+		if (Tcl_GetDoubleFromObj(interp, objv[i], &max) != TCL_OK) {
+		    ret = TCL_ERROR;
+		    goto cmdExit;
+		}
+		hasMax = 1;
+		break;
+	    }
+	}
+	byValue = valuePattern || regExp || hasMin || hasMax;
+	Sv_PatternInit(&keyPattern, pattern, 0);
+	Sv_PatternInit(&valueMatch, valuePattern, 0);
+
+	/*
+	 * A plain key is looked up in its own shard. Keys of ordered
+	 * arrays matching a pattern all start with the literal prefix
+	 * of the pattern, and are next to each other in the index.
+	 */
+
+	resObj = Tcl_NewListObj(0, NULL);
+	Tcl_DStringInit(&prefix);
+	if (pattern) {
+	    Tcl_DStringAppend(&prefix, pattern, SvGlobPrefix(pattern));
+	}
+	for (i = 0; arrayPtr && i < SHARD_COUNT(arrayPtr) && found != limit; i++) {
+	    Array *shardPtr = SHARD(arrayPtr, i);
+	    Tcl_HashEntry *hPtr = NULL;
+	    SvIndexNode *nodePtr = NULL;
+	    char *key;
+
+	    if (keyPattern.type == SV_MATCH_EXACT) {
+		if (shardPtr != GetShard(arrayPtr, pattern)) {
+		    continue;
+		}
+		hPtr = Tcl_FindHashEntry(&shardPtr->vars, pattern);
+	    } else if (shardPtr->indexPtr && Tcl_DStringLength(&prefix)) {
+		nodePtr = Sv_IndexSeek(shardPtr->indexPtr,
+			Tcl_DStringValue(&prefix));
+	    } else {
+		hPtr = Tcl_FirstHashEntry(&shardPtr->vars, &search);
+	    }
+	    while ((hPtr || nodePtr) && found != limit) {
+		if (nodePtr) {
+		    key = (char *)nodePtr->key;
+		    if (strncmp(key, Tcl_DStringValue(&prefix),
+			    Tcl_DStringLength(&prefix))) {
+			break;
+		    }
+		    elObj = (Container*)nodePtr->value;
+		    nodePtr = Sv_IndexNext(nodePtr);
+		} else {
+		    key = (char *)Tcl_GetHashKey(&shardPtr->vars, hPtr);
+		    elObj = (Container*)Tcl_GetHashValue(hPtr);
+		    hPtr = (keyPattern.type == SV_MATCH_EXACT)
+			    ? NULL : Tcl_NextHashEntry(&search);
+		}
+		if (SV_EXPIRED(elObj)
+			|| !Sv_PatternMatch(&keyPattern, key, TCL_INDEX_NONE)) {
+		    continue;
+		}
+
+		/*
+		 * Values are matched by their string, without converting
+		 * the shared object, which the shared lock would not allow.
+		 * Only values without a string yet need the exclusive lock,
+		 * and the new string is counted in the array statistics.
+		 */
+
+		valueObj = NULL;
+		if (byValue) {
+		    if (elObj->repTypePtr) {
+			valueObj = GetValue(elObj);
+			Tcl_IncrRefCount(valueObj);
+			string = Tcl_GetStringFromObj(valueObj, &length);
+		    } else if (elObj->tclObj->bytes == NULL
+			    && (flags & FLAGS_READONLY)) {
+			goto queryRelock;
+		    } else if (elObj->tclObj->bytes == NULL) {
+			string = Tcl_GetStringFromObj(elObj->tclObj, &length);
+			CountValue(elObj, 0);
+			if (elObj->arrayPtr->policy != SV_EVICT_NONE) {
+			    AccountContainer(elObj, 1);
+			}
+		    } else {
+			string = Tcl_GetStringFromObj(elObj->tclObj, &length);
+		    }
+		    match = Sv_PatternMatch(&valueMatch, string, length);
+		    if (match && regExp) {
+			match = Tcl_RegExpExec(interp, regExp, string, string);
+			if (match < 0) {
+			    if (valueObj) {
+				Tcl_DecrRefCount(valueObj);
+			    }
+			    Tcl_DStringFree(&prefix);
+			    Tcl_DecrRefCount(resObj);
+			    ret = TCL_ERROR;
+			    goto cmdExit;
+			}
+		    }
+		    if (match && (hasMin || hasMax)) {
+			match = Tcl_GetDouble(NULL, string, &number) == TCL_OK
+				&& (!hasMin || number >= min)
+				&& (!hasMax || number <= max);
+		    }
+		    if (!match) {
+			if (valueObj) {
+			    Tcl_DecrRefCount(valueObj);
+			}
+			continue;
+		    }
+		}
+		found++;
+		if (!countOnly) {
+		    Tcl_ListObjAppendElement(NULL, resObj,
+			    Tcl_NewStringObj(key, TCL_INDEX_NONE));
+		}
+		if (!countOnly && !keysOnly) {
+		    if (valueObj == NULL) {
+			if ((flags & FLAGS_READONLY)
+				&& !SvIsReadable(elObj, flags)) {
+			    goto queryRelock;
+			}
+			valueObj = GetValue(elObj);
+			Tcl_IncrRefCount(valueObj);
+		    }
+		    Tcl_ListObjAppendElement(NULL, resObj, valueObj);
+		}
+		if (valueObj) {
+		    Tcl_DecrRefCount(valueObj);
+		}
+	    }
+	}
+	Tcl_DStringFree(&prefix);
+	if (countOnly) {
+	    Tcl_DecrRefCount(resObj);
+	    resObj = Tcl_NewWideIntObj(found);
+	}
+	Tcl_SetObjResult(interp, resObj);
+	goto cmdExit;
+
+    queryRelock:
+	Tcl_DStringFree(&prefix);
+	Tcl_DecrRefCount(resObj);
+	UnlockArray(arrayPtr);
+	flags &= ~FLAGS_READONLY;
+	goto relock;
+
+    } else if (index == ARANGE) {
+	static const char *const rangeOpts[] = {"-limit", NULL};
+	Tcl_WideInt limit = -1;
+	SvIndexNode **nodes, *nodePtr;
+	const char *from, *to;
+	Tcl_Obj *resObj;
+	int dummy, j;
+
+	if (objc != 5 && objc != 7) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "array from to ?-limit count?");
+	    ret = TCL_ERROR;
+	    goto cmdExit;
+	}
+	if (objc == 7) {
+	    if (Tcl_GetIndexFromObjStruct(interp, objv[5], rangeOpts,
+		    sizeof(char *), "option", 0, &dummy) != TCL_OK
+		    || Tcl_GetWideIntFromObj(interp, objv[6], &limit) != TCL_OK) {
+		ret = TCL_ERROR;
+		goto cmdExit;
+	    }
+	    if (limit < 0) {
+		Tcl_AppendResult(interp, "expected non-negative limit but got \"",
+			Tcl_GetString(objv[6]), "\"", (void *)NULL);
+		ret = TCL_ERROR;
+		goto cmdExit;
+	    }
+	}
+	if (arrayPtr == NULL) {
+	    goto cmdExit;
+	}
+	if (SHARD(arrayPtr, 0)->indexPtr == NULL) {
+	    Tcl_AppendResult(interp, "array \"", arrayName,
+		    "\" is not ordered", (void *)NULL);
+	    ret = TCL_ERROR;
+	    goto cmdExit;
+	}
+
+	/*
+	 * Each shard has an index of its own keys. Walk them all at
+	 * once, always taking the lowest key next.
+	 */
+
+	from = Tcl_GetString(objv[3]);
+	to = Tcl_GetString(objv[4]);
+	nodes = (SvIndexNode **)Tcl_Alloc(SHARD_COUNT(arrayPtr)
+		* sizeof(SvIndexNode *));
+	for (i = 0; i < SHARD_COUNT(arrayPtr); i++) {
+	    nodes[i] = Sv_IndexSeek(SHARD(arrayPtr, i)->indexPtr, from);
+	}
+	resObj = Tcl_NewListObj(0, NULL);
+	while (limit != 0) {
+	    for (i = 0, j = -1; i < SHARD_COUNT(arrayPtr); i++) {
+		if (nodes[i] && strcmp(nodes[i]->key, to) <= 0
+			&& (j < 0 || strcmp(nodes[i]->key, nodes[j]->key) < 0)) {
+		    j = (int)i;
+		}
+	    }
+	    if (j < 0) {
+		break;
+	    }
+	    nodePtr = nodes[j];
+	    nodes[j] = Sv_IndexNext(nodePtr);
+	    elObj = (Container*)nodePtr->value;
+	    if (SV_EXPIRED(elObj)) {
+		continue;
+	    }
+	    if ((flags & FLAGS_READONLY) && !SvIsReadable(elObj, flags)) {
+		Tcl_Free(nodes);
+		Tcl_DecrRefCount(resObj);
+		UnlockArray(arrayPtr);
+		flags &= ~FLAGS_READONLY;
+		goto relock;
+	    }
+	    Tcl_ListObjAppendElement(interp, resObj,
+		    Tcl_NewStringObj(nodePtr->key, TCL_INDEX_NONE));
+	    Tcl_ListObjAppendElement(interp, resObj, GetValue(elObj));
+	    if (limit > 0) {
+		limit--;
+	    }
+	}
+	Tcl_Free(nodes);
+	Tcl_SetObjResult(interp, resObj);
+
+    } else if (index == ABIND) {
+
+	/*
+	 * This is more complex operation, requiring some clarification.
+	 *
+	 * When binding an already existing array, we walk the array
+	 * first and store all key/value pairs found there in the
+	 * persistent storage. Then we proceed with the below.
+	 *
+	 * When binding an non-existent array, we open the persistent
+	 * storage and cache all key/value pairs found there into tne
+	 * newly created shared array.
+	 */
+
+	PsStore *psPtr;
+	Tcl_HashEntry *hPtr;
+	Tcl_Size len;
+	int isNew;
+	char *psurl, *key = NULL, *val = NULL;
+
+	if (objc < 4) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "array handle");
+	    ret = TCL_ERROR;
+	    goto cmdExit;
+	}
+
+	if (arrayPtr && arrayPtr->psPtr) {
+	    Tcl_AppendResult(interp, "array is already bound", (void *)NULL);
+	    ret = TCL_ERROR;
+	    goto cmdExit;
+	}
+	if (arrayPtr && arrayPtr->numShards) {
+	    Tcl_AppendResult(interp, "can't bind sharded array", (void *)NULL);
+	    ret = TCL_ERROR;
+	    goto cmdExit;
+	}
+	if (arrayPtr && arrayPtr->policy != SV_EVICT_NONE) {
+	    Tcl_AppendResult(interp, "can't bind array with eviction policy",
+		    (void *)NULL);
+	    ret = TCL_ERROR;
+	    goto cmdExit;
+	}
+
+	psurl = Tcl_GetStringFromObj(objv[3], &len);
+	psPtr = GetPsStore(psurl);
+
+	if (psPtr == NULL) {
+	    Tcl_AppendResult(interp, "can't open persistent storage on \"",
+			     psurl, "\"", (void *)NULL);
+	    ret = TCL_ERROR;
+	    goto cmdExit;
+	}
+	if (arrayPtr) {
+	    Tcl_HashSearch search;
+	    hPtr = Tcl_FirstHashEntry(&arrayPtr->vars,&search);
+	    arrayPtr->psPtr = psPtr;
+	    arrayPtr->bindAddr = strcpy((char *)Tcl_Alloc(len+1), psurl);
+	    while (hPtr) {
+
+		/*
+		 * Values do not change, so neither epochs are bumped nor
+		 * watches and waiters are told about it.
+		 */
+
+		svObj = (Container *)Tcl_GetHashValue(hPtr);
+		Sv_UpdateContainer(svObj);
+		if (PersistContainer(interp, svObj) != TCL_OK) {
+		    ret = TCL_ERROR;
+		    goto cmdExit;
+		}
+		CountValue(svObj, 0);
+		hPtr = Tcl_NextHashEntry(&search);
+	    }
+	} else {
+	    arrayPtr = LockArray(interp, arrayName, FLAGS_CREATEARRAY);
+	    arrayPtr->psPtr = psPtr;
+	    arrayPtr->bindAddr = strcpy((char *)Tcl_Alloc(len+1), psurl);
+	}
+	if (!psPtr->psFirst(psPtr->psHandle, &key, &val, &len)) {
+	    do {
+		Tcl_Obj * tclObj = Tcl_NewStringObj(val, len);
+		hPtr = Tcl_CreateHashEntry(&arrayPtr->vars, key, &isNew);
+		Tcl_SetHashValue(hPtr, CreateContainer(arrayPtr, hPtr, tclObj));
+		psPtr->psFree(psPtr->psHandle, val);
+	    } while (!psPtr->psNext(psPtr->psHandle, &key, &val, &len));
+	}
+
+    } else if (index == AUNBIND) {
+	if (!arrayPtr || !arrayPtr->psPtr) {
+	    Tcl_AppendResult(interp, "shared variable is not bound", (void *)NULL);
+	    ret = TCL_ERROR;
+	    goto cmdExit;
+	}
+	if (UnbindArray(interp, arrayPtr) != TCL_OK) {
+	    ret = TCL_ERROR;
+	    goto cmdExit;
+	}
+
+    } else if (index == ACONFIGURE) {
+	static const char *const configOpts[] = {
+	    "-maxbytes", "-maxkeys", "-policy", "-ttl", NULL
+	};
+	enum configOpts {CMAXBYTES, CMAXKEYS, CPOLICY, CTTL};
+	static const char *const policies[] = {"none", "lru", "clock", NULL};
+	Tcl_WideInt value, limits[2];
+	int opt, policy, j;
+
+	if ((objc % 2) == 0) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "array ?option value ...?");
+	    ret = TCL_ERROR;
+	    goto cmdExit;
+	}
+	if (arrayPtr == NULL) {
+	    arrayPtr = LockArray(interp, arrayName, FLAGS_CREATEARRAY);
+	}
+	if (objc == 3) {
+	    Tcl_Obj *resObj = Tcl_NewListObj(0, NULL);
+	    Tcl_ListObjAppendElement(NULL, resObj,
+		    Tcl_NewStringObj(configOpts[CMAXBYTES], TCL_INDEX_NONE));
+	    Tcl_ListObjAppendElement(NULL, resObj,
+		    Tcl_NewWideIntObj(arrayPtr->maxBytes));
+	    Tcl_ListObjAppendElement(NULL, resObj,
+		    Tcl_NewStringObj(configOpts[CMAXKEYS], TCL_INDEX_NONE));
+	    Tcl_ListObjAppendElement(NULL, resObj,
+		    Tcl_NewWideIntObj(arrayPtr->maxKeys));
+	    Tcl_ListObjAppendElement(NULL, resObj,
+		    Tcl_NewStringObj(configOpts[CPOLICY], TCL_INDEX_NONE));
+	    Tcl_ListObjAppendElement(NULL, resObj,
+		    Tcl_NewStringObj(policies[arrayPtr->policy], TCL_INDEX_NONE));
+	    Tcl_ListObjAppendElement(NULL, resObj,
+		    Tcl_NewStringObj(configOpts[CTTL], TCL_INDEX_NONE));
+	    Tcl_ListObjAppendElement(NULL, resObj,
+		    Tcl_NewWideIntObj(arrayPtr->ttl));
+	    Tcl_SetObjResult(interp, resObj);
+	}
+	policy = arrayPtr->policy;
+	limits[CMAXBYTES] = arrayPtr->maxBytes;
+	limits[CMAXKEYS]  = arrayPtr->maxKeys;
+	for (i = 3; i < objc; i += 2) {
+	    if (Tcl_GetIndexFromObjStruct(interp, objv[i], configOpts,
+		    sizeof(char *), "option", 0, &opt) != TCL_OK) {
+		ret = TCL_ERROR;
+		goto cmdExit;
+	    }
+	    switch ((enum configOpts) opt) {
+	    case CPOLICY:
+		if (Tcl_GetIndexFromObjStruct(interp, objv[i+1], policies,
+			sizeof(char *), "policy", 0, &policy) != TCL_OK) {
+		    ret = TCL_ERROR;
+		    goto cmdExit;
+		}
+		if (policy != SV_EVICT_NONE && arrayPtr->psPtr) {
+		    Tcl_AppendResult(interp, "can't evict keys of bound array",
+			    (void *)NULL);
+		    ret = TCL_ERROR;
+		    goto cmdExit;
+		}
+		break;
+	    case CMAXBYTES:
+	    case CMAXKEYS:
+	    case CTTL:
+		if (Tcl_GetWideIntFromObj(interp, objv[i+1], &value) != TCL_OK) {
+		    ret = TCL_ERROR;
+		    goto cmdExit;
+		}
+		if (value < 0) {
+		    Tcl_AppendResult(interp, "expected non-negative ",
+			    opt == CTTL ? "time to live" : "limit",
+			    " but got \"", Tcl_GetString(objv[i+1]), "\"",
+			    (void *)NULL);
+		    ret = TCL_ERROR;
+		    goto cmdExit;
+		}
+		if (opt != CTTL) {
+		    limits[opt] = value;
+		    break;
+		}
+		arrayPtr->ttl = value;
+		for (j = 0; j < arrayPtr->numShards; j++) {
+		    arrayPtr->shards[j]->ttl = value;
+		}
+		break;
+	    }
+	}
+
+	/*
+	 * Shards share the limits of the array evenly.
+	 */
+
+	SetEviction(arrayPtr, policy, limits[CMAXKEYS], limits[CMAXBYTES]);
+	for (j = 0; j < arrayPtr->numShards; j++) {
+	    SetEviction(arrayPtr->shards[j], policy,
+		    (limits[CMAXKEYS] + arrayPtr->numShards - 1) / arrayPtr->numShards,
+		    (limits[CMAXBYTES] + arrayPtr->numShards - 1) / arrayPtr->numShards);
+	}
+
+    } else if (index == ACREATE) {
+	static const char *const createOpts[] = {"-ordered", "-shards", NULL};
+	enum createOpts {CORDERED, CSHARDS};
+	int numShards = 0, ordered = 0, opt;
+
+	for (i = 3; i < objc; i++) {
+	    if (Tcl_GetIndexFromObjStruct(interp, objv[i], createOpts,
+		    sizeof(char *), "option", 0, &opt) != TCL_OK) {
+		ret = TCL_ERROR;
+		goto cmdExit;
+	    }
+	    if (opt == CORDERED) {
+		ordered = 1;
+		continue;
+	    }
+	    if (++i == objc) {
+		Tcl_WrongNumArgs(interp, 2, objv,
+			"array ?-shards count? ?-ordered?");
+		ret = TCL_ERROR;
+		goto cmdExit;
+	    }
+	    if (Tcl_GetIntFromObj(interp, objv[i], &numShards) != TCL_OK) {
+		ret = TCL_ERROR;
+		goto cmdExit;
+	    }
+	    if (numShards < 0) {
+		Tcl_AppendResult(interp, "expected non-negative shard count but"
+			" got \"", Tcl_GetString(objv[i]), "\"", (void *)NULL);
+		ret = TCL_ERROR;
+		goto cmdExit;
+	    }
+
+	    /*
+	     * Every shard gets its own bucket, other than the array one.
+	     */
+
+	    if ((size_t)numShards >= numBuckets) {
+		numShards = (int)numBuckets - 1;
+	    }
+	}
+	if (arrayPtr == NULL) {
+	    arrayPtr = CreateShardedArray(&buckets[SvHashString(arrayName)
+		    & (numBuckets - 1)], arrayName, numShards);
+	    if (arrayPtr != NULL) {
+		for (i = 0; ordered && i < SHARD_COUNT(arrayPtr); i++) {
+		    SHARD(arrayPtr, i)->indexPtr = Sv_IndexNew();
+		}
+		goto cmdExit;
+	    }
+	}
+	Tcl_AppendResult(interp, "array \"", arrayName,
+		"\" already exists", (void *)NULL);
+	ret = TCL_ERROR;
+    }
+
+ cmdExit:
+    if (arrayPtr) {
+	UnlockArray(arrayPtr);
+    }
+
+    return ret;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * ScanArray --
+ *
+ *      Implements "tsv::array scan". Each call visits a few slots of
+ *      the hash table of one array shard, locking only the bucket of
+ *      that shard, and returns the keys found there along with the
+ *      cursor to pass to the next call.
+ *
+ *      The cursor holds the shard number in its upper 32 bits and the
+ *      next slot of the hash table in the lower ones. Slots are visited
+ *      in the order of their reversed bits. Tcl hash tables grow by
+ *      splitting each slot into slots differing only in their upper
+ *      bits, which this order visits one right after the other. Keys
+ *      present during the whole scan are thus always returned, even if
+ *      the table grows meanwhile, though maybe more than once.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      See the user documentation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+ScanArray(
+	  Tcl_Interp *interp,                 /* Current interpreter. */
+	  Tcl_Size objc,                      /* Number of arguments. */
+	  Tcl_Obj *const objv[])              /* Argument objects. */
+{
+    static const char *const scanOpts[] = {
+	"-count", "-names", "-pattern", NULL
+    };
+    enum scanOpts {
+	SCOUNT, SNAMES, SPATTERN
+    };
+    const char *arrayName, *pattern = NULL, *key;
+    Tcl_WideInt cursor, count = 10, seen, slots;
+    unsigned int slot, first, mask;
+    int opt, names = 0, shard, numShards = 0;
+    int flags = FLAGS_NOERRMSG | FLAGS_READONLY;
+    Tcl_Size i;
+    SvPattern keyPattern;
+    Array *arrayPtr;
+    Tcl_HashTable *tablePtr;
+    Tcl_HashEntry *hPtr;
+    Container *elObj;
+    Tcl_Obj *listObj, *resObj;
+
+    if (objc < 4) {
+	Tcl_WrongNumArgs(interp, 2, objv,
+		"array cursor ?-count count? ?-pattern pattern? ?-names?");
+	return TCL_ERROR;
+    }
+    arrayName = Tcl_GetString(objv[2]);
+    if (Tcl_GetWideIntFromObj(interp, objv[3], &cursor) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (cursor < 0) {
+	Tcl_AppendResult(interp, "invalid cursor \"",
+		Tcl_GetString(objv[3]), "\"", (void *)NULL);
+	return TCL_ERROR;
+    }
+    for (i = 4; i < objc; i++) {
+	if (Tcl_GetIndexFromObjStruct(interp, objv[i], scanOpts,
+		sizeof(char *), "option", 0, &opt) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if (opt == SNAMES) {
+	    names = 1;
+	    continue;
+	}
+	if (++i == objc) {
+	    Tcl_AppendResult(interp, "missing value for option \"",
+		    Tcl_GetString(objv[i-1]), "\"", (void *)NULL);
+	    return TCL_ERROR;
+	}
+	if (opt == SPATTERN) {
+	    pattern = Tcl_GetString(objv[i]);
+	} else if (Tcl_GetWideIntFromObj(interp, objv[i], &count) != TCL_OK) {
+	    return TCL_ERROR;
+	} else if (count < 1) {
+	    Tcl_AppendResult(interp, "expected positive count but got \"",
+		    Tcl_GetString(objv[i]), "\"", (void *)NULL);
+	    return TCL_ERROR;
+	}
+    }
+
+    Sv_PatternInit(&keyPattern, pattern, 0);
+    shard = (int)(cursor >> 32);
+    first = (unsigned int)(cursor & 0xFFFFFFFFU);
+
+ relock:
+    arrayPtr = LockShard(interp, arrayName, NULL, shard, &numShards, flags);
+    Tcl_ResetResult(interp);
+    listObj = Tcl_NewListObj(0, NULL);
+    cursor = 0;
+    if (arrayPtr == NULL) {
+	goto done;
+    }
+    if (shard >= numShards) {
+	UnlockArray(arrayPtr);
+	goto done;
+    }
+
+    /*
+     * Visit at least one slot, then stop as soon as enough keys were
+     * seen, or after many more empty slots, to keep the lock short.
+     */
+
+    tablePtr = &arrayPtr->vars;
+    mask = (unsigned int)tablePtr->mask;
+    slot = first;
+    seen = slots = 0;
+    do {
+	for (hPtr = tablePtr->buckets[slot & mask]; hPtr;
+		hPtr = hPtr->nextPtr) {
+	    seen++;
+	    key = (const char *)Tcl_GetHashKey(tablePtr, hPtr);
+	    elObj = (Container*)Tcl_GetHashValue(hPtr);
+	    if (SV_EXPIRED(elObj)
+		    || !Sv_PatternMatch(&keyPattern, key, TCL_INDEX_NONE)) {
+		continue;
+	    }
+	    Tcl_ListObjAppendElement(NULL, listObj,
+		    Tcl_NewStringObj(key, TCL_INDEX_NONE));
+	    if (names) {
+		continue;
+	    }
+	    if ((flags & FLAGS_READONLY) && !SvIsReadable(elObj, flags)) {
+		Tcl_DecrRefCount(listObj);
+		UnlockArray(arrayPtr);
+		flags &= ~FLAGS_READONLY;
+		goto relock;
+	    }
+	    Tcl_ListObjAppendElement(NULL, listObj, GetValue(elObj));
+	}
+	slot = SvReverseBits(SvReverseBits(slot | ~mask) + 1);
+    } while (slot != 0 && seen < count && ++slots < count * 10);
+    UnlockArray(arrayPtr);
+
+    if (slot != 0) {
+	cursor = ((Tcl_WideInt)shard << 32) | slot;
+    } else if (shard + 1 < numShards) {
+	cursor = (Tcl_WideInt)(shard + 1) << 32;
+    }
+
+ done:
+    resObj = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, resObj, Tcl_NewWideIntObj(cursor));
+    Tcl_ListObjAppendElement(NULL, resObj, listObj);
+    Tcl_SetObjResult(interp, resObj);
+
+    return TCL_OK;
 }
-#endif /* SV_FINALIZE */
 
 /*
  *-----------------------------------------------------------------------------
  *
- * Sv_DuplicateObj --
+ * SvUnsetObjCmd --
  *
- *  Create and return a new object that is (mostly) a duplicate of the
- *  argument object. We take care that the duplicate object is either
- *  a proper object copy, i.e. w/o hidden references to original object
- *  elements or a plain string object, i.e one w/o internal representation.
+ *      This procedure is invoked to process the "tsv::unset" command.
+ *      See the user documentation for details on what it does.
  *
- *  Decision about whether to produce a real duplicate or a string object
- *  is done as follows:
+ * Results:
+ *      A standard Tcl result.
  *
- *     1) Scalar Tcl object types are properly copied by default;
- *        these include: boolean, int double, string and byteArray types.
- *     2) Object registered with Sv_RegisterObjType are duplicated
- *        using custom duplicator function which is guaranteed to
- *        produce a proper deep copy of the object in question.
- *     3) All other object types are stringified; these include
- *        miscelaneous Tcl objects (cmdName, nsName, bytecode, etc, etc)
- *        and all user-defined objects.
+ * Side effects:
+ *      See the user documentation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SvUnsetObjCmd(
+	      TCL_UNUSED(void *),                 /* Not used. */
+	      Tcl_Interp *interp,                 /* Current interpreter. */
+	      Tcl_Size objc,                   /* Number of arguments. */
+	      Tcl_Obj *const objv[])              /* Argument objects. */
+{
+    Tcl_Size ii;
+    const char *arrayName;
+    Array *arrayPtr;
+
+    if (objc < 2) {
+	Tcl_WrongNumArgs(interp, 1, objv, "array ?key ...?");
+	return TCL_ERROR;
+    }
+
+    arrayName = Tcl_GetString(objv[1]);
+    arrayPtr  = LockArray(interp, arrayName, 0);
+
+    if (arrayPtr == NULL) {
+	return TCL_ERROR;
+    }
+    if (objc == 2) {
+	Bucket *bucketPtr = arrayPtr->bucketPtr;
+	int numShards = arrayPtr->numShards;
+	int ret = DeleteArray(interp, arrayPtr);
+
+	/*
+	 * The array is gone, so unlock its buckets directly.
+	 */
+
+	UnlockShards(bucketPtr, numShards);
+	if (ret != TCL_OK) {
+	    return TCL_ERROR;
+	}
+    } else {
+	for (ii = 2; ii < objc; ii++) {
+	    const char *key = Tcl_GetString(objv[ii]);
+	    Tcl_HashEntry *hPtr = Tcl_FindHashEntry(&GetShard(arrayPtr, key)->vars, key);
+	    if (hPtr) {
+		if (DeleteContainer((Container*)Tcl_GetHashValue(hPtr))
+		    != TCL_OK) {
+		    UnlockArray(arrayPtr);
+		    return TCL_ERROR;
+		}
+	    } else {
+		UnlockArray(arrayPtr);
+		Tcl_AppendResult(interp,"no key ",arrayName,"(",key,")",(void *)NULL);
+		return TCL_ERROR;
+	    }
+	}
+	UnlockArray(arrayPtr);
+    }
+
+    return TCL_OK;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvNamesObjCmd --
+ *
+ *      This procedure is invoked to process the "tsv::names" command.
+ *      See the user documentation for details on what it does.
  *
  * Results:
- *      The return value is a pointer to a newly created Tcl_Obj. This
- *      object has reference count 0 and the same type, if any, as the
- *      source object objPtr. Also:
+ *      A standard Tcl result.
  *
- *        1) If the source object has a valid string rep, we copy it;
- *           otherwise, the new string rep is marked invalid.
- *        2) If the source object has an internal representation (i.e. its
- *           typePtr is non-NULL), the new object's internal rep is set to
- *           a copy; otherwise the new internal rep is marked invalid.
+ * Side effects:
+ *      See the user documentation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SvNamesObjCmd(
+	      void *arg,                     /* != NULL if aolSpecial */
+	      Tcl_Interp *interp,                 /* Current interpreter. */
+	      Tcl_Size objc,                   /* Number of arguments. */
+	      Tcl_Obj *const objv[])              /* Argument objects. */
+{
+    size_t i;
+    const char *pattern = NULL;
+    SvPattern namePattern;
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+    Tcl_Obj *resObj;
+
+    if (objc > 2) {
+	Tcl_WrongNumArgs(interp, 1, objv, "?pattern?");
+	return TCL_ERROR;
+    }
+    if (objc == 2) {
+	pattern = Tcl_GetString(objv[1]);
+    }
+    Sv_PatternInit(&namePattern, pattern, 0);
+
+    resObj = Tcl_NewListObj(0, NULL);
+
+    for (i = 0; i < numBuckets; i++) {
+	Bucket *bucketPtr = &buckets[i];
+	RLOCK_BUCKET(bucketPtr);
+	hPtr = Tcl_FirstHashEntry(&bucketPtr->arrays, &search);
+	while (hPtr) {
+	    char *key = (char *)Tcl_GetHashKey(&bucketPtr->arrays, hPtr);
+	    if ((arg==NULL || (*key != '.')) /* Hide .<name> arrays for AOL*/ &&
+		Sv_PatternMatch(&namePattern, key, TCL_INDEX_NONE)) {
+		Tcl_ListObjAppendElement(interp, resObj,
+			Tcl_NewStringObj(key, TCL_INDEX_NONE));
+	    }
+	    hPtr = Tcl_NextHashEntry(&search);
+	}
+	UNLOCK_BUCKET(bucketPtr);
+    }
+
+    Tcl_SetObjResult(interp, resObj);
+
+    return TCL_OK;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvGetObjCmd --
+ *
+ *      This procedure is invoked to process "tsv::get" command.
+ *      See the user documentation for details on what it does.
+ *
+ * Results:
+ *      A standard Tcl result.
  *
  * Side effects:
- *  Some object may, when copied, loose their type, i.e. will become
- *  just plain string objects.
+ *      See the user documentation.
  *
  *-----------------------------------------------------------------------------
  */
 
-Tcl_Obj *
-Sv_DuplicateObj(
-    Tcl_Obj *objPtr        /* The object to duplicate. */
-) {
-    Tcl_Obj *dupPtr = Tcl_NewObj();
+static int
+SvGetObjCmd(
+	    void *arg,                     /* Pointer to object container. */
+	    Tcl_Interp *interp,                 /* Current interpreter. */
+	    Tcl_Size objc,                   /* Number of arguments. */
+	    Tcl_Obj *const objv[])              /* Argument objects. */
+{
+    int ret, version;
+    Tcl_Size off, first = arg ? 2 : 1;
+    Tcl_WideInt epoch;
+    Tcl_Obj *res, *args[SV_MAXARGS];
+    Container *svObj = (Container*)arg;
 
     /*
-     * Handle the internal rep
+     * Syntax:
+     *          tsv::get ?-version? array key ?var?
+     *          $object get ?-version? ?var?
      */
 
-    if (objPtr->typePtr != NULL) {
-	if (objPtr->typePtr->dupIntRepProc == NULL) {
-	    dupPtr->internalRep = objPtr->internalRep;
-	    dupPtr->typePtr = objPtr->typePtr;
-	    Tcl_InvalidateStringRep(dupPtr);
+    version = SvStripOption(&objc, &objv, first, "-version", args);
+    if (version < 0) {
+	Tcl_WrongNumArgs(interp, first, objv,
+		arg ? "?-version? ?var?" : "?-version? array key ?var?");
+	return TCL_ERROR;
+    }
+
+    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off,
+	    FLAGS_READONLY|FLAGS_KEEPREP);
+    switch (ret) {
+    case TCL_BREAK:
+	if (objc == off) {
+	    return TCL_ERROR;
 	} else {
-	    if (   objPtr->typePtr == booleanObjTypePtr    \
-		|| objPtr->typePtr == byteArrayObjTypePtr  \
-		|| objPtr->typePtr == doubleObjTypePtr     \
-		|| objPtr->typePtr == intObjTypePtr        \
-		|| objPtr->typePtr == wideIntObjTypePtr    \
-		|| objPtr->typePtr == stringObjTypePtr) {
-	       /*
-		* Cover all "safe" obj types (see header comment)
-		*/
-	      (*objPtr->typePtr->dupIntRepProc)(objPtr, dupPtr);
-	      if (dupPtr->typePtr != NULL) {
-		  Tcl_InvalidateStringRep(dupPtr);
-	      }
-	    } else {
-		int found = 0;
-		RegType *regPtr;
-	       /*
-		* Cover special registered types. Assume not
-		* very many of those, so this sequential walk
-		* should be fast enough.
-		*/
-		for (regPtr = regType; regPtr; regPtr = regPtr->nextPtr) {
-		    if (objPtr->typePtr == regPtr->typePtr) {
-			(*regPtr->dupIntRepProc)(objPtr, dupPtr);
-			if (dupPtr->typePtr != NULL) {
-			    Tcl_InvalidateStringRep(dupPtr);
-			}
-			found = 1;
-			break;
-		    }
-		}
-	       /*
-		* Assure at least string rep of the source
-		* is present, which will be copied below.
-		*/
-		if (found == 0 && objPtr->bytes == NULL
-		    && objPtr->typePtr->updateStringProc != NULL) {
-		    (*objPtr->typePtr->updateStringProc)(objPtr);
-		}
-	    }
+	    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+	    return TCL_OK;
 	}
+    case TCL_ERROR:
+	return TCL_ERROR;
     }
 
+    res = GetValue(svObj);
+    epoch = SvAtomicGet(&svObj->epoch);
+
     /*
-     * Handle the string rep
+     * Release the container before setting the variable, since
+     * variable traces may want to modify the shared array.
      */
 
-    if (objPtr->bytes == NULL) {
-	if (dupPtr->bytes != Sv_tclEmptyStringRep) {
-	    dupPtr->bytes = NULL;
+    ret = Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+    if (ret != TCL_OK) {
+	Tcl_DecrRefCount(res);
+	return ret;
+    }
+
+    if (objc == off) {
+	if (version) {
+	    Tcl_Obj *pair[2];
+	    pair[0] = res;
+	    pair[1] = Tcl_NewWideIntObj(epoch);
+	    res = Tcl_NewListObj(2, pair);
 	}
-    } else if (objPtr->bytes != Sv_tclEmptyStringRep) {
-	/* A copy of TclInitStringRep macro */
-	dupPtr->bytes = (char *)Tcl_Alloc(objPtr->length + 1);
-	if (objPtr->length > 0) {
-	    memcpy(dupPtr->bytes, objPtr->bytes,
-		    objPtr->length);
+	Tcl_SetObjResult(interp, res);
+    } else {
+	if (Tcl_ObjSetVar2(interp, objv[off], NULL, res, 0) == NULL) {
+	    return TCL_ERROR;
+	}
+	if (version) {
+	    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(epoch));
+	} else {
+	    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
 	}
-	dupPtr->length = objPtr->length;
-	dupPtr->bytes[objPtr->length] = '\0';
     }
 
-    return dupPtr;
+    return TCL_OK;
 }
 
 /*
  *-----------------------------------------------------------------------------
  *
- * SvObjDispatchObjCmd --
+ * SvExistsObjCmd --
  *
- *      The method command for dispatching sub-commands of the shared
- *      object.
+ *      This procedure is invoked to process "tsv::exists" command.
+ *      See the user documentation for details on what it does.
  *
  * Results:
  *      A standard Tcl result.
  *
  * Side effects:
- *      Depends on the dispatched command
+ *      See the user documentation.
  *
  *-----------------------------------------------------------------------------
  */
 
 static int
-SvObjDispatchObjCmd(
-		    void *arg,                     /* Pointer to object container. */
-		    Tcl_Interp *interp,                 /* Current interpreter. */
-		    Tcl_Size objc,                           /* Number of arguments. */
-		    Tcl_Obj *const objv[])              /* Argument objects. */
+SvExistsObjCmd(
+	       void *arg,                     /* Pointer to object container. */
+	       Tcl_Interp *interp,                 /* Current interpreter. */
+	       Tcl_Size objc,                   /* Number of arguments. */
+	       Tcl_Obj *const objv[])              /* Argument objects. */
 {
-    const char *cmdName;
-    SvCmdInfo *cmdPtr;
-
-    if (objc < 2) {
-	Tcl_WrongNumArgs(interp, 1, objv, "args");
-	return TCL_ERROR;
-    }
-
-    cmdName = Tcl_GetString(objv[1]);
+    Tcl_Size off;
+    int ret;
+    Container *svObj = (Container*)arg;
 
     /*
-     * Do simple linear search. We may later replace this list
-     * with the hash table to gain speed. Currently, the list
-     * of registered commands is so small, so this will work
-     * fast enough.
+     * Syntax:
+     *          tsv::exists array key
+     *          $object exists
      */
 
-    for (cmdPtr = svCmdInfo; cmdPtr; cmdPtr = cmdPtr->nextPtr) {
-	if (!strcmp(cmdPtr->name, cmdName)) {
-	    return (*cmdPtr->objProcPtr)(arg, interp, objc, objv);
-	}
+    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off,
+	    FLAGS_READONLY|FLAGS_KEEPREP);
+    switch (ret) {
+    case TCL_BREAK: /* Array/key not found */
+	Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+	return TCL_OK;
+    case TCL_ERROR:
+	return TCL_ERROR;
     }
 
-    Tcl_AppendResult(interp, "invalid command name \"", cmdName, "\"", (void *)NULL);
-    return TCL_ERROR;
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
+
+    return Sv_PutContainer(interp, svObj, SV_UNCHANGED);
 }
 
 /*
  *-----------------------------------------------------------------------------
  *
- * SvObjObjCmd --
+ * SvSetObjCmd --
  *
- *      Creates the object command for a shared array.
+ *      This procedure is invoked to process the "tsv::set" command.
+ *      See the user documentation for details on what it does.
  *
  * Results:
  *      A standard Tcl result.
  *
  * Side effects:
- *      New Tcl command gets created.
+ *      See the user documentation.
  *
  *-----------------------------------------------------------------------------
  */
 
 static int
-SvObjObjCmd(
-	    void *arg,                     /* != NULL if aolSpecial */
+SvSetObjCmd(
+	    void *arg,                     /* Pointer to object container */
 	    Tcl_Interp *interp,                 /* Current interpreter. */
 	    Tcl_Size objc,                   /* Number of arguments. */
 	    Tcl_Obj *const objv[])              /* Argument objects. */
 {
-    int isNew, ret, flg;
-    Tcl_Size off;
-    char buf[128];
-    Tcl_Obj *val = NULL;
-    Container *svObj = NULL;
+    int ret, flg, mode, frozen = 0, move = 0, hasTtl = 0;
+    Tcl_Size i, off, first = arg ? 2 : 1;
+    Tcl_WideInt ttl = 0;
+    Tcl_Obj *val, *newObj = NULL, *takenObj = NULL, *args[SV_MAXARGS];
+    Container *svObj = (Container*)arg;
 
     /*
-     * Syntax: sv::object array key ?var?
+     * Syntax:
+     *          tsv::set ?-frozen|-move? ?-ttl ms? array key ?value|varName?
+     *          $object set ?-frozen|-move? ?-ttl ms? ?value|varName?
      */
 
-    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, 0);
-    switch (ret) {
-    case TCL_BREAK: /* Shared array was not found */
-	if (objc != off) {
-	    val = objv[off];
+    for (i = first; i < objc; i++) {
+	const char *opt = Tcl_GetString(objv[i]);
+	if (!strcmp(opt, "-frozen")) {
+	    frozen = 1;
+	} else if (!strcmp(opt, "-move")) {
+	    move = 1;
+	} else if (!strcmp(opt, "-ttl") && i + 1 < objc) {
+	    if (Tcl_GetWideIntFromObj(interp, objv[++i], &ttl) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if (ttl < 0) {
+		Tcl_AppendResult(interp, "expected non-negative time to live"
+			" but got \"", Tcl_GetString(objv[i]), "\"", (void *)NULL);
+		return TCL_ERROR;
+	    }
+	    hasTtl = 1;
+	} else {
+	    break;
 	}
-	Tcl_ResetResult(interp);
-	flg = FLAGS_CREATEARRAY | FLAGS_CREATEVAR;
-	ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, flg);
-	if (ret != TCL_OK) {
+    }
+    if (SvShiftArgs(&objc, &objv, first, i - first, args) != TCL_OK
+	    || (frozen && move)
+	    || ((frozen || move) && objc != first + (arg ? 1 : 3))) {
+	Tcl_WrongNumArgs(interp, first, objv, arg
+		? "?-frozen|-move? ?-ttl ms? ?value|varName?"
+		: "?-frozen|-move? ?-ttl ms? array key ?value|varName?");
+	return TCL_ERROR;
+    }
+
+    /*
+     * The new value is prepared before taking the lock.
+     */
+
+    if (frozen) {
+	newObj = NewFrozenObj(objv[objc-1]);
+	Tcl_IncrRefCount(newObj);
+    } else if (move) {
+	newObj = SvTakeVar(interp, objv[objc-1], &takenObj);
+	if (newObj == NULL) {
 	    return TCL_ERROR;
 	}
-	Tcl_DecrRefCount(svObj->tclObj);
-	svObj->tclObj = Sv_DuplicateObj(val ? val : Tcl_NewObj());
-	Tcl_IncrRefCount(svObj->tclObj);
+    }
+
+    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, FLAGS_KEEPREP);
+    switch (ret) {
+    case TCL_BREAK:
+	if (objc == off) {
+	    return TCL_ERROR;
+	} else {
+	    Tcl_ResetResult(interp);
+	    flg = FLAGS_CREATEARRAY | FLAGS_CREATEVAR;
+	    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, flg);
+	    if (ret != TCL_OK) {
+		goto cmd_err;
+	    }
+	}
 	break;
     case TCL_ERROR:
-	return TCL_ERROR;
+	goto cmd_err;
     }
-
-    if (svObj->handlePtr == NULL) {
-	Tcl_HashTable *handles = &svObj->arrayPtr->bucketPtr->handles;
-	svObj->handlePtr = Tcl_CreateHashEntry(handles, (char*)svObj, &isNew);
+    if (objc != off) {
+	val = objv[off];
+	Sv_UpdateContainer(svObj);
+	Tcl_DecrRefCount(svObj->tclObj);
+	if (newObj) {
+	    svObj->tclObj = newObj;
+	    if (takenObj) {
+		Tcl_DecrRefCount(takenObj); /* Maybe newObj, so while locked */
+	    }
+	} else {
+	    svObj->tclObj = Sv_DuplicateObj(val);
+	    Tcl_IncrRefCount(svObj->tclObj);
+	}
+	mode = SV_CHANGED;
+	if (!hasTtl) {
+	    ResetExpiry(svObj);
+	}
+    } else {
+	val = GetValue(svObj);
+	mode = SV_UNCHANGED;
+    }
+    if (hasTtl) {
+	SetExpiry(svObj, ttl ? SvNow() + ttl : 0);
     }
 
-    /*
-     * Format the command name
-     */
+    if (!move) {
+	Tcl_SetObjResult(interp, val);
+    }
 
-    snprintf(buf, sizeof(buf), "::%p", svObj);
-    svObj->aolSpecial = (arg != NULL);
-    Tcl_CreateObjCommand2(interp, buf, SvObjDispatchObjCmd, svObj, NULL);
-    Tcl_ResetResult(interp);
-    Tcl_SetObjResult(interp, Tcl_NewStringObj(buf, TCL_INDEX_NONE));
+    return Sv_PutContainer(interp, svObj, mode);
 
-    return Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+ cmd_err:
+    if (takenObj) {
+	Tcl_ObjSetVar2(interp, objv[objc-1], NULL, takenObj, 0);
+	Tcl_DecrRefCount(takenObj);
+    }
+    if (newObj) {
+	Tcl_DecrRefCount(newObj);
+    }
+    return TCL_ERROR;
 }
 
 /*
  *-----------------------------------------------------------------------------
  *
- * SvArrayObjCmd --
+ * SvTakeVar --
  *
- *      This procedure is invoked to process the "tsv::array" command.
- *      See the user documentation for details on what it does.
+ *      Takes the value out of the given variable, which is unset, for
+ *      storing it in a shared array. If nothing else refers to the
+ *      value, and the value is of a type which is safe to use from
+ *      another thread, it is handed over as it is. Otherwise, it is
+ *      copied with Sv_DuplicateObj.
  *
  * Results:
- *      A standard Tcl result.
+ *      The value to store, with a reference held, or NULL on error.
+ *      The value taken out of the variable is left in takenPtr, with
+ *      another reference held, so that the caller can put it back if
+ *      the value can not be stored after all.
  *
  * Side effects:
- *      See the user documentation.
+ *      The variable is unset.
  *
  *-----------------------------------------------------------------------------
  */
 
-static int
-SvArrayObjCmd(
-	      void *arg,                     /* Pointer to object container. */
-	      Tcl_Interp *interp,                 /* Current interpreter. */
-	      Tcl_Size objc,                   /* Number of arguments. */
-	      Tcl_Obj *const objv[])              /* Argument objects. */
+static Tcl_Obj *
+SvTakeVar(
+	  Tcl_Interp *interp,                 /* Current interpreter. */
+	  Tcl_Obj *varObj,                    /* Name of the variable */
+	  Tcl_Obj **takenPtr)                 /* Gets the value taken */
 {
-    int ret = TCL_OK;
-    Tcl_Size i, argx = 0, lobjc = 0;
-    const char *arrayName = NULL;
-    Array *arrayPtr = NULL;
-    Tcl_Obj **lobjv = NULL;
-    Container *svObj, *elObj = NULL;
-
-    static const char *const opts[] = {
-	"set",  "reset", "get", "names", "size", "exists", "isbound",
-	"bind", "unbind", NULL
-    };
-    enum options {
-	ASET,   ARESET,  AGET,  ANAMES,  ASIZE,  AEXISTS, AISBOUND,
-	ABIND,  AUNBIND
-    };
-    int index;
-
-    svObj = (Container*)arg;
+    Tcl_Obj *objPtr, *dupPtr;
 
-    if (objc < 3) {
-	Tcl_WrongNumArgs(interp, 1, objv, "option array");
-	return TCL_ERROR;
+    objPtr = Tcl_ObjGetVar2(interp, varObj, NULL, TCL_LEAVE_ERR_MSG);
+    if (objPtr == NULL) {
+	return NULL;
     }
-
-    arrayName = Tcl_GetString(objv[2]);
-    arrayPtr  = LockArray(interp, arrayName, FLAGS_NOERRMSG);
-
-    if (objc > 3) {
-	argx = 3;
+    Tcl_IncrRefCount(objPtr);
+    if (Tcl_UnsetVar2(interp, Tcl_GetString(varObj), NULL,
+	    TCL_LEAVE_ERR_MSG) != TCL_OK) {
+	Tcl_DecrRefCount(objPtr);
+	return NULL;
     }
 
-    Tcl_ResetResult(interp);
-
-    if (Tcl_GetIndexFromObjStruct(interp,objv[1],opts, sizeof(char *),"option",0,&index) != TCL_OK) {
-	ret = TCL_ERROR;
-
-    } else if (index == AEXISTS) {
-	Tcl_SetIntObj(Tcl_GetObjResult(interp), arrayPtr!=0);
-
-    } else if (index == AISBOUND) {
-	if (arrayPtr == NULL) {
-	    Tcl_SetIntObj(Tcl_GetObjResult(interp), 0);
-	} else {
-	    Tcl_SetIntObj(Tcl_GetObjResult(interp), arrayPtr->psPtr!=0);
-	}
-
-    } else if (index == ASIZE) {
-	if (arrayPtr == NULL) {
-	    Tcl_SetIntObj(Tcl_GetObjResult(interp), 0);
-	} else {
-	    Tcl_SetWideIntObj(Tcl_GetObjResult(interp), (Tcl_WideInt)arrayPtr->vars.numEntries);
-	}
-
-    } else if (index == ASET || index == ARESET) {
-	if (argx == (objc - 1)) {
-	    if (argx && Tcl_ListObjGetElements(interp, objv[argx], &lobjc,
-		    &lobjv) != TCL_OK) {
-		ret = TCL_ERROR;
-		goto cmdExit;
-	    }
-	} else {
-	    lobjc = objc - 3;
-	    lobjv = (Tcl_Obj**)objv + 3;
-	}
-	if (lobjc & 1) {
-	    Tcl_AppendResult(interp, "list must have an even number"
-		    " of elements", (void *)NULL);
-	    ret = TCL_ERROR;
-	    goto cmdExit;
-	}
-	if (arrayPtr == NULL) {
-	    arrayPtr = LockArray(interp, arrayName, FLAGS_CREATEARRAY);
-	}
-	if (index == ARESET) {
-	    ret = FlushArray(arrayPtr);
-	    if (ret != TCL_OK) {
-		if (arrayPtr->psPtr) {
-		    PsStore *psPtr = arrayPtr->psPtr;
-		    const char *err = psPtr->psError(psPtr->psHandle);
-		    Tcl_SetObjResult(interp, Tcl_NewStringObj(err, TCL_INDEX_NONE));
-		}
-		goto cmdExit;
-	    }
-	}
-	for (i = 0; i < lobjc; i += 2) {
-	    const char *key = Tcl_GetString(lobjv[i]);
-	    elObj = AcquireContainer(arrayPtr, key, FLAGS_CREATEVAR);
-	    Tcl_DecrRefCount(elObj->tclObj);
-	    elObj->tclObj = Sv_DuplicateObj(lobjv[i+1]);
-	    Tcl_IncrRefCount(elObj->tclObj);
-	    if (ReleaseContainer(interp, elObj, SV_CHANGED) != TCL_OK) {
-		ret = TCL_ERROR;
-		goto cmdExit;
-	    }
-	}
-
-    } else if (index == AGET || index == ANAMES) {
-	if (arrayPtr) {
-	    Tcl_HashSearch search;
-	    Tcl_Obj *resObj = Tcl_NewListObj(0, NULL);
-	    const char *pattern = (argx == 0) ? NULL : Tcl_GetString(objv[argx]);
-	    Tcl_HashEntry *hPtr = Tcl_FirstHashEntry(&arrayPtr->vars,&search);
-	    while (hPtr) {
-		char *key = (char *)Tcl_GetHashKey(&arrayPtr->vars, hPtr);
-		if (pattern == NULL || Tcl_StringCaseMatch(key, pattern, 0)) {
-		    Tcl_ListObjAppendElement(interp, resObj,
-			    Tcl_NewStringObj(key, TCL_INDEX_NONE));
-		    if (index == AGET) {
-			elObj = (Container*)Tcl_GetHashValue(hPtr);
-			Tcl_ListObjAppendElement(interp, resObj,
-				Sv_DuplicateObj(elObj->tclObj));
-		    }
-		}
-		hPtr = Tcl_NextHashEntry(&search);
-	    }
-	    Tcl_SetObjResult(interp, resObj);
-	}
+    /*
+     * Only flat values can be handed over. Elements of lists and
+     * dicts may be shared with other objects of this thread, and
+     * so may be their internal representations.
+     */
 
-    } else if (index == ABIND) {
+    if (objPtr->refCount == 1 && (objPtr->typePtr == NULL
+	    || objPtr->typePtr == booleanObjTypePtr
+	    || objPtr->typePtr == byteArrayObjTypePtr
+	    || objPtr->typePtr == doubleObjTypePtr
+	    || objPtr->typePtr == intObjTypePtr
+	    || objPtr->typePtr == wideIntObjTypePtr
+	    || objPtr->typePtr == stringObjTypePtr
+	    || objPtr->typePtr == &frozenObjType)) {
+	dupPtr = objPtr;
+    } else {
+	dupPtr = Sv_DuplicateObj(objPtr);
+    }
+    Tcl_IncrRefCount(dupPtr);
+    *takenPtr = objPtr;
 
-	/*
-	 * This is more complex operation, requiring some clarification.
-	 *
-	 * When binding an already existing array, we walk the array
-	 * first and store all key/value pairs found there in the
-	 * persistent storage. Then we proceed with the below.
-	 *
-	 * When binding an non-existent array, we open the persistent
-	 * storage and cache all key/value pairs found there into tne
-	 * newly created shared array.
-	 */
+    return dupPtr;
+}
 
-	PsStore *psPtr;
-	Tcl_HashEntry *hPtr;
-	Tcl_Size len;
-	int isNew;
-	char *psurl, *key = NULL, *val = NULL;
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvCasObjCmd --
+ *
+ *      This procedure is invoked to process the "tsv::cas" command.
+ *      See the user documentation for details on what it does.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      See the user documentation.
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-	if (objc < 4) {
-	    Tcl_WrongNumArgs(interp, 2, objv, "array handle");
-	    ret = TCL_ERROR;
-	    goto cmdExit;
-	}
+static int
+SvCasObjCmd(
+	    void *arg,                     /* Pointer to object container */
+	    Tcl_Interp *interp,                 /* Current interpreter. */
+	    Tcl_Size objc,                   /* Number of arguments. */
+	    Tcl_Obj *const objv[])              /* Argument objects. */
+{
+    int ret;
+    Tcl_Size off;
+    Tcl_WideInt expected;
+    Container *svObj = (Container*)arg;
 
-	if (arrayPtr && arrayPtr->psPtr) {
-	    Tcl_AppendResult(interp, "array is already bound", (void *)NULL);
-	    ret = TCL_ERROR;
-	    goto cmdExit;
-	}
+    /*
+     * Syntax:
+     *          tsv::cas array key version value
+     *          $object cas version value
+     */
 
-	psurl = Tcl_GetStringFromObj(objv[3], &len);
-	psPtr = GetPsStore(psurl);
+    if (objc != (arg ? 4 : 5)) {
+	Tcl_WrongNumArgs(interp, arg ? 2 : 1, objv,
+		arg ? "version value" : "array key version value");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetWideIntFromObj(interp, objv[objc-2], &expected) != TCL_OK) {
+	return TCL_ERROR;
+    }
 
-	if (psPtr == NULL) {
-	    Tcl_AppendResult(interp, "can't open persistent storage on \"",
-			     psurl, "\"", (void *)NULL);
-	    ret = TCL_ERROR;
-	    goto cmdExit;
-	}
-	if (arrayPtr) {
-	    Tcl_HashSearch search;
-	    hPtr = Tcl_FirstHashEntry(&arrayPtr->vars,&search);
-	    arrayPtr->psPtr = psPtr;
-	    arrayPtr->bindAddr = strcpy((char *)Tcl_Alloc(len+1), psurl);
-	    while (hPtr) {
-		svObj = (Container *)Tcl_GetHashValue(hPtr);
-		if (ReleaseContainer(interp, svObj, SV_CHANGED) != TCL_OK) {
-		    ret = TCL_ERROR;
-		    goto cmdExit;
-		}
-		hPtr = Tcl_NextHashEntry(&search);
-	    }
-	} else {
-	    arrayPtr = LockArray(interp, arrayName, FLAGS_CREATEARRAY);
-	    arrayPtr->psPtr = psPtr;
-	    arrayPtr->bindAddr = strcpy((char *)Tcl_Alloc(len+1), psurl);
+    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, FLAGS_KEEPREP);
+    switch (ret) {
+    case TCL_BREAK:
+	if (arg != NULL) {
+	    return TCL_ERROR;
 	}
-	if (!psPtr->psFirst(psPtr->psHandle, &key, &val, &len)) {
-	    do {
-		Tcl_Obj * tclObj = Tcl_NewStringObj(val, len);
-		hPtr = Tcl_CreateHashEntry(&arrayPtr->vars, key, &isNew);
-		Tcl_SetHashValue(hPtr, CreateContainer(arrayPtr, hPtr, tclObj));
-		psPtr->psFree(psPtr->psHandle, val);
-	    } while (!psPtr->psNext(psPtr->psHandle, &key, &val, &len));
+	Tcl_ResetResult(interp);
+	if (expected != 0) {
+	    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+	    return TCL_OK;
 	}
 
-    } else if (index == AUNBIND) {
-	if (!arrayPtr || !arrayPtr->psPtr) {
-	    Tcl_AppendResult(interp, "shared variable is not bound", (void *)NULL);
-	    ret = TCL_ERROR;
-	    goto cmdExit;
+	/*
+	 * Version 0 stands for the missing key, so create it. Another
+	 * thread may have created and set the key since, while the
+	 * array was not locked. Keys nobody has set yet have version 1
+	 * and an empty value, others do not match.
+	 */
+
+	ret = Sv_GetContainer(interp, objc, objv, &svObj, &off,
+		FLAGS_CREATEARRAY | FLAGS_CREATEVAR);
+	if (ret != TCL_OK) {
+	    return TCL_ERROR;
 	}
-	if (UnbindArray(interp, arrayPtr) != TCL_OK) {
-	    ret = TCL_ERROR;
-	    goto cmdExit;
+	if (svObj->epoch == 1 && svObj->repTypePtr == NULL
+		&& svObj->tclObj->typePtr == NULL
+		&& svObj->tclObj->length == 0) {
+	    expected = svObj->epoch;
 	}
+	break;
+    case TCL_ERROR:
+	return TCL_ERROR;
     }
 
- cmdExit:
-    if (arrayPtr) {
-	UnlockArray(arrayPtr);
+    if (svObj->epoch != expected) {
+	Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+	return Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+    }
+
+    Sv_UpdateContainer(svObj);
+    Tcl_DecrRefCount(svObj->tclObj);
+    svObj->tclObj = Sv_DuplicateObj(objv[off+1]);
+    Tcl_IncrRefCount(svObj->tclObj);
+    ResetExpiry(svObj);
+
+    ret = Sv_PutContainer(interp, svObj, SV_CHANGED);
+    if (ret == TCL_OK) {
+	Tcl_SetObjResult(interp, Tcl_NewWideIntObj(expected + 1));
     }
 
     return ret;
 }
-
+
 /*
  *-----------------------------------------------------------------------------
  *
- * SvUnsetObjCmd --
+ * SvConfigureObjCmd --
  *
- *      This procedure is invoked to process the "tsv::unset" command.
+ *      This procedure is invoked to process the "tsv::configure" command.
  *      See the user documentation for details on what it does.
  *
  * Results:
@@ -1443,60 +6103,60 @@ SvArrayObjCmd(
  */
 
 static int
-SvUnsetObjCmd(
-	      TCL_UNUSED(void *),                 /* Not used. */
-	      Tcl_Interp *interp,                 /* Current interpreter. */
-	      Tcl_Size objc,                   /* Number of arguments. */
-	      Tcl_Obj *const objv[])              /* Argument objects. */
+SvConfigureObjCmd(
+		  void *dummy,                /* Not used. */
+		  Tcl_Interp *interp,         /* Current interpreter. */
+		  Tcl_Size objc,              /* Number of arguments. */
+		  Tcl_Obj *const objv[])      /* Argument objects. */
 {
-    Tcl_Size ii;
-    const char *arrayName;
-    Array *arrayPtr;
+    static const char *const configOpts[] = {"-maxbytes", NULL};
+    Tcl_WideInt value;
+    Tcl_Size i;
+    int opt;
 
-    if (objc < 2) {
-	Tcl_WrongNumArgs(interp, 1, objv, "array ?key ...?");
-	return TCL_ERROR;
-    }
+    (void)dummy;
 
-    arrayName = Tcl_GetString(objv[1]);
-    arrayPtr  = LockArray(interp, arrayName, 0);
+    /*
+     * Syntax:
+     *          tsv::configure ?option value ...?
+     */
 
-    if (arrayPtr == NULL) {
+    if ((objc % 2) == 0) {
+	Tcl_WrongNumArgs(interp, 1, objv, "?option value ...?");
 	return TCL_ERROR;
     }
-    if (objc == 2) {
-	UnlockArray(arrayPtr);
-	if (DeleteArray(interp, arrayPtr) != TCL_OK) {
+    if (objc == 1) {
+	Tcl_Obj *resObj = Tcl_NewListObj(0, NULL);
+	Tcl_ListObjAppendElement(NULL, resObj,
+		Tcl_NewStringObj(configOpts[0], TCL_INDEX_NONE));
+	Tcl_ListObjAppendElement(NULL, resObj,
+		Tcl_NewWideIntObj(SvAtomicGet(&globalMaxBytes)));
+	Tcl_SetObjResult(interp, resObj);
+	return TCL_OK;
+    }
+    for (i = 1; i < objc; i += 2) {
+	if (Tcl_GetIndexFromObjStruct(interp, objv[i], configOpts,
+		sizeof(char *), "option", 0, &opt) != TCL_OK
+		|| Tcl_GetWideIntFromObj(interp, objv[i+1], &value) != TCL_OK) {
 	    return TCL_ERROR;
 	}
-    } else {
-	for (ii = 2; ii < objc; ii++) {
-	    const char *key = Tcl_GetString(objv[ii]);
-	    Tcl_HashEntry *hPtr = Tcl_FindHashEntry(&arrayPtr->vars, key);
-	    if (hPtr) {
-		if (DeleteContainer((Container*)Tcl_GetHashValue(hPtr))
-		    != TCL_OK) {
-		    UnlockArray(arrayPtr);
-		    return TCL_ERROR;
-		}
-	    } else {
-		UnlockArray(arrayPtr);
-		Tcl_AppendResult(interp,"no key ",arrayName,"(",key,")",(void *)NULL);
-		return TCL_ERROR;
-	    }
+	if (value < 0) {
+	    Tcl_AppendResult(interp, "expected non-negative limit but got \"",
+		    Tcl_GetString(objv[i+1]), "\"", (void *)NULL);
+	    return TCL_ERROR;
 	}
-	UnlockArray(arrayPtr);
+	SvAtomicSet(&globalMaxBytes, value);
     }
 
     return TCL_OK;
 }
-
+
 /*
  *-----------------------------------------------------------------------------
  *
- * SvNamesObjCmd --
+ * SvCompactObjCmd --
  *
- *      This procedure is invoked to process the "tsv::names" command.
+ *      This procedure is invoked to process the "tsv::compact" command.
  *      See the user documentation for details on what it does.
  *
  * Results:
@@ -1509,55 +6169,48 @@ SvUnsetObjCmd(
  */
 
 static int
-SvNamesObjCmd(
-	      void *arg,                     /* != NULL if aolSpecial */
-	      Tcl_Interp *interp,                 /* Current interpreter. */
-	      Tcl_Size objc,                   /* Number of arguments. */
-	      Tcl_Obj *const objv[])              /* Argument objects. */
+SvCompactObjCmd(
+		void *dummy,                  /* Not used. */
+		Tcl_Interp *interp,           /* Current interpreter. */
+		Tcl_Size objc,                /* Number of arguments. */
+		Tcl_Obj *const objv[])        /* Argument objects. */
 {
-    int i;
-    const char *pattern = NULL;
-    Tcl_HashEntry *hPtr;
-    Tcl_HashSearch search;
-    Tcl_Obj *resObj;
+    Tcl_WideInt released = 0;
+    size_t i;
 
-    if (objc > 2) {
-	Tcl_WrongNumArgs(interp, 1, objv, "?pattern?");
+    (void)dummy;
+
+    /*
+     * Syntax:
+     *          tsv::compact
+     */
+
+    if (objc != 1) {
+	Tcl_WrongNumArgs(interp, 1, objv, NULL);
 	return TCL_ERROR;
     }
-    if (objc == 2) {
-	pattern = Tcl_GetString(objv[1]);
-    }
 
-    resObj = Tcl_NewListObj(0, NULL);
+    /*
+     * Buckets are locked one at a time, so only threads using
+     * the bucket being compacted have to wait.
+     */
 
-    for (i = 0; i < NUMBUCKETS; i++) {
-	Bucket *bucketPtr = &buckets[i];
-	LOCK_BUCKET(bucketPtr);
-	hPtr = Tcl_FirstHashEntry(&bucketPtr->arrays, &search);
-	while (hPtr) {
-	    char *key = (char *)Tcl_GetHashKey(&bucketPtr->arrays, hPtr);
-	    if ((arg==NULL || (*key != '.')) /* Hide .<name> arrays for AOL*/ &&
-		(pattern == NULL || Tcl_StringCaseMatch(key, pattern, 0))) {
-		Tcl_ListObjAppendElement(interp, resObj,
-			Tcl_NewStringObj(key, TCL_INDEX_NONE));
-	    }
-	    hPtr = Tcl_NextHashEntry(&search);
-	}
-	UNLOCK_BUCKET(bucketPtr);
+    for (i = 0; i < numBuckets; i++) {
+	Sv_LockBucket(&buckets[i], 0);
+	released += CompactBucket(&buckets[i]);
+	Sv_UnlockBucket(&buckets[i]);
     }
-
-    Tcl_SetObjResult(interp, resObj);
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(released));
 
     return TCL_OK;
 }
-
+
 /*
  *-----------------------------------------------------------------------------
  *
- * SvGetObjCmd --
+ * SvWatchObjCmd --
  *
- *      This procedure is invoked to process "tsv::get" command.
+ *      This procedure is invoked to process the "tsv::watch" command.
  *      See the user documentation for details on what it does.
  *
  * Results:
@@ -1570,60 +6223,159 @@ SvNamesObjCmd(
  */
 
 static int
-SvGetObjCmd(
-	    void *arg,                     /* Pointer to object container. */
-	    Tcl_Interp *interp,                 /* Current interpreter. */
-	    Tcl_Size objc,                   /* Number of arguments. */
-	    Tcl_Obj *const objv[])              /* Argument objects. */
+SvWatchObjCmd(
+	      void *dummy,                    /* Not used. */
+	      Tcl_Interp *interp,             /* Current interpreter. */
+	      Tcl_Size objc,                  /* Number of arguments. */
+	      Tcl_Obj *const objv[])          /* Argument objects. */
+{
+    Array *arrayPtr;
+    Watch *watchPtr;
+    WatchRef *refPtr;
+    Tcl_HashEntry *hPtr;
+    Tcl_Size len;
+    const char *str;
+    char name[32];
+    int isNew;
+
+    (void)dummy;
+
+    /*
+     * Syntax:
+     *          tsv::watch array ?pattern? command
+     */
+
+    if (objc != 3 && objc != 4) {
+	Tcl_WrongNumArgs(interp, 1, objv, "array ?pattern? command");
+	return TCL_ERROR;
+    }
+
+    watchPtr = (Watch *)Tcl_Alloc(sizeof(Watch));
+    watchPtr->refCount = 1;
+    watchPtr->active   = 1;
+    watchPtr->threadId = Tcl_GetCurrentThread();
+    watchPtr->interp   = interp;
+    watchPtr->queued   = 0;
+    watchPtr->pattern  = NULL;
+    Tcl_InitHashTable(&watchPtr->pending, TCL_STRING_KEYS);
+
+    str = Tcl_GetStringFromObj(objv[1], &len);
+    watchPtr->array = strcpy((char *)Tcl_Alloc(len + 1), str);
+    if (objc == 4) {
+	str = Tcl_GetStringFromObj(objv[2], &len);
+	watchPtr->pattern = strcpy((char *)Tcl_Alloc(len + 1), str);
+    }
+    str = Tcl_GetStringFromObj(objv[objc-1], &len);
+    watchPtr->command = strcpy((char *)Tcl_Alloc(len + 1), str);
+
+    /*
+     * The watch waits for the array to be created first. If the array
+     * exists already, or gets created meanwhile, it is attached to
+     * every shard of it, since changes happen in shards.
+     */
+
+    Tcl_MutexLock(&watchMutex);
+    if (!watchTableInit) {
+	Tcl_InitHashTable(&watchTable, TCL_STRING_KEYS);
+	Tcl_InitHashTable(&idleWatches, TCL_STRING_KEYS);
+	watchTableInit = 1;
+    }
+    snprintf(name, sizeof(name), "tsvwatch%" TCL_Z_MODIFIER "u", ++watchIds);
+    watchPtr->entryPtr = Tcl_CreateHashEntry(&watchTable, name, &isNew);
+    Tcl_SetHashValue(watchPtr->entryPtr, watchPtr);
+    hPtr = Tcl_CreateHashEntry(&idleWatches, watchPtr->array, &isNew);
+    refPtr = (WatchRef *)Tcl_Alloc(sizeof(WatchRef));
+    refPtr->watchPtr = watchPtr;
+    refPtr->nextPtr = isNew ? NULL : (WatchRef *)Tcl_GetHashValue(hPtr);
+    Tcl_SetHashValue(hPtr, refPtr);
+    watchPtr->refCount++;
+    if (isNew) {
+	SvAtomicAdd(&numIdleWatches, 1);
+    }
+    Tcl_MutexUnlock(&watchMutex);
+
+    arrayPtr = LockArray(NULL, watchPtr->array, FLAGS_NOERRMSG);
+    if (arrayPtr != NULL) {
+	AttachWatches(arrayPtr, watchPtr->array);
+	UnlockArray(arrayPtr);
+    }
+
+    Tcl_CallWhenDeleted(interp, WatchInterpDeleted, watchPtr);
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(name, TCL_INDEX_NONE));
+
+    return TCL_OK;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvUnwatchObjCmd --
+ *
+ *      This procedure is invoked to process the "tsv::unwatch" command.
+ *      See the user documentation for details on what it does.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      See the user documentation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SvUnwatchObjCmd(
+		void *dummy,                  /* Not used. */
+		Tcl_Interp *interp,           /* Current interpreter. */
+		Tcl_Size objc,                /* Number of arguments. */
+		Tcl_Obj *const objv[])        /* Argument objects. */
 {
-    int ret;
-    Tcl_Size off;
-    Tcl_Obj *res;
-    Container *svObj = (Container*)arg;
+    Tcl_HashEntry *hPtr = NULL;
+    Watch *watchPtr = NULL;
+
+    (void)dummy;
 
     /*
      * Syntax:
-     *          tsv::get array key ?var?
-     *          $object get ?var?
+     *          tsv::unwatch watch
      */
 
-    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, 0);
-    switch (ret) {
-    case TCL_BREAK:
-	if (objc == off) {
-	    return TCL_ERROR;
-	} else {
-	    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
-	    return TCL_OK;
-	}
-    case TCL_ERROR:
+    if (objc != 2) {
+	Tcl_WrongNumArgs(interp, 1, objv, "watch");
 	return TCL_ERROR;
     }
 
-    res = Sv_DuplicateObj(svObj->tclObj);
-
-    if (objc == off) {
-	Tcl_SetObjResult(interp, res);
-    } else {
-	if (Tcl_ObjSetVar2(interp, objv[off], NULL, res, 0) == NULL) {
-	    Tcl_DecrRefCount(res);
-	    goto cmd_err;
-	}
-	Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
+    Tcl_MutexLock(&watchMutex);
+    if (watchTableInit) {
+	hPtr = Tcl_FindHashEntry(&watchTable, Tcl_GetString(objv[1]));
     }
+    if (hPtr != NULL) {
+	watchPtr = (Watch *)Tcl_GetHashValue(hPtr);
+    }
+    Tcl_MutexUnlock(&watchMutex);
 
-    return Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+    /*
+     * Only the interpreter having set up the watch may cancel it,
+     * so it can not go away meanwhile.
+     */
 
- cmd_err:
-    return Sv_PutContainer(interp, svObj, SV_ERROR);
+    if (watchPtr == NULL || watchPtr->interp != interp) {
+	Tcl_AppendResult(interp, "no such watch \"", Tcl_GetString(objv[1]),
+		"\"", (void *)NULL);
+	return TCL_ERROR;
+    }
+    Tcl_DontCallWhenDeleted(interp, WatchInterpDeleted, watchPtr);
+    CancelWatch(watchPtr);
+
+    return TCL_OK;
 }
-
+
 /*
  *-----------------------------------------------------------------------------
  *
- * SvExistsObjCmd --
+ * SvMGetObjCmd --
  *
- *      This procedure is invoked to process "tsv::exists" command.
+ *      This procedure is invoked to process the "tsv::mget" command.
  *      See the user documentation for details on what it does.
  *
  * Results:
@@ -1636,42 +6388,80 @@ SvGetObjCmd(
  */
 
 static int
-SvExistsObjCmd(
-	       void *arg,                     /* Pointer to object container. */
-	       Tcl_Interp *interp,                 /* Current interpreter. */
-	       Tcl_Size objc,                   /* Number of arguments. */
-	       Tcl_Obj *const objv[])              /* Argument objects. */
+SvMGetObjCmd(
+	     void *dummy,                   /* Not used. */
+	     Tcl_Interp *interp,                 /* Current interpreter. */
+	     Tcl_Size objc,                   /* Number of arguments. */
+	     Tcl_Obj *const objv[])              /* Argument objects. */
 {
-    Tcl_Size off;
-    int ret;
-    Container *svObj = (Container*)arg;
+    Tcl_Size i;
+    int flags = FLAGS_NOERRMSG | FLAGS_READONLY;
+    const char *arrayName;
+    Array *arrayPtr;
+    Container *svObj;
+    Tcl_Obj *resObj;
+    (void)dummy;
 
     /*
      * Syntax:
-     *          tsv::exists array key
-     *          $object exists
+     *          tsv::mget array key ?key ...?
      */
 
-    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, 0);
-    switch (ret) {
-    case TCL_BREAK: /* Array/key not found */
-	Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
-	return TCL_OK;
-    case TCL_ERROR:
+    if (objc < 3) {
+	Tcl_WrongNumArgs(interp, 1, objv, "array key ?key ...?");
 	return TCL_ERROR;
     }
 
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
+    arrayName = Tcl_GetString(objv[1]);
 
-    return Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+    /*
+     * All keys are looked up holding the lock of the array just once.
+     * Bound arrays may load keys from the persistent storage, which
+     * needs the exclusive lock.
+     */
+
+ relock:
+    arrayPtr = LockArray(interp, arrayName, flags);
+    if (arrayPtr && arrayPtr->psPtr && (flags & FLAGS_READONLY)) {
+	UnlockArray(arrayPtr);
+	flags &= ~FLAGS_READONLY;
+	goto relock;
+    }
+
+    resObj = Tcl_NewListObj(objc - 2, NULL);
+    for (i = 2; i < objc; i++) {
+	svObj = NULL;
+	if (arrayPtr) {
+	    const char *key = Tcl_GetString(objv[i]);
+	    svObj = AcquireContainer(GetShard(arrayPtr, key), key, 0);
+	}
+	if (svObj == NULL) {
+	    Tcl_ListObjAppendElement(NULL, resObj, Tcl_NewObj());
+	    continue;
+	}
+	if ((flags & FLAGS_READONLY) && !SvIsReadable(svObj, flags)) {
+	    Tcl_DecrRefCount(resObj);
+	    UnlockArray(arrayPtr);
+	    flags &= ~FLAGS_READONLY;
+	    goto relock;
+	}
+	Tcl_ListObjAppendElement(NULL, resObj, GetValue(svObj));
+    }
+
+    if (arrayPtr) {
+	UnlockArray(arrayPtr);
+    }
+    Tcl_SetObjResult(interp, resObj);
+
+    return TCL_OK;
 }
-
+
 /*
  *-----------------------------------------------------------------------------
  *
- * SvSetObjCmd --
+ * SvMSetObjCmd --
  *
- *      This procedure is invoked to process the "tsv::set" command.
+ *      This procedure is invoked to process the "tsv::mset" command.
  *      See the user documentation for details on what it does.
  *
  * Results:
@@ -1684,56 +6474,50 @@ SvExistsObjCmd(
  */
 
 static int
-SvSetObjCmd(
-	    void *arg,                     /* Pointer to object container */
-	    Tcl_Interp *interp,                 /* Current interpreter. */
-	    Tcl_Size objc,                   /* Number of arguments. */
-	    Tcl_Obj *const objv[])              /* Argument objects. */
+SvMSetObjCmd(
+	     void *dummy,                   /* Not used. */
+	     Tcl_Interp *interp,                 /* Current interpreter. */
+	     Tcl_Size objc,                   /* Number of arguments. */
+	     Tcl_Obj *const objv[])              /* Argument objects. */
 {
-    int ret, flg, mode;
-    Tcl_Size off;
-    Tcl_Obj *val;
-    Container *svObj = (Container*)arg;
+    int ret = TCL_OK;
+    Tcl_Size i;
+    Array *arrayPtr;
+    Container *svObj;
+    (void)dummy;
 
     /*
      * Syntax:
-     *          tsv::set array key ?value?
-     *          $object set ?value?
+     *          tsv::mset array key value ?key value ...?
      */
 
-    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, 0);
-    switch (ret) {
-    case TCL_BREAK:
-	if (objc == off) {
-	    return TCL_ERROR;
-	} else {
-	    Tcl_ResetResult(interp);
-	    flg = FLAGS_CREATEARRAY | FLAGS_CREATEVAR;
-	    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, flg);
-	    if (ret != TCL_OK) {
-		return TCL_ERROR;
-	    }
-	}
-	break;
-    case TCL_ERROR:
+    if (objc < 4 || (objc & 1)) {
+	Tcl_WrongNumArgs(interp, 1, objv, "array key value ?key value ...?");
 	return TCL_ERROR;
     }
-    if (objc != off) {
-	val = objv[off];
+
+    arrayPtr = LockArray(interp, Tcl_GetString(objv[1]), FLAGS_CREATEARRAY);
+
+    for (i = 2; i < objc; i += 2) {
+	const char *key = Tcl_GetString(objv[i]);
+	svObj = AcquireContainer(GetShard(arrayPtr, key), key,
+		FLAGS_CREATEVAR);
+	Sv_UpdateContainer(svObj);
 	Tcl_DecrRefCount(svObj->tclObj);
-	svObj->tclObj = Sv_DuplicateObj(val);
+	svObj->tclObj = Sv_DuplicateObj(objv[i+1]);
 	Tcl_IncrRefCount(svObj->tclObj);
-	mode = SV_CHANGED;
-    } else {
-	val = Sv_DuplicateObj(svObj->tclObj);
-	mode = SV_UNCHANGED;
+	ResetExpiry(svObj);
+	if (ReleaseContainer(interp, svObj, SV_CHANGED) != TCL_OK) {
+	    ret = TCL_ERROR;
+	    break;
+	}
     }
 
-    Tcl_SetObjResult(interp, val);
+    UnlockArray(arrayPtr);
 
-    return Sv_PutContainer(interp, svObj, mode);
+    return ret;
 }
-
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -1758,18 +6542,62 @@ SvIncrObjCmd(
 	     Tcl_Size objc,                   /* Number of arguments. */
 	     Tcl_Obj *const objv[])              /* Argument objects. */
 {
-    int ret, flg, isNew = 0;
-    Tcl_Size off;
+    int ret, flg, isNew = 0, striped = 0;
+    Tcl_Size off, first = arg ? 2 : 1;
     Tcl_WideInt incrValue = 1, currValue = 0;
+    Tcl_Obj *args[SV_MAXARGS];
     Container *svObj = (Container*)arg;
 
     /*
      * Syntax:
-     *          tsv::incr array key ?increment?
-     *          $object incr ?increment?
+     *          tsv::incr ?-striped? array key ?increment?
+     *          $object incr ?-striped? ?increment?
      */
 
-    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, 0);
+    striped = SvStripOption(&objc, &objv, first, "-striped", args);
+    if (striped < 0) {
+	Tcl_WrongNumArgs(interp, first, objv,
+		arg ? "?-striped? ?increment?" : "?-striped? array key ?increment?");
+	return TCL_ERROR;
+    }
+
+    /*
+     * Counters are incremented atomically, holding only the shared lock.
+     */
+
+    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off,
+	    FLAGS_READONLY|FLAGS_KEEPREP);
+    if (ret == TCL_OK) {
+	if (svObj->repTypePtr == &stripedRepType
+		|| (svObj->repTypePtr == &counterRepType && !striped)) {
+	    if ((objc != off)) {
+		ret = Tcl_GetWideIntFromObj(interp, objv[off], &incrValue);
+		if (ret != TCL_OK) {
+		    goto cmd_err;
+		}
+	    }
+	    if (svObj->repTypePtr == &counterRepType) {
+		incrValue = SvAtomicAdd((Tcl_WideInt *)svObj->repPtr, incrValue);
+		SvAtomicAdd(&svObj->epoch, 1);
+		Tcl_SetObjResult(interp, Tcl_NewWideIntObj(incrValue));
+	    } else {
+		StripedSlot *slots = ((StripedCounter *)svObj->repPtr)->slots;
+		incrValue = SvAtomicAdd(&slots[SvThreadSlot()].value, incrValue);
+		if (striped) {
+		    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(incrValue));
+		} else {
+		    Tcl_SetObjResult(interp, StripedValueProc(svObj));
+		}
+	    }
+	    if (svObj->arrayPtr->watches) {
+		NotifyWatches(svObj, "set");
+	    }
+	    return Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+	}
+	Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+	svObj = (Container*)arg;
+	ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, 0);
+    }
     if (ret != TCL_OK) {
 	if (ret != TCL_BREAK) {
 	    return TCL_ERROR;
@@ -1798,7 +6626,31 @@ SvIncrObjCmd(
     }
 
     incrValue += currValue;
-    Tcl_SetWideIntObj(svObj->tclObj, incrValue);
+    if (svObj->arrayPtr->psPtr != NULL) {
+
+	/*
+	 * Bound arrays keep plain objects, since every
+	 * change goes to the persistent store.
+	 */
+
+	Tcl_SetWideIntObj(svObj->tclObj, incrValue);
+    } else if (striped) {
+	StripedCounter *counterPtr;
+	size_t size = numSlots * sizeof(StripedSlot);
+
+	counterPtr = (StripedCounter *)Tcl_Alloc(sizeof(StripedCounter));
+	counterPtr->memPtr = Tcl_Alloc(size + CACHELINE_SIZE);
+	counterPtr->slots = (StripedSlot *)(((size_t)counterPtr->memPtr
+		+ CACHELINE_SIZE - 1) & ~(size_t)(CACHELINE_SIZE - 1));
+	memset(counterPtr->slots, 0, size);
+	counterPtr->slots[SvThreadSlot()].value = incrValue;
+	svObj->repPtr = counterPtr;
+	svObj->repTypePtr = &stripedRepType;
+    } else {
+	svObj->repPtr = Tcl_Alloc(sizeof(Tcl_WideInt));
+	*(Tcl_WideInt *)svObj->repPtr = incrValue;
+	svObj->repTypePtr = &counterRepType;
+    }
     Tcl_ResetResult(interp);
     Tcl_SetWideIntObj(Tcl_GetObjResult(interp), incrValue);
 
@@ -1888,20 +6740,50 @@ SvPopObjCmd(
 	    Tcl_Obj *const objv[])              /* Argument objects. */
 {
     int ret;
-    Tcl_Size off;
-    Tcl_Obj *retObj;
+    Tcl_Size off, first = arg ? 2 : 1;
+    Tcl_WideInt deadline;
+    SvWait wait;
+    Tcl_Obj *retObj, *args[SV_MAXARGS];
     Array *arrayPtr = NULL;
     Container *svObj = (Container*)arg;
 
     /*
      * Syntax:
-     *          tsv::pop array key ?var?
+     *          tsv::pop ?-wait? ?-timeout ms? array key ?var?
      *          $object pop ?var?
      *
      * Note: the object command will run into error next time !
      */
 
-    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, 0);
+    if (Sv_WaitOptions(interp, &objc, &objv, first, args,
+	    &deadline) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (deadline) {
+	Sv_WaitBegin(&wait, objc, objv, (Container*)arg);
+    }
+
+    while (1) {
+	ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, 0);
+	if (ret != TCL_BREAK || arg || !deadline) {
+	    break;
+	}
+
+	/*
+	 * No such array or key yet. Wait for somebody to change
+	 * anything and look again.
+	 */
+
+	if (!Sv_WaitChange(&wait, deadline)) {
+	    break;
+	}
+	Tcl_ResetResult(interp);
+	svObj = NULL;
+    }
+    if (deadline) {
+	Sv_WaitEnd(&wait);
+    }
+
     switch (ret) {
     case TCL_BREAK:
 	if (objc == off) {
@@ -1989,6 +6871,9 @@ SvMoveObjCmd(
     }
 
     toKey = Tcl_GetString(objv[off]);
+    if (svObj->arrayPtr->shardId) {
+	return MoveShardedKey(interp, svObj, toKey);
+    }
     hPtr = Tcl_CreateHashEntry(&svObj->arrayPtr->vars, toKey, &isNew);
 
     if (!isNew) {
@@ -1997,6 +6882,10 @@ SvMoveObjCmd(
     }
     if (svObj->entryPtr) {
 	char *key = (char *)Tcl_GetHashKey(&svObj->arrayPtr->vars, svObj->entryPtr);
+	svObj->arrayPtr->keyBytes -= KEY_LENGTH(svObj);
+	if (svObj->arrayPtr->watches) {
+	    NotifyWatches(svObj, "unset");
+	}
 	if (svObj->arrayPtr->psPtr) {
 	    PsStore *psPtr = svObj->arrayPtr->psPtr;
 	    if (psPtr->psDelete(psPtr->psHandle, key) == -1) {
@@ -2005,11 +6894,18 @@ SvMoveObjCmd(
 		return TCL_ERROR;
 	    }
 	}
+	if (svObj->arrayPtr->indexPtr) {
+	    Sv_IndexRemove(svObj->arrayPtr->indexPtr, key);
+	}
 	Tcl_DeleteHashEntry(svObj->entryPtr);
     }
 
     svObj->entryPtr = hPtr;
     Tcl_SetHashValue(hPtr, svObj);
+    svObj->arrayPtr->keyBytes += KEY_LENGTH(svObj);
+    if (svObj->arrayPtr->indexPtr) {
+	Sv_IndexInsert(svObj->arrayPtr->indexPtr, toKey, svObj);
+    }
 
     return Sv_PutContainer(interp, svObj, SV_CHANGED);
 
@@ -2018,6 +6914,126 @@ SvMoveObjCmd(
 
 }
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * MoveShardedKey --
+ *
+ *      Implements "tsv::move" for keys of sharded arrays, where the
+ *      renamed key may have to move into another shard.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      The container is unlocked. It is deleted if the key moves into
+ *      another shard, which makes its object commands invalid.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+MoveShardedKey(
+	       Tcl_Interp *interp,            /* Current interpreter. */
+	       Container *svObj,              /* Locked container to move */
+	       const char *toKey)             /* New key of the container */
+{
+    int ret = TCL_OK, isNew;
+    Tcl_DString array, key;
+    Array *arrayPtr, *fromPtr, *toPtr;
+    Tcl_HashEntry *hPtr;
+
+    /*
+     * The new key may belong to another shard. Remember names of the
+     * array and the key, and start over with the whole array locked.
+     */
+
+    Tcl_DStringInit(&array);
+    Tcl_DStringInit(&key);
+    Tcl_DStringAppend(&array, (char *)Tcl_GetHashKey(&svObj->bucketPtr->shards,
+	    svObj->arrayPtr->entryPtr), TCL_INDEX_NONE);
+    Tcl_DStringAppend(&key, (char *)Tcl_GetHashKey(&svObj->arrayPtr->vars,
+	    svObj->entryPtr), TCL_INDEX_NONE);
+    UnlockArray(svObj->arrayPtr);
+
+    arrayPtr = LockArray(interp, Tcl_DStringValue(&array), 0);
+    if (arrayPtr == NULL) {
+	ret = TCL_ERROR;
+	goto cmd_exit;
+    }
+    fromPtr = GetShard(arrayPtr, Tcl_DStringValue(&key));
+    hPtr = Tcl_FindHashEntry(&fromPtr->vars, Tcl_DStringValue(&key));
+    if (hPtr == NULL) {
+	Tcl_AppendResult(interp, "no key ", Tcl_DStringValue(&array), "(",
+		Tcl_DStringValue(&key), ")", (void *)NULL);
+	ret = TCL_ERROR;
+	goto cmd_unlock;
+    }
+    svObj = (Container*)Tcl_GetHashValue(hPtr);
+
+    toPtr = GetShard(arrayPtr, toKey);
+    hPtr = Tcl_CreateHashEntry(&toPtr->vars, toKey, &isNew);
+    if (!isNew) {
+	Tcl_AppendResult(interp, "key \"", toKey, "\" exists", (void *)NULL);
+	ret = TCL_ERROR;
+	goto cmd_unlock;
+    }
+
+    /*
+     * Containers are always locked through their bucket and live in
+     * chunks of that bucket, so moving the key to the shard in another
+     * bucket means moving the value into a new container there.
+     */
+
+    if (toPtr == fromPtr) {
+	fromPtr->keyBytes -= KEY_LENGTH(svObj);
+	if (fromPtr->watches) {
+	    NotifyWatches(svObj, "unset");
+	}
+	if (fromPtr->indexPtr) {
+	    Sv_IndexRemove(fromPtr->indexPtr, Tcl_DStringValue(&key));
+	    Sv_IndexInsert(fromPtr->indexPtr, toKey, svObj);
+	}
+	Tcl_DeleteHashEntry(svObj->entryPtr);
+	svObj->entryPtr = hPtr;
+	Tcl_SetHashValue(hPtr, svObj);
+	toPtr->keyBytes += KEY_LENGTH(svObj);
+	svObj->epoch++;
+    } else {
+	Container *newObj = CreateContainer(toPtr, hPtr, svObj->tclObj);
+
+	Tcl_SetHashValue(hPtr, newObj);
+	newObj->repTypePtr = svObj->repTypePtr;
+	newObj->repPtr     = svObj->repPtr;
+	newObj->epoch      = svObj->epoch + 1;
+	newObj->referenced = svObj->referenced;
+	SetExpiry(newObj, svObj->expires);
+	svObj->repTypePtr = NULL;
+	svObj->repPtr     = NULL;
+	DeleteContainer(svObj);
+	svObj = newObj;
+    }
+    if (toPtr->watches) {
+	NotifyWatches(svObj, "set");
+    }
+    if (SvAtomicGet(&toPtr->bucketPtr->numWaiters)) {
+	WakeWaiters(toPtr->bucketPtr);
+    }
+    if (toPtr->policy != SV_EVICT_NONE) {
+	AccountContainer(svObj, 1);
+	EvictKeys(toPtr, svObj);
+    }
+
+ cmd_unlock:
+    UnlockArray(arrayPtr);
+
+ cmd_exit:
+    Tcl_DStringFree(&array);
+    Tcl_DStringFree(&key);
+
+    return ret;
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -2042,7 +7058,7 @@ SvLockObjCmd(
 	     Tcl_Size objc,                   /* Number of arguments. */
 	     Tcl_Obj *const objv[])              /* Argument objects. */
 {
-    int ret;
+    int ret, numShards;
     Tcl_Obj *scriptObj;
     Bucket *bucketPtr;
     Array *arrayPtr = NULL;
@@ -2060,6 +7076,7 @@ SvLockObjCmd(
 
     arrayPtr  = LockArray(interp, Tcl_GetString(objv[1]), FLAGS_CREATEARRAY);
     bucketPtr = arrayPtr->bucketPtr;
+    numShards = arrayPtr->numShards;
 
     /*
      * Evaluate passed arguments as Tcl script. Note that
@@ -2084,11 +7101,11 @@ SvLockObjCmd(
     }
 
     /*
-     * We unlock the bucket directly, w/o going to Sv_Unlock()
+     * We unlock the buckets directly, w/o going to UnlockArray()
      * since it needs the array which may be unset by the script.
      */
 
-    UNLOCK_BUCKET(bucketPtr);
+    UnlockShards(bucketPtr, numShards);
 
     return ret;
 }
@@ -2160,6 +7177,7 @@ static void
 SvRegisterStdCommands(void)
 {
     static int initialized = 0;
+    Tcl_Obj *dictObj;
 
     if (initialized == 0) {
 	Tcl_MutexLock(&initMutex);
@@ -2178,6 +7196,17 @@ SvRegisterStdCommands(void)
 	    Sv_RegisterCommand("move",     SvMoveObjCmd,     NULL, 0);
 	    Sv_RegisterCommand("lock",     SvLockObjCmd,     NULL, 0);
 	    Sv_RegisterCommand("handlers", SvHandlersObjCmd, NULL, 0);
+	    Sv_RegisterCommand("mget",     SvMGetObjCmd,     NULL, 0);
+	    Sv_RegisterCommand("mset",     SvMSetObjCmd,     NULL, 0);
+	    Sv_RegisterCommand("cas",      SvCasObjCmd,      NULL, 0);
+	    Sv_RegisterCommand("configure", SvConfigureObjCmd, NULL, 0);
+	    Sv_RegisterCommand("compact",  SvCompactObjCmd,  NULL, 0);
+	    Sv_RegisterCommand("watch",    SvWatchObjCmd,    NULL, 0);
+	    Sv_RegisterCommand("unwatch",  SvUnwatchObjCmd,  NULL, 0);
+	    Sv_RegisterObjType(&frozenObjType, DupFrozenInternalRep);
+	    dictObj = Tcl_NewDictObj();
+	    Sv_RegisterObjType(dictObj->typePtr, DupDictObjShared);
+	    Tcl_DecrRefCount(dictObj);
 	    initialized = 1;
 	}
 	Tcl_MutexUnlock(&initMutex);
@@ -2238,6 +7267,10 @@ SvInit (
 
     SvRegisterStdCommands();
     Sv_RegisterListCommands();
+    Sv_RegisterDictCommands();
+    Sv_RegisterSetCommands();
+    Sv_RegisterZsetCommands();
+    Sv_RegisterQueueCommands();
 
     /*
      * Get Tcl object types. These are used
@@ -2271,6 +7304,15 @@ SvInit (
     wideIntObjTypePtr       = obj->typePtr;
     Tcl_DecrRefCount(obj);
 
+    obj = Tcl_NewObj();
+    obj = Tcl_NewListObj(1, &obj);
+    listObjTypePtr      = obj->typePtr;
+    Tcl_DecrRefCount(obj);
+
+    obj = Tcl_NewDictObj();
+    dictObjTypePtr      = obj->typePtr;
+    Tcl_DecrRefCount(obj);
+
     /*
      * Plug-in registered commands in current interpreter
      */
@@ -2291,12 +7333,18 @@ SvInit (
     if (buckets == NULL) {
 	Tcl_MutexLock(&bucketsMutex);
 	if (buckets == NULL) {
-	    buckets = (Bucket *)Tcl_Alloc(sizeof(Bucket) * NUMBUCKETS);
+	    numBuckets = SvNumBuckets();
+	    for (numSlots = 1; numSlots < SvNumProcessors()
+		    && numSlots < MAXSLOTS; numSlots <<= 1) {
+		/* Round up to the next power of two */
+	    }
+	    buckets = (Bucket *)Tcl_Alloc(sizeof(Bucket) * numBuckets);
 
-	    for (i = 0; i < NUMBUCKETS; ++i) {
+	    for (i = 0; i < (Tcl_Size)numBuckets; ++i) {
 		bucketPtr = &buckets[i];
 		memset(bucketPtr, 0, sizeof(Bucket));
 		Tcl_InitHashTable(&bucketPtr->arrays, TCL_STRING_KEYS);
+		Tcl_InitHashTable(&bucketPtr->shards, TCL_STRING_KEYS);
 		Tcl_InitHashTable(&bucketPtr->handles, TCL_ONE_WORD_KEYS);
 	    }
 
@@ -2355,7 +7403,7 @@ static void
 SvFinalize (
     TCL_UNUSED(void *))
 {
-    int i;
+    size_t i;
     SvCmdInfo *cmdPtr;
     RegType *regPtr;
 
@@ -2374,6 +7422,40 @@ SvFinalize (
 	goto done;
     }
 
+    /*
+     * Keys deleted below are not reported anymore. Watches are left
+     * to their interpreters, which may still cancel them.
+     */
+
+    Tcl_MutexLock(&watchMutex);
+    if (watchTableInit) {
+	hashPtr = Tcl_FirstHashEntry(&watchTable, &search);
+	while (hashPtr != NULL) {
+	    ((Watch *)Tcl_GetHashValue(hashPtr))->active = 0;
+	    hashPtr = Tcl_NextHashEntry(&search);
+	}
+    }
+    Tcl_MutexUnlock(&watchMutex);
+
+    Sv_FinalizeQueues();
+
+    /*
+     * Stop the reaper thread before the buckets go away
+     */
+
+    Tcl_MutexLock(&reaperMutex);
+    if (reaperState == REAPER_RUNNING) {
+	int state;
+
+	reaperState = REAPER_STOPPING;
+	Tcl_ConditionNotify(&reaperCond);
+	Tcl_MutexUnlock(&reaperMutex);
+	Tcl_JoinThread(reaperId, &state);
+	Tcl_MutexLock(&reaperMutex);
+    }
+    reaperState = REAPER_IDLE;
+    Tcl_MutexUnlock(&reaperMutex);
+
     /*
      * Reclaim memory for shared arrays
      */
@@ -2381,7 +7463,7 @@ SvFinalize (
     if (buckets != NULL) {
 	Tcl_MutexLock(&bucketsMutex);
 	if (buckets != NULL) {
-	    for (i = 0; i < NUMBUCKETS; ++i) {
+	    for (i = 0; i < numBuckets; ++i) {
 		Bucket *bucketPtr = &buckets[i];
 		hashPtr = Tcl_FirstHashEntry(&bucketPtr->arrays, &search);
 		while (hashPtr != NULL) {
@@ -2393,12 +7475,22 @@ SvFinalize (
 		    DeleteArray(NULL, arrayPtr);
 		    hashPtr = Tcl_NextHashEntry(&search);
 		}
+	    }
+	    /* shards of arrays may live in any bucket, so delete them all first */
+	    for (i = 0; i < numBuckets; ++i) {
+		Bucket *bucketPtr = &buckets[i];
 		if (bucketPtr->lock) {
-		    Sp_RecursiveMutexFinalize(&bucketPtr->lock);
+		    Sp_ReadWriteMutexFinalize(&bucketPtr->lock);
 		}
+		Tcl_ConditionFinalize(&bucketPtr->waitCond);
+		Tcl_MutexFinalize(&bucketPtr->waitMutex);
 		SvFinalizeContainers(bucketPtr);
+		if (bucketPtr->ttlHeap) {
+		    Tcl_Free(bucketPtr->ttlHeap);
+		}
 		Tcl_DeleteHashTable(&bucketPtr->handles);
 		Tcl_DeleteHashTable(&bucketPtr->arrays);
+		Tcl_DeleteHashTable(&bucketPtr->shards);
 	    }
 	    Tcl_Free(buckets), buckets = NULL;
 	}
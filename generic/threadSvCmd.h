@@ -17,7 +17,31 @@
 #include <string.h>
 
 #include "tclThreadInt.h"
-#include "threadSpCmd.h" /* For recursive locks */
+#include "threadSpCmd.h" /* For reader/writer locks */
+
+/* Tcl 8 only defines Tcl_GetIntForIndex in its internal stubs */
+#if TCL_MAJOR_VERSION < 9
+# if defined(USE_TCL_STUBS)
+/*  Little hack to eliminate the need for "tclInt.h" here:
+    Just copy a small portion of TclIntStubs, just
+    enough to make it work */
+typedef struct TclIntStubs {
+    int magic;
+    void *hooks;
+    void (*dummy[34]) (void); /* dummy entries 0-33, not used */
+    int (*tclGetIntForIndex) (Tcl_Interp *interp, Tcl_Obj *objPtr, int endValue, int *indexPtr); /* 34 */
+} TclIntStubs;
+extern const TclIntStubs *tclIntStubsPtr;
+
+# undef Tcl_GetIntForIndex
+# define Tcl_GetIntForIndex(interp, obj, max, ptr) ((tclIntStubsPtr->tclGetIntForIndex == NULL)? \
+    ((int (*)(Tcl_Interp*,  Tcl_Obj *, int, int*))(void *)((&(tclStubsPtr->tcl_PkgProvideEx))[645]))((interp), (obj), (max), (ptr)): \
+	tclIntStubsPtr->tclGetIntForIndex((interp), (obj), (max), (ptr)))
+# else
+EXTERN int TclGetIntForIndex(Tcl_Interp *interp, Tcl_Obj *objPtr, int endValue, int *indexPtr);
+#   define Tcl_GetIntForIndex TclGetIntForIndex
+# endif
+#endif
 
 /*
  * Uncomment following line to get command-line
@@ -51,22 +75,23 @@
 #define FLAGS_CREATEARRAY  1   /* Create the array in bucket if none found */
 #define FLAGS_NOERRMSG     2   /* Do not format error message */
 #define FLAGS_CREATEVAR    4   /* Create the array variable if none found */
+#define FLAGS_READONLY     8   /* Lock the bucket for reading only */
+#define FLAGS_LISTREP     16   /* Reader needs the list representation */
+#define FLAGS_KEEPREP     32   /* Caller handles alternative representations */
+#define FLAGS_DICTREP     64   /* Reader needs the dict representation */
 
 /*
- * Macros for handling locking and unlocking
- */
-#define LOCK_BUCKET(a)      Sp_RecursiveMutexLock(&(a)->lock)
-#define UNLOCK_BUCKET(a)    Sp_RecursiveMutexUnlock(&(a)->lock)
-
-#define LOCK_CONTAINER(a)   Sp_RecursiveMutexLock(&(a)->bucketPtr->lock)
-#define UNLOCK_CONTAINER(a) Sp_RecursiveMutexUnlock(&(a)->bucketPtr->lock)
-
-/*
- * This is named synetrically to LockArray as function
- * rather than as a macro just to improve readability.
+ * Macros for handling locking and unlocking. Buckets are protected
+ * with reader/writer locks. Commands which do not modify the shared
+ * object take the shared (reader) side of the lock.
  */
+#define LOCK_BUCKET(a)      Sv_LockBucket((a), 0)
+#define RLOCK_BUCKET(a)     Sv_LockBucket((a), 1)
+#define UNLOCK_BUCKET(a)    Sv_UnlockBucket(a)
 
-#define UnlockArray(a) UNLOCK_CONTAINER(a)
+#define LOCK_CONTAINER(a)   Sv_LockBucket((a)->bucketPtr, 0)
+#define RLOCK_CONTAINER(a)  Sv_LockBucket((a)->bucketPtr, 1)
+#define UNLOCK_CONTAINER(a) Sv_UnlockBucket((a)->bucketPtr)
 
 /*
  * Mode for Sv_PutContainer, so it knows what
@@ -77,6 +102,74 @@
 #define SV_CHANGED         1   /* Object has been modified */
 #define SV_ERROR          -1   /* Object may be in incosistent state */
 
+/*
+ * Eviction policies of bounded arrays
+ */
+
+#define SV_EVICT_NONE      0   /* Array is not bounded */
+#define SV_EVICT_LRU       1   /* Evict least recently used keys first */
+#define SV_EVICT_CLOCK     2   /* Evict keys not used since last sweep */
+
+/*
+ * Maximum number of arguments of commands accepting leading options,
+ * see SvStripOption and Sv_WaitOptions.
+ */
+
+#define SV_MAXARGS 8
+
+/*
+ * Size of a processor cache line. Data written by different threads
+ * is kept this far apart, so they do not invalidate each other's caches.
+ */
+
+#define CACHELINE_SIZE 64
+
+/*
+ * Atomic operations on 64-bit values shared between threads.
+ *
+ * SvAtomicGet, SvAtomicSet and SvAtomicAdd do not order other memory
+ * accesses and are meant for counters. SvAtomicLoad acquires and
+ * SvAtomicStore releases, so that what was written before a store is
+ * visible to whoever loads the stored value. SvAtomicCas replaces the
+ * value if it equals the expected one, else updates the expected one,
+ * and may fail spuriously. SvAtomicAddSync and SvAtomicFence order all
+ * memory accesses before them against all those after them.
+ *
+ * Where no atomic instructions are available, these fall back to a
+ * mutex.
+ */
+
+#if defined(__ATOMIC_RELAXED)
+#   define SvAtomicGet(p)       __atomic_load_n((p), __ATOMIC_RELAXED)
+#   define SvAtomicSet(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#   define SvAtomicAdd(p, v)    __atomic_add_fetch((p), (v), __ATOMIC_RELAXED)
+#   define SvAtomicLoad(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#   define SvAtomicStore(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#   define SvAtomicCas(p, o, n) __atomic_compare_exchange_n((p), (o), (n), \
+	1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#   define SvAtomicAddSync(p, v) __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#   define SvAtomicFence()      __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#elif defined(_MSC_VER)
+#   define SvAtomicGet(p) \
+    InterlockedCompareExchange64((volatile LONG64 *)(p), 0, 0)
+#   define SvAtomicSet(p, v) \
+    ((void)InterlockedExchange64((volatile LONG64 *)(p), (v)))
+#   define SvAtomicAdd(p, v) \
+    (InterlockedExchangeAdd64((volatile LONG64 *)(p), (v)) + (v))
+#   define SvAtomicLoad(p)      SvAtomicGet(p)
+#   define SvAtomicStore(p, v)  SvAtomicSet((p), (v))
+#   define SvAtomicAddSync(p, v) SvAtomicAdd((p), (v))
+#   define SvAtomicFence()      MemoryBarrier()
+#   define SV_ATOMIC_CAS
+#else
+#   define SV_ATOMIC_MUTEX
+#   define SV_ATOMIC_CAS
+#   define SvAtomicLoad(p)      SvAtomicGet(p)
+#   define SvAtomicStore(p, v)  SvAtomicSet((p), (v))
+#   define SvAtomicAddSync(p, v) SvAtomicAdd((p), (v))
+#   define SvAtomicFence()
+#endif
+
 /*
  * Definitions of functions implementing simple key/value
  * persistent storage for shared variable arrays.
@@ -114,6 +207,22 @@ typedef struct PsStore {
     struct PsStore *nextPtr;   /* For linking into linked lists */
 } PsStore;
 
+/*
+ * Object containers are allocated in chunks, each holding a fixed
+ * number of them. Chunks belong to one bucket and are freed as soon
+ * as they are no longer used, unless it is the only empty one.
+ */
+
+typedef struct Chunk {
+    struct Bucket *bucketPtr;  /* Bucket owning the chunk */
+    struct Chunk *prevPtr;     /* Neighbours in one of the bucket lists */
+    struct Chunk *nextPtr;
+    struct Container *freeCt;  /* List of free containers in the chunk */
+    Tcl_Size numFree;          /* Number of containers in the free list */
+    int pinned;                /* Containers were handed out to tsv::object
+                                * handles, so the chunk is never freed */
+} Chunk;
+
 /*
  * The following structure defines a collection of arrays.
  * Only the arrays within a given bucket share a lock,
@@ -121,14 +230,30 @@ typedef struct PsStore {
  */
 
 typedef struct Bucket {
-    Sp_RecursiveMutex lock;    /* */
+    Sp_ReadWriteMutex lock;    /* Reader/writer lock for the bucket */
+    int nested;                /* Nested locks of the writer thread */
     Tcl_HashTable arrays;      /* Hash table of all arrays in bucket */
+    Tcl_HashTable shards;      /* Hash table of array shards in bucket */
     Tcl_HashTable handles;     /* Hash table of given-out handles in bucket */
-    struct Container *freeCt;  /* List of free Tcl-object containers */
+    struct Chunk *chunks;      /* Chunks with free containers */
+    struct Chunk *fullChunks;  /* Chunks with all containers used */
+    Tcl_Size numContainers;    /* Number of containers in all chunks */
+    Tcl_Size numFree;          /* Number of free containers in all chunks */
+    Tcl_Size numEmpty;         /* Number of chunks with no container used */
+    struct Container **ttlHeap; /* Containers with expiry time, as min-heap */
+    Tcl_Size ttlCount;         /* Number of containers in the heap */
+    Tcl_Size ttlSize;          /* Allocated size of the heap */
+    Tcl_Mutex waitMutex;       /* Protects the generation below */
+    Tcl_Condition waitCond;    /* Signalled when the generation changes */
+    Tcl_WideInt waitGen;       /* Bumped on changes seen by waiters */
+    Tcl_WideInt numWaiters;    /* Threads waiting for changes in bucket */
 } Bucket;
 
 /*
  * The following structure maintains the context for each variable array.
+ * Keys of a sharded array are spread over a number of shards, which are
+ * themselves arrays held in the neighbouring buckets. The variable table
+ * of the sharded array itself is then left empty.
  */
 
 typedef struct Array {
@@ -138,8 +263,44 @@ typedef struct Array {
     Tcl_HashEntry *entryPtr;   /* Entry in bucket array table. */
     Tcl_HashEntry *handlePtr;  /* Entry in handles table */
     Tcl_HashTable vars;        /* Table of variables. */
+    Tcl_WideInt ttl;           /* Default time to live of keys in ms, or 0 */
+    int policy;                /* Eviction policy, one of SV_EVICT_* */
+    Tcl_WideInt maxKeys;       /* Evict keys above this number, if not 0 */
+    Tcl_WideInt maxBytes;      /* Evict keys above this size, if not 0 */
+    Tcl_WideInt numBytes;      /* Size of all keys, if evicting */
+    struct Container *lruHead; /* Keys in the order of eviction */
+    struct Container *lruTail;
+    Tcl_WideInt keyBytes;      /* Size of all keys */
+    Tcl_WideInt stringBytes;   /* Size of string reps of all values */
+    Tcl_WideInt repBytes;      /* Estimated size of values otherwise */
+    struct WatchRef *watches;  /* Watches of changes of keys, if any */
+    int numShards;             /* Number of shards, 0 if not sharded */
+    size_t shardId;            /* Same for the array and all its shards */
+    struct Array **shards;     /* Shards of the array, indexed by key hash */
+    struct SvIndex *indexPtr;  /* Keys in order, if the array is ordered */
 } Array;
 
+/*
+ * Some shared objects are better kept in an alternative representation
+ * than a Tcl object, like counters updated with atomic instructions.
+ * While such representation is in use, the Tcl object of the container
+ * is out of date. Sv_GetContainer brings it up to date and drops the
+ * representation, unless the caller asks to keep it.
+ */
+
+struct Container;
+
+typedef struct SvRepType {
+    const char *name;                           /* Name of the type */
+    void (*updateProc)(struct Container*);      /* Updates the Tcl object */
+    void (*freeProc)(struct Container*);        /* Frees the representation */
+    Tcl_Obj *(*valueProc)(struct Container*);   /* Returns a copy of the value,
+                                                 * may run under shared lock */
+    Tcl_Size (*sizeProc)(struct Container*);    /* Estimated memory used by
+                                                 * the representation, or NULL
+                                                 * if negligible */
+} SvRepType;
+
 /*
  * The object container for Tcl-objects stored within shared arrays.
  */
@@ -150,8 +311,18 @@ typedef struct Container {
     Tcl_HashEntry *entryPtr;   /* Entry in array table. */
     Tcl_HashEntry *handlePtr;  /* Entry in handles table */
     Tcl_Obj *tclObj;           /* Tcl object to hold shared values */
-    Tcl_Size epoch;            /* Track object changes */
-    char *chunkAddr;           /* Address of one chunk of object containers */
+    const SvRepType *repTypePtr; /* Type of the alternative representation */
+    void *repPtr;              /* The alternative representation, if any */
+    Tcl_WideInt epoch;         /* Track object changes */
+    Tcl_WideInt expires;       /* Expiry time in ms, 0 if none */
+    Tcl_Size ttlIndex;         /* Index in the bucket ttlHeap, -1 if none */
+    Tcl_Size size;             /* Size of key and value, if evicting */
+    struct Container *lruPrev; /* Neighbours in the array eviction order */
+    struct Container *lruNext;
+    int referenced;            /* Used since last looked at by CLOCK */
+    Tcl_Size strBytes;         /* Size of string rep counted in array */
+    Tcl_Size repBytes;         /* Size of value counted in array */
+    struct Chunk *chunkPtr;    /* Chunk holding the container */
     struct Container *nextPtr; /* Next object container in the free list */
     int aolSpecial;
 } Container;
@@ -187,6 +358,37 @@ typedef struct RegType {
     struct RegType *nextPtr;    /* Next in chain of registered types */
 } RegType;
 
+/*
+ * Commands waiting for a key to change register with the bucket the key
+ * lives in, or would live in once created, see Sv_WaitBegin.
+ */
+
+typedef struct SvWait {
+    const char *array;         /* Array of the key, NULL for handles */
+    const char *key;           /* Key waited for */
+    Bucket *bucketPtr;         /* Bucket registered with, or NULL */
+    Tcl_WideInt gen;           /* Generation of the bucket last seen */
+} SvWait;
+
+/*
+ * Glob patterns prepared with Sv_PatternInit. Patterns which are plain
+ * strings, or plain strings with a single "*" before or after them, are
+ * matched by comparing bytes instead of with Tcl_StringCaseMatch.
+ */
+
+#define SV_MATCH_ALL       0   /* No pattern, or just "*" */
+#define SV_MATCH_EXACT     1   /* Plain string */
+#define SV_MATCH_PREFIX    2   /* Plain string followed by "*" */
+#define SV_MATCH_SUFFIX    3   /* Plain string following "*" */
+#define SV_MATCH_GLOB      4   /* Any other pattern */
+
+typedef struct SvPattern {
+    const char *pattern;       /* The whole pattern */
+    const char *literal;       /* Its plain string */
+    Tcl_Size length;           /* Length of the plain string */
+    int type;                  /* One of SV_MATCH_* */
+} SvPattern;
+
 /*
  * Limited API functions
  */
@@ -206,6 +408,50 @@ Sv_GetContainer(Tcl_Interp*,Tcl_Size,Tcl_Obj*const objv[],Container**,Tcl_Size*,
 MODULE_SCOPE int
 Sv_PutContainer(Tcl_Interp*, Container*, int);
 
+MODULE_SCOPE void
+Sv_UpdateContainer(Container*);
+
+MODULE_SCOPE void
+Sv_LockBucket(Bucket*, int);
+
+MODULE_SCOPE void
+Sv_UnlockBucket(Bucket*);
+
+MODULE_SCOPE int
+Sv_WaitOptions(Tcl_Interp*, Tcl_Size*, Tcl_Obj*const**, Tcl_Size, Tcl_Obj**,
+	Tcl_WideInt*);
+
+MODULE_SCOPE void
+Sv_WaitBegin(SvWait*, Tcl_Size, Tcl_Obj*const objv[], Container*);
+
+MODULE_SCOPE int
+Sv_WaitChange(SvWait*, Tcl_WideInt);
+
+MODULE_SCOPE void
+Sv_WaitEnd(SvWait*);
+
+MODULE_SCOPE void
+Sv_PatternInit(SvPattern*, const char*, int);
+
+MODULE_SCOPE int
+Sv_PatternMatch(const SvPattern*, const char*, Tcl_Size);
+
+#ifdef SV_ATOMIC_MUTEX
+MODULE_SCOPE Tcl_WideInt
+SvAtomicGet(Tcl_WideInt*);
+
+MODULE_SCOPE void
+SvAtomicSet(Tcl_WideInt*, Tcl_WideInt);
+
+MODULE_SCOPE Tcl_WideInt
+SvAtomicAdd(Tcl_WideInt*, Tcl_WideInt);
+#endif
+
+#ifdef SV_ATOMIC_CAS
+MODULE_SCOPE int
+SvAtomicCas(Tcl_WideInt*, Tcl_WideInt*, Tcl_WideInt);
+#endif
+
 /*
  * Private version of Tcl_DuplicateObj which takes care about
  * copying objects when loaded to and retrieved from shared array.
@@ -0,0 +1,488 @@
+/*
+ * threadSvDictCmd.c --
+ *
+ * Implementation of the basic Tcl dict commands suitable for operation
+ * on thread shared (dict) variables.
+ *
+ * Like the list commands, these commands operate on the dict held in
+ * the shared variable per-reference instead of per-value. Changing one
+ * entry of a shared dict copies just that entry into the shared
+ * variable, not the whole dict back and forth.
+ *
+ * See the file "license.txt" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * ---------------------------------------------------------------------------
+ */
+
+#include "tclThreadInt.h"
+#include "threadSvCmd.h"
+#include "threadSvDictCmd.h"
+
+static Tcl_ObjCmdProc2 SvDsetObjCmd;      /* dset        */
+static Tcl_ObjCmdProc2 SvDgetObjCmd;      /* dget        */
+static Tcl_ObjCmdProc2 SvDunsetObjCmd;    /* dunset      */
+static Tcl_ObjCmdProc2 SvDincrObjCmd;     /* dincr       */
+static Tcl_ObjCmdProc2 SvDexistsObjCmd;   /* dexists     */
+
+static int DictGetPath(Tcl_Interp *, Tcl_Obj *, Tcl_Size, Tcl_Obj *const [],
+	int, Tcl_Obj **);
+
+/*
+ * Tcl type of dict objects. Readers holding the shared lock may only
+ * look into values which already are dicts.
+ */
+
+static const Tcl_ObjType *dictObjTypePtr = NULL;
+
+/*
+ * This mutex protects a static variable which tracks
+ * registration of commands and object types.
+ */
+
+static Tcl_Mutex initMutex;
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * Sv_RegisterDictCommands --
+ *
+ *      Register dict commands with shared variable module.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Memory gets allocated
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+Sv_RegisterDictCommands(void)
+{
+    static int initialized = 0;
+
+    if (initialized == 0) {
+	Tcl_MutexLock(&initMutex);
+	if (initialized == 0) {
+	    Tcl_Obj *dictObj = Tcl_NewDictObj();
+	    dictObjTypePtr = dictObj->typePtr;
+	    Tcl_DecrRefCount(dictObj);
+
+	    Sv_RegisterCommand("dset",    SvDsetObjCmd,    NULL, 0);
+	    Sv_RegisterCommand("dget",    SvDgetObjCmd,    NULL, 0);
+	    Sv_RegisterCommand("dunset",  SvDunsetObjCmd,  NULL, 0);
+	    Sv_RegisterCommand("dincr",   SvDincrObjCmd,   NULL, 0);
+	    Sv_RegisterCommand("dexists", SvDexistsObjCmd, NULL, 0);
+
+	    initialized = 1;
+	}
+	Tcl_MutexUnlock(&initMutex);
+    }
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvDsetObjCmd --
+ *
+ *      This procedure is invoked to process the "tsv::dset" command.
+ *      See the user documentation for details on what it does.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      See the user documentation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SvDsetObjCmd(
+    void *arg,
+    Tcl_Interp *interp,
+    Tcl_Size objc,
+    Tcl_Obj *const objv[]
+) {
+    int ret, flg;
+    Tcl_Size i, off, pathc;
+    Tcl_Obj *keys[SV_MAXARGS], **pathv = keys, *valObj;
+    Container *svObj = (Container*)arg;
+
+    /*
+     * Syntax:
+     *          tsv::dset array key dkey ?dkey ...? value
+     *          $dict dset dkey ?dkey ...? value
+     */
+
+    flg = FLAGS_CREATEARRAY | FLAGS_CREATEVAR;
+    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, flg);
+    if (ret != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (objc < 2 + off) {
+	Tcl_WrongNumArgs(interp, off, objv, "dkey ?dkey ...? value");
+	goto cmd_err;
+    }
+
+    /*
+     * Keys of new entries are kept by the shared dict, so
+     * the dict gets copies, as it does for the value.
+     */
+
+    pathc = objc - off - 1;
+    if (pathc > SV_MAXARGS) {
+	pathv = (Tcl_Obj **)Tcl_Alloc(pathc * sizeof(Tcl_Obj *));
+    }
+    for (i = 0; i < pathc; i++) {
+	pathv[i] = Sv_DuplicateObj(objv[off + i]);
+	Tcl_IncrRefCount(pathv[i]);
+    }
+    valObj = Sv_DuplicateObj(objv[objc - 1]);
+    Tcl_IncrRefCount(valObj);
+
+    ret = Tcl_DictObjPutKeyList(interp, svObj->tclObj, pathc, pathv, valObj);
+
+    Tcl_DecrRefCount(valObj);
+    for (i = 0; i < pathc; i++) {
+	Tcl_DecrRefCount(pathv[i]);
+    }
+    if (pathv != keys) {
+	Tcl_Free(pathv);
+    }
+    if (ret != TCL_OK) {
+	goto cmd_err;
+    }
+
+    return Sv_PutContainer(interp, svObj, SV_CHANGED);
+
+ cmd_err:
+    return Sv_PutContainer(interp, svObj, SV_ERROR);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvDgetObjCmd --
+ *
+ *      This procedure is invoked to process the "tsv::dget" command.
+ *      See the user documentation for details on what it does.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      See the user documentation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SvDgetObjCmd(
+    void *arg,
+    Tcl_Interp *interp,
+    Tcl_Size objc,
+    Tcl_Obj *const objv[]
+) {
+    int ret, flags = FLAGS_READONLY|FLAGS_DICTREP;
+    Tcl_Size off;
+    Tcl_Obj *valObj;
+    Container *svObj;
+
+    /*
+     * Syntax:
+     *          tsv::dget array key ?dkey ...?
+     *          $dict dget ?dkey ...?
+     */
+
+    while (1) {
+	svObj = (Container*)arg;
+	ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, flags);
+	if (ret != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	ret = DictGetPath(interp, svObj->tclObj, objc - off, objv + off,
+		flags & FLAGS_READONLY, &valObj);
+	if (ret != TCL_CONTINUE) {
+	    break;
+	}
+
+	/*
+	 * Some value on the way needs to be converted
+	 * to a dict. Start over with the exclusive lock.
+	 */
+
+	Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+	flags = 0;
+    }
+    if (ret != TCL_OK) {
+	goto cmd_err;
+    }
+    Tcl_SetObjResult(interp, Sv_DuplicateObj(valObj));
+
+    return Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+
+ cmd_err:
+    return Sv_PutContainer(interp, svObj, SV_ERROR);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvDunsetObjCmd --
+ *
+ *      This procedure is invoked to process the "tsv::dunset" command.
+ *      See the user documentation for details on what it does.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      See the user documentation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SvDunsetObjCmd(
+    void *arg,
+    Tcl_Interp *interp,
+    Tcl_Size objc,
+    Tcl_Obj *const objv[]
+) {
+    int ret;
+    Tcl_Size off;
+    Container *svObj = (Container*)arg;
+
+    /*
+     * Syntax:
+     *          tsv::dunset array key dkey ?dkey ...?
+     *          $dict dunset dkey ?dkey ...?
+     */
+
+    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, 0);
+    if (ret != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (objc < 1 + off) {
+	Tcl_WrongNumArgs(interp, off, objv, "dkey ?dkey ...?");
+	goto cmd_err;
+    }
+    ret = Tcl_DictObjRemoveKeyList(interp, svObj->tclObj, objc - off,
+	    objv + off);
+    if (ret != TCL_OK) {
+	goto cmd_err;
+    }
+
+    return Sv_PutContainer(interp, svObj, SV_CHANGED);
+
+ cmd_err:
+    return Sv_PutContainer(interp, svObj, SV_ERROR);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvDincrObjCmd --
+ *
+ *      This procedure is invoked to process the "tsv::dincr" command.
+ *      See the user documentation for details on what it does.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      See the user documentation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SvDincrObjCmd(
+    void *arg,
+    Tcl_Interp *interp,
+    Tcl_Size objc,
+    Tcl_Obj *const objv[]
+) {
+    int ret, flg;
+    Tcl_Size off;
+    Tcl_WideInt value = 0, incr = 1;
+    Tcl_Obj *keyObj, *valObj;
+    Container *svObj = (Container*)arg;
+
+    /*
+     * Syntax:
+     *          tsv::dincr array key dkey ?increment?
+     *          $dict dincr dkey ?increment?
+     */
+
+    flg = FLAGS_CREATEARRAY | FLAGS_CREATEVAR;
+    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, flg);
+    if (ret != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (objc != 1 + off && objc != 2 + off) {
+	Tcl_WrongNumArgs(interp, off, objv, "dkey ?increment?");
+	goto cmd_err;
+    }
+    if (objc == 2 + off
+	    && Tcl_GetWideIntFromObj(interp, objv[off + 1], &incr) != TCL_OK) {
+	goto cmd_err;
+    }
+    if (Tcl_DictObjGet(interp, svObj->tclObj, objv[off], &valObj) != TCL_OK) {
+	goto cmd_err;
+    }
+    if (valObj && Tcl_GetWideIntFromObj(interp, valObj, &value) != TCL_OK) {
+	goto cmd_err;
+    }
+    value += incr;
+
+    keyObj = Sv_DuplicateObj(objv[off]);
+    Tcl_IncrRefCount(keyObj);
+    ret = Tcl_DictObjPut(interp, svObj->tclObj, keyObj,
+	    Tcl_NewWideIntObj(value));
+    Tcl_DecrRefCount(keyObj);
+    if (ret != TCL_OK) {
+	goto cmd_err;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(value));
+
+    return Sv_PutContainer(interp, svObj, SV_CHANGED);
+
+ cmd_err:
+    return Sv_PutContainer(interp, svObj, SV_ERROR);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvDexistsObjCmd --
+ *
+ *      This procedure is invoked to process the "tsv::dexists" command.
+ *      See the user documentation for details on what it does.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      See the user documentation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SvDexistsObjCmd(
+    void *arg,
+    Tcl_Interp *interp,
+    Tcl_Size objc,
+    Tcl_Obj *const objv[]
+) {
+    int ret, flags = FLAGS_READONLY|FLAGS_DICTREP;
+    Tcl_Size off;
+    Tcl_Obj *valObj;
+    Container *svObj;
+
+    /*
+     * Syntax:
+     *          tsv::dexists array key dkey ?dkey ...?
+     *          $dict dexists dkey ?dkey ...?
+     */
+
+    while (1) {
+	svObj = (Container*)arg;
+	ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, flags);
+	if (ret == TCL_BREAK) {
+	    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+	    return TCL_OK;
+	} else if (ret != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if (objc < 1 + off) {
+	    Tcl_WrongNumArgs(interp, off, objv, "dkey ?dkey ...?");
+	    goto cmd_err;
+	}
+	ret = DictGetPath(NULL, svObj->tclObj, objc - off, objv + off,
+		flags & FLAGS_READONLY, &valObj);
+	if (ret != TCL_CONTINUE) {
+	    break;
+	}
+	Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+	flags = 0;
+    }
+
+    /*
+     * Like "dict exists", values which are no dict do not
+     * have the key, rather than being an error.
+     */
+
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(ret == TCL_OK && valObj != NULL));
+
+    return Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+
+ cmd_err:
+    return Sv_PutContainer(interp, svObj, SV_ERROR);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * DictGetPath --
+ *
+ *      Looks up the value at the path of keys in the nested dict. With
+ *      the shared lock held, values may not be converted to dicts,
+ *      since other readers look at them at the same time.
+ *
+ * Results:
+ *      A standard Tcl result and the value found. A missing key is an
+ *      error, unless no interpreter is given; the value is NULL then.
+ *      TCL_CONTINUE if the lookup must be repeated with the exclusive
+ *      lock held.
+ *
+ * Side effects:
+ *      Values may be converted to dicts.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+DictGetPath(
+    Tcl_Interp *interp,
+    Tcl_Obj *dictObj,
+    Tcl_Size pathc,
+    Tcl_Obj *const pathv[],
+    int readonly,
+    Tcl_Obj **valObjPtr
+) {
+    Tcl_Size i, size;
+
+    if (pathc == 0 && !readonly
+	    && Tcl_DictObjSize(interp, dictObj, &size) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    for (i = 0; i < pathc && dictObj != NULL; i++) {
+	if (readonly && dictObj->typePtr != dictObjTypePtr) {
+	    return TCL_CONTINUE;
+	}
+	if (Tcl_DictObjGet(interp, dictObj, pathv[i], &dictObj) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if (dictObj == NULL && interp) {
+	    Tcl_AppendResult(interp, "key \"", Tcl_GetString(pathv[i]),
+		    "\" not known in dictionary", (void *)NULL);
+	    return TCL_ERROR;
+	}
+    }
+    *valObjPtr = dictObj;
+
+    return TCL_OK;
+}
+
+/* EOF $RCSfile: threadSvDictCmd.c,v $ */
+
+/* Emacs Setup Variables */
+/* Local Variables:      */
+/* mode: C               */
+/* indent-tabs-mode: nil */
+/* c-basic-offset: 4     */
+/* End:                  */
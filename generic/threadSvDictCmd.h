@@ -0,0 +1,25 @@
+/*
+ * threadSvDictCmd.h --
+ *
+ * See the file "license.txt" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * ---------------------------------------------------------------------------
+ */
+
+#ifndef _SV_DICT_H_
+#define _SV_DICT_H_
+
+#include "tclThreadInt.h"
+
+MODULE_SCOPE void Sv_RegisterDictCommands(void);
+
+#endif /* _SV_DICT_H_ */
+
+/* EOF $RCSfile: threadSvDictCmd.h,v $ */
+
+/* Emacs Setup Variables */
+/* Local Variables:      */
+/* mode: C               */
+/* indent-tabs-mode: nil */
+/* c-basic-offset: 4     */
+/* End:                  */
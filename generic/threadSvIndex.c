@@ -0,0 +1,257 @@
+/*
+ * threadSvIndex.c --
+ *
+ * Ordered index of the keys of shared arrays.
+ *
+ * Shared arrays keep their keys in hash tables, which have no order, so
+ * finding the keys in a range or with a common prefix means visiting
+ * all of them. Arrays created with the -ordered option also keep their
+ * keys in a skiplist, where such keys are found in logarithmic time
+ * and then visited in order. The index is protected by the lock of the
+ * bucket holding the array.
+ *
+ * See the file "license.txt" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * ---------------------------------------------------------------------------
+ */
+
+#include "tclThreadInt.h"
+#include "threadSvIndex.h"
+
+static SvIndexNode *NewNode(int, const char*, void*);
+static int FindPath(SvIndex*, const char*, SvIndexNode**);
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * Sv_IndexNew, Sv_IndexFree --
+ *
+ *      Create and delete an index.
+ *
+ * Results:
+ *      Sv_IndexNew returns the new, empty index.
+ *
+ * Side effects:
+ *      Memory gets allocated or freed. The values are left alone.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+SvIndex *
+Sv_IndexNew(void)
+{
+    SvIndex *indexPtr = (SvIndex *)Tcl_Alloc(sizeof(SvIndex));
+
+    indexPtr->headPtr  = NewNode(SV_INDEX_MAXLEVEL, "", NULL);
+    indexPtr->level    = 1;
+    indexPtr->seed     = (unsigned int)(size_t)indexPtr | 1;
+    indexPtr->numKeys  = 0;
+    indexPtr->numBytes = 0;
+
+    return indexPtr;
+}
+
+void
+Sv_IndexFree(
+    SvIndex *indexPtr
+) {
+    SvIndexNode *nodePtr, *nextPtr;
+
+    for (nodePtr = indexPtr->headPtr; nodePtr; nodePtr = nextPtr) {
+	nextPtr = nodePtr->next[0];
+	Tcl_Free(nodePtr);
+    }
+    Tcl_Free(indexPtr);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * Sv_IndexInsert, Sv_IndexRemove --
+ *
+ *      Add a key with its value to the index, or remove it. The key
+ *      must not be in the index when added.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Memory gets allocated or freed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+Sv_IndexInsert(
+    SvIndex *indexPtr,
+    const char *key,
+    void *value
+) {
+    SvIndexNode *update[SV_INDEX_MAXLEVEL], *nodePtr;
+    int i, level;
+
+    FindPath(indexPtr, key, update);
+
+    /*
+     * Every fourth node reaches one level higher.
+     */
+
+    level = 1;
+    do {
+	indexPtr->seed ^= indexPtr->seed << 13;
+	indexPtr->seed ^= indexPtr->seed >> 17;
+	indexPtr->seed ^= indexPtr->seed << 5;
+    } while ((indexPtr->seed & 3) == 0 && ++level < SV_INDEX_MAXLEVEL);
+
+    for (i = indexPtr->level; i < level; i++) {
+	update[i] = indexPtr->headPtr;
+    }
+    if (level > indexPtr->level) {
+	indexPtr->level = level;
+    }
+
+    nodePtr = NewNode(level, key, value);
+    for (i = 0; i < level; i++) {
+	nodePtr->next[i] = update[i]->next[i];
+	update[i]->next[i] = nodePtr;
+    }
+    indexPtr->numKeys++;
+    indexPtr->numBytes += sizeof(SvIndexNode)
+	    + (level - 1) * sizeof(SvIndexNode *) + strlen(key) + 1;
+}
+
+void
+Sv_IndexRemove(
+    SvIndex *indexPtr,
+    const char *key
+) {
+    SvIndexNode *update[SV_INDEX_MAXLEVEL], *nodePtr;
+    int i;
+
+    if (!FindPath(indexPtr, key, update)) {
+	return;
+    }
+    nodePtr = update[0]->next[0];
+    for (i = 0; i < nodePtr->level; i++) {
+	update[i]->next[i] = nodePtr->next[i];
+    }
+    while (indexPtr->level > 1
+	    && indexPtr->headPtr->next[indexPtr->level - 1] == NULL) {
+	indexPtr->level--;
+    }
+    indexPtr->numKeys--;
+    indexPtr->numBytes -= sizeof(SvIndexNode)
+	    + (nodePtr->level - 1) * sizeof(SvIndexNode *) + strlen(key) + 1;
+    Tcl_Free(nodePtr);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * Sv_IndexSeek --
+ *
+ *      Finds the first key of the index not sorting before the given
+ *      one. Following keys are visited with Sv_IndexNext.
+ *
+ * Results:
+ *      The node of the key, or NULL if there is no such key.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+SvIndexNode *
+Sv_IndexSeek(
+    SvIndex *indexPtr,
+    const char *key
+) {
+    SvIndexNode *update[SV_INDEX_MAXLEVEL];
+
+    FindPath(indexPtr, key, update);
+
+    return update[0]->next[0];
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * FindPath --
+ *
+ *      Finds the last node before the given key on each level in use.
+ *
+ * Results:
+ *      1 if the key is in the index, 0 otherwise.
+ *
+ * Side effects:
+ *      The nodes are stored in the given array.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+FindPath(
+    SvIndex *indexPtr,
+    const char *key,
+    SvIndexNode **update
+) {
+    SvIndexNode *nodePtr = indexPtr->headPtr, *nextPtr;
+    int i;
+
+    for (i = indexPtr->level - 1; i >= 0; i--) {
+	while ((nextPtr = nodePtr->next[i]) != NULL
+		&& strcmp(nextPtr->key, key) < 0) {
+	    nodePtr = nextPtr;
+	}
+	update[i] = nodePtr;
+    }
+    nextPtr = nodePtr->next[0];
+
+    return nextPtr != NULL && !strcmp(nextPtr->key, key);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * NewNode --
+ *
+ *      Allocates a node with the given number of links, holding
+ *      a copy of the key.
+ *
+ * Results:
+ *      The new node.
+ *
+ * Side effects:
+ *      Memory gets allocated.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static SvIndexNode *
+NewNode(
+    int level,
+    const char *key,
+    void *value
+) {
+    size_t len = strlen(key) + 1;
+    size_t size = sizeof(SvIndexNode) + (level - 1) * sizeof(SvIndexNode *);
+    SvIndexNode *nodePtr = (SvIndexNode *)Tcl_Alloc(size + len);
+
+    memset(nodePtr->next, 0, level * sizeof(SvIndexNode *));
+    memcpy((char *)nodePtr + size, key, len);
+    nodePtr->key = (char *)nodePtr + size;
+    nodePtr->value = value;
+    nodePtr->level = level;
+
+    return nodePtr;
+}
+
+/* EOF $RCSfile: threadSvIndex.c,v $ */
+
+/* Emacs Setup Variables */
+/* Local Variables:      */
+/* mode: C               */
+/* indent-tabs-mode: nil */
+/* c-basic-offset: 4     */
+/* End:                  */
@@ -0,0 +1,56 @@
+/*
+ * threadSvIndex.h --
+ *
+ * Ordered index of the keys of shared arrays.
+ *
+ * See the file "license.txt" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * ---------------------------------------------------------------------------
+ */
+
+#ifndef _SV_INDEX_H_
+#define _SV_INDEX_H_
+
+#include "tclThreadInt.h"
+
+#define SV_INDEX_MAXLEVEL 32
+
+/*
+ * The index is a skiplist of keys, each with a copy of its key and
+ * a pointer to the value indexed, kept in the order of strcmp.
+ */
+
+typedef struct SvIndexNode {
+    void *value;               /* Value of the key */
+    const char *key;           /* Key, stored after the links */
+    int level;                 /* Number of links */
+    struct SvIndexNode *next[1]; /* Next nodes, actually "level" of them */
+} SvIndexNode;
+
+typedef struct SvIndex {
+    SvIndexNode *headPtr;      /* Head of the skiplist, no key */
+    int level;                 /* Highest level in use */
+    unsigned int seed;         /* State of the level generator */
+    Tcl_Size numKeys;          /* Number of keys */
+    Tcl_Size numBytes;         /* Memory used by the nodes */
+} SvIndex;
+
+#define Sv_IndexFirst(indexPtr) ((indexPtr)->headPtr->next[0])
+#define Sv_IndexNext(nodePtr)   ((nodePtr)->next[0])
+
+MODULE_SCOPE SvIndex *Sv_IndexNew(void);
+MODULE_SCOPE void Sv_IndexFree(SvIndex*);
+MODULE_SCOPE void Sv_IndexInsert(SvIndex*, const char*, void*);
+MODULE_SCOPE void Sv_IndexRemove(SvIndex*, const char*);
+MODULE_SCOPE SvIndexNode *Sv_IndexSeek(SvIndex*, const char*);
+
+#endif /* _SV_INDEX_H_ */
+
+/* EOF $RCSfile: threadSvIndex.h,v $ */
+
+/* Emacs Setup Variables */
+/* Local Variables:      */
+/* mode: C               */
+/* indent-tabs-mode: nil */
+/* c-basic-offset: 4     */
+/* End:                  */
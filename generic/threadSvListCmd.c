@@ -13,30 +13,6 @@
 #include "threadSvCmd.h"
 #include "threadSvListCmd.h"
 
-/* Tcl 8 only defines Tcl_GetIntForIndex in its internal stubs */
-#if TCL_MAJOR_VERSION < 9
-# if defined(USE_TCL_STUBS)
-/*  Little hack to eliminate the need for "tclInt.h" here:
-    Just copy a small portion of TclIntStubs, just
-    enough to make it work */
-typedef struct TclIntStubs {
-    int magic;
-    void *hooks;
-    void (*dummy[34]) (void); /* dummy entries 0-33, not used */
-    int (*tclGetIntForIndex) (Tcl_Interp *interp, Tcl_Obj *objPtr, int endValue, int *indexPtr); /* 34 */
-} TclIntStubs;
-extern const TclIntStubs *tclIntStubsPtr;
-
-# undef Tcl_GetIntForIndex
-# define Tcl_GetIntForIndex(interp, obj, max, ptr) ((tclIntStubsPtr->tclGetIntForIndex == NULL)? \
-    ((int (*)(Tcl_Interp*,  Tcl_Obj *, int, int*))(void *)((&(tclStubsPtr->tcl_PkgProvideEx))[645]))((interp), (obj), (max), (ptr)): \
-	tclIntStubsPtr->tclGetIntForIndex((interp), (obj), (max), (ptr)))
-# else
-EXTERN int TclGetIntForIndex(Tcl_Interp *interp, Tcl_Obj *objPtr, int endValue, int *indexPtr);
-#   define Tcl_GetIntForIndex TclGetIntForIndex
-# endif
-#endif
-
 /*
  * Implementation of list commands for shared variables.
  * Most of the standard Tcl list commands are implemented.
@@ -68,6 +44,41 @@ static Tcl_ObjCmdProc2 SvLsetObjCmd;      /* lset        */
 
 static void DupListObjShared(Tcl_Obj*, Tcl_Obj*);
 
+/*
+ * Lists used as double-ended queues, with tsv::lpush and tsv::lpop at
+ * their head, are kept in a ring buffer instead, so that adding and
+ * removing elements at either end takes constant time. Other commands
+ * convert the ring back to a Tcl list.
+ */
+
+typedef struct Deque {
+    Tcl_Obj **elems;           /* Ring of elements, each referenced */
+    Tcl_Size first;            /* Slot of the first element */
+    Tcl_Size count;            /* Number of elements */
+    Tcl_Size size;             /* Number of slots, a power of two */
+} Deque;
+
+#define DEQUE_MIN_SIZE 16
+#define DEQUE_SLOT(d, i) ((d)->elems[((d)->first + (i)) & ((d)->size - 1)])
+
+static void DequeUpdateProc(Container*);
+static void DequeFreeProc(Container*);
+static Tcl_Obj* DequeValueProc(Container*);
+static Tcl_Size DequeSizeProc(Container*);
+
+static const SvRepType dequeRepType = {
+    "deque",
+    DequeUpdateProc,
+    DequeFreeProc,
+    DequeValueProc,
+    DequeSizeProc
+};
+
+static Deque *DequeFromList(Container*);
+static void DequePush(Deque*, Tcl_Obj*, int);
+static Tcl_Obj *DequePop(Deque*, int);
+static int ListLength(Tcl_Interp*, Container*, Tcl_Size*);
+
 /*
  * This mutex protects a static variable which tracks
  * registration of commands and object types.
@@ -156,41 +167,91 @@ SvLpopObjCmd (
     Tcl_Obj *const objv[]
 ) {
     int ret;
-    Tcl_Size off, llen, index = 0, iarg = 0;
-    Tcl_Obj *elPtr = NULL;
+    Tcl_Size off, llen, index = 0, iarg = 0, first = arg ? 2 : 1;
+    Tcl_WideInt deadline;
+    SvWait wait;
+    Tcl_Obj *elPtr = NULL, *args[SV_MAXARGS];
     Container *svObj = (Container*)arg;
+    Deque *dqPtr;
 
     /*
      * Syntax:
-     *          tsv::lpop array key ?index?
-     *          $list lpop ?index?
+     *          tsv::lpop ?-wait? ?-timeout ms? array key ?index?
+     *          $list lpop ?-wait? ?-timeout ms? ?index?
      */
 
-    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, 0);
-    if (ret != TCL_OK) {
+    if (Sv_WaitOptions(interp, &objc, &objv, first, args,
+	    &deadline) != TCL_OK) {
 	return TCL_ERROR;
     }
-    if (objc > 1 + off) {
-	Tcl_WrongNumArgs(interp, off, objv, "?index?");
-	goto cmd_err;
-    }
-    if (objc == 1 + off) {
-	iarg = off;
-    }
-    ret = Tcl_ListObjLength(interp, svObj->tclObj, &llen);
-    if (ret != TCL_OK) {
-	goto cmd_err;
+    if (deadline) {
+	Sv_WaitBegin(&wait, objc, objv, (Container*)arg);
     }
-    if (iarg) {
-	ret = Tcl_GetIntForIndex(interp, objv[iarg], llen-1, &index);
-	if (ret != TCL_OK) {
-	    goto cmd_err;
+
+    while (1) {
+	ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, FLAGS_KEEPREP);
+	if (ret == TCL_OK) {
+	    if (objc > 1 + off) {
+		Tcl_WrongNumArgs(interp, off, objv, "?index?");
+		goto cmd_err;
+	    }
+	    if (objc == 1 + off) {
+		iarg = off;
+	    }
+	    ret = ListLength(interp, svObj, &llen);
+	    if (ret != TCL_OK) {
+		goto cmd_err;
+	    }
+	    if (iarg) {
+		ret = Tcl_GetIntForIndex(interp, objv[iarg], llen-1, &index);
+		if (ret != TCL_OK) {
+		    goto cmd_err;
+		}
+	    }
+	    if (((index >= 0) && (index < llen)) || !deadline) {
+		break;
+	    }
+	    Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+	} else if (ret == TCL_ERROR || arg || !deadline) {
+	    ret = TCL_ERROR;
+	    goto cmd_exit;
+	}
+
+	/*
+	 * Nothing to pop yet. Wait for somebody to
+	 * change anything and look again.
+	 */
+
+	Tcl_ResetResult(interp);
+	if (!Sv_WaitChange(&wait, deadline)) {
+	    ret = TCL_OK;
+	    goto cmd_exit;
 	}
+	svObj = (Container*)arg;
     }
+
     if ((index < 0) || (index >= llen)) {
 	/* Ignore out-of bounds, like Tcl does */
-	return Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+	ret = Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+	goto cmd_exit;
+    }
+
+    /*
+     * Popping the head of a list shifts all other elements. Keep such
+     * lists as a ring, where both ends are cheap to get at.
+     */
+
+    dqPtr = (svObj->repTypePtr == &dequeRepType) ? (Deque *)svObj->repPtr
+	    : (index == 0 && llen > 1) ? DequeFromList(svObj) : NULL;
+    if (dqPtr && (index == 0 || index == llen - 1)) {
+	elPtr = DequePop(dqPtr, index == 0);
+	Tcl_SetObjResult(interp, elPtr);
+	Tcl_DecrRefCount(elPtr);
+	ret = Sv_PutContainer(interp, svObj, SV_CHANGED);
+	goto cmd_exit;
     }
+    Sv_UpdateContainer(svObj);
+
     ret = Tcl_ListObjIndex(interp, svObj->tclObj, index, &elPtr);
     if (ret != TCL_OK) {
 	goto cmd_err;
@@ -204,10 +265,17 @@ SvLpopObjCmd (
     }
     Tcl_SetObjResult(interp, elPtr);
     Tcl_DecrRefCount(elPtr);
-    return Sv_PutContainer(interp, svObj, SV_CHANGED);
+    ret = Sv_PutContainer(interp, svObj, SV_CHANGED);
+    goto cmd_exit;
 
  cmd_err:
-    return Sv_PutContainer(interp, svObj, SV_ERROR);
+    ret = Sv_PutContainer(interp, svObj, SV_ERROR);
+
+ cmd_exit:
+    if (deadline) {
+	Sv_WaitEnd(&wait);
+    }
+    return ret;
 }
 
 /*
@@ -238,6 +306,7 @@ SvLpushObjCmd (
     Tcl_Size off, llen, index = 0;
     Tcl_Obj *args[1];
     Container *svObj = (Container*)arg;
+    Deque *dqPtr;
 
     /*
      * Syntax:
@@ -245,7 +314,7 @@ SvLpushObjCmd (
      *          $list lpush element ?index?
      */
 
-    flg = FLAGS_CREATEARRAY | FLAGS_CREATEVAR;
+    flg = FLAGS_CREATEARRAY | FLAGS_CREATEVAR | FLAGS_KEEPREP;
     ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, flg);
     if (ret != TCL_OK) {
 	return TCL_ERROR;
@@ -254,7 +323,7 @@ SvLpushObjCmd (
 	Tcl_WrongNumArgs(interp, off, objv, "element ?index?");
 	goto cmd_err;
     }
-    ret = Tcl_ListObjLength(interp, svObj->tclObj, &llen);
+    ret = ListLength(interp, svObj, &llen);
     if (ret != TCL_OK) {
 	goto cmd_err;
     }
@@ -270,6 +339,14 @@ SvLpushObjCmd (
 	}
     }
 
+    dqPtr = (svObj->repTypePtr == &dequeRepType) ? (Deque *)svObj->repPtr
+	    : (index == 0 && llen > 0) ? DequeFromList(svObj) : NULL;
+    if (dqPtr && (index == 0 || index == llen)) {
+	DequePush(dqPtr, Sv_DuplicateObj(objv[off]), index == 0);
+	return Sv_PutContainer(interp, svObj, SV_CHANGED);
+    }
+    Sv_UpdateContainer(svObj);
+
     args[0] = Sv_DuplicateObj(objv[off]);
     ret = Tcl_ListObjReplace(interp, svObj->tclObj, index, 0, 1, args);
     if (ret != TCL_OK) {
@@ -318,7 +395,7 @@ SvLappendObjCmd(
      *          $list lappend value ?value ...?
      */
 
-    flg = FLAGS_CREATEARRAY | FLAGS_CREATEVAR;
+    flg = FLAGS_CREATEARRAY | FLAGS_CREATEVAR | FLAGS_KEEPREP;
     ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, flg);
     if (ret != TCL_OK) {
 	return TCL_ERROR;
@@ -327,6 +404,14 @@ SvLappendObjCmd(
 	Tcl_WrongNumArgs(interp, off, objv, "value ?value ...?");
 	goto cmd_err;
     }
+    if (svObj->repTypePtr == &dequeRepType) {
+	for (i = off; i < objc; i++) {
+	    DequePush((Deque *)svObj->repPtr, Sv_DuplicateObj(objv[i]), 0);
+	}
+	Tcl_SetObjResult(interp, DequeValueProc(svObj));
+	return Sv_PutContainer(interp, svObj, SV_CHANGED);
+    }
+    Sv_UpdateContainer(svObj);
     for (i = off; i < objc; i++) {
 	dup = Sv_DuplicateObj(objv[i]);
 	ret = Tcl_ListObjAppendElement(interp, svObj->tclObj, dup);
@@ -477,7 +562,8 @@ SvLrangeObjCmd(
      *          $list lrange first last
      */
 
-    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, 0);
+    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off,
+	    FLAGS_READONLY|FLAGS_LISTREP);
     if (ret != TCL_OK) {
 	return TCL_ERROR;
     }
@@ -638,12 +724,32 @@ SvLlengthObjCmd(
      *          $list llength
      */
 
-    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, 0);
+    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off,
+	    FLAGS_READONLY|FLAGS_LISTREP|FLAGS_KEEPREP);
     if (ret != TCL_OK) {
 	return TCL_ERROR;
     }
+    if (svObj->repTypePtr && svObj->repTypePtr != &dequeRepType) {
 
-    ret = Tcl_ListObjLength(interp, svObj->tclObj, &llen);
+	/*
+	 * Other representations are converted under the exclusive lock.
+	 */
+
+	Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+	svObj = (Container*)arg;
+	ret = Sv_GetContainer(interp, objc, objv, &svObj, &off,
+		FLAGS_READONLY|FLAGS_LISTREP);
+	if (ret != TCL_OK) {
+	    return TCL_ERROR;
+	}
+    }
+
+    if (svObj->repTypePtr == &dequeRepType) {
+	llen = ((Deque *)svObj->repPtr)->count;
+	ret = TCL_OK;
+    } else {
+	ret = Tcl_ListObjLength(interp, svObj->tclObj, &llen);
+    }
     if (ret == TCL_OK) {
 	Tcl_SetObjResult(interp, Tcl_NewIntObj(llen));
     }
@@ -678,82 +784,122 @@ SvLsearchObjCmd(
     Tcl_Size objc,
     Tcl_Obj *const objv[]
 ) {
-    int ret, match;
-    Tcl_Size off, index, length, i, listc, imode, ipatt;
-    const char *patBytes;
-    Tcl_Obj **listv;
+    int ret, match, opt, all = 0, inlineRes = 0;
+    Tcl_Size off, index, i, listc, start = 0, ipatt;
+    SvPattern pattern;
+    Tcl_Obj **listv, *startObj = NULL, *resObj = NULL;
     Container *svObj = (Container*)arg;
 
-    static const char *const modes[] = {"-exact", "-glob", "-regexp", NULL};
-    enum { LS_EXACT, LS_GLOB, LS_REGEXP };
+    static const char *const opts[] = {
+	"-all", "-exact", "-glob", "-inline", "-regexp", "-start", NULL
+    };
+    enum { LS_ALL, LS_EXACT, LS_GLOB, LS_INLINE, LS_REGEXP, LS_START };
     int mode;
 
     mode = LS_GLOB;
 
     /*
      * Syntax:
-     *          tsv::lsearch array key ?mode? pattern
-     *          $list lsearch ?mode? pattern
+     *          tsv::lsearch array key ?options? pattern
+     *          $list lsearch ?options? pattern
      */
 
     ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, 0);
     if (ret != TCL_OK) {
 	return TCL_ERROR;
     }
-    if (objc == 2 + off) {
-	imode = off;
-	ipatt = off + 1;
-    } else if (objc == 1 + off) {
-	imode = 0;
-	ipatt = off;
-    } else {
-	Tcl_WrongNumArgs(interp, off, objv, "?mode? pattern");
+    if (objc < 1 + off) {
+	Tcl_WrongNumArgs(interp, off, objv, "?options? pattern");
 	goto cmd_err;
     }
-    if (imode) {
-	ret = Tcl_GetIndexFromObjStruct(interp, objv[imode], modes, sizeof(char *), "search mode",
-		0, &mode);
+    ipatt = objc - 1;
+    for (i = off; i < ipatt; i++) {
+	ret = Tcl_GetIndexFromObjStruct(interp, objv[i], opts, sizeof(char *),
+		"option", 0, &opt);
 	if (ret != TCL_OK) {
 	    goto cmd_err;
 	}
+	switch (opt) {
+	case LS_ALL:
+	    all = 1;
+	    break;
+	case LS_INLINE:
+	    inlineRes = 1;
+	    break;
+	case LS_START:
+	    if (++i == ipatt) {
+		Tcl_AppendResult(interp, "missing starting index", (void *)NULL);
+		goto cmd_err;
+	    }
+	    startObj = objv[i];
+	    break;
+	default:
+	    mode = opt;
+	    break;
+	}
     }
     ret = Tcl_ListObjGetElements(interp, svObj->tclObj, &listc, &listv);
     if (ret != TCL_OK) {
 	goto cmd_err;
     }
+    if (startObj) {
+	ret = Tcl_GetIntForIndex(interp, startObj, listc-1, &start);
+	if (ret != TCL_OK) {
+	    goto cmd_err;
+	}
+	if (start < 0) {
+	    start = 0;
+	}
+    }
+
+    /*
+     * Only the matches are copied out of the shared list.
+     */
 
     index = TCL_INDEX_NONE;
-    patBytes = Tcl_GetStringFromObj(objv[ipatt], &length);
+    Sv_PatternInit(&pattern, Tcl_GetString(objv[ipatt]), mode == LS_EXACT);
+    if (all) {
+	resObj = Tcl_NewListObj(0, NULL);
+    }
 
-    for (i = 0; i < listc; i++) {
+    for (i = start; i < listc; i++) {
 	match = 0;
 	switch (mode) {
 	case LS_GLOB:
-	    match = Tcl_StringCaseMatch(Tcl_GetString(listv[i]), patBytes, 0);
-	    break;
-
 	case LS_EXACT: {
 	    Tcl_Size len;
 	    const char *bytes = Tcl_GetStringFromObj(listv[i], &len);
-	    if (length == len) {
-		match = (memcmp(bytes, patBytes, length) == 0);
-	    }
+	    match = Sv_PatternMatch(&pattern, bytes, len);
 	    break;
 	}
 	case LS_REGEXP:
 	    match = Tcl_RegExpMatchObj(interp, listv[i], objv[ipatt]);
 	    if (match < 0) {
+		if (resObj) {
+		    Tcl_DecrRefCount(resObj);
+		}
 		goto cmd_err;
 	    }
 	    break;
 	}
-	if (match) {
+	if (!match) {
+	    continue;
+	}
+	if (!all) {
 	    index = i;
 	    break;
 	}
+	Tcl_ListObjAppendElement(NULL, resObj, inlineRes
+		? Sv_DuplicateObj(listv[i]) : Tcl_NewWideIntObj(i));
     }
 
-    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(index));
+    if (all) {
+	Tcl_SetObjResult(interp, resObj);
+    } else if (!inlineRes) {
+	Tcl_SetObjResult(interp, Tcl_NewWideIntObj(index));
+    } else if (index != TCL_INDEX_NONE) {
+	Tcl_SetObjResult(interp, Sv_DuplicateObj(listv[index]));
+    }
 
     return Sv_PutContainer(interp, svObj, SV_UNCHANGED);
 
@@ -796,7 +942,8 @@ SvLindexObjCmd(
      *          $list lindex index
      */
 
-    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, 0);
+    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off,
+	    FLAGS_READONLY|FLAGS_LISTREP);
     if (ret != TCL_OK) {
 	return TCL_ERROR;
     }
@@ -881,6 +1028,232 @@ SvLsetObjCmd(
     return Sv_PutContainer(interp, svObj, SV_ERROR);
 }
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * ListLength --
+ *
+ *      Returns the length of the list held in the container, either
+ *      as a ring or as a Tcl list. Any other alternative representation
+ *      is dropped first.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      The object may be converted to a list.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+ListLength(
+    Tcl_Interp *interp,
+    Container *svObj,
+    Tcl_Size *llenPtr
+) {
+    if (svObj->repTypePtr == &dequeRepType) {
+	*llenPtr = ((Deque *)svObj->repPtr)->count;
+	return TCL_OK;
+    }
+    Sv_UpdateContainer(svObj);
+
+    return Tcl_ListObjLength(interp, svObj->tclObj, llenPtr);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * DequeFromList --
+ *
+ *      Moves the elements of the list held in the container to a ring.
+ *      Only done for arrays which are neither bound to a persistent
+ *      store nor evict keys, since those need the Tcl object to be
+ *      up to date after every change.
+ *
+ * Results:
+ *      The ring, or NULL if the list must stay as it is.
+ *
+ * Side effects:
+ *      The container gets the deque representation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Deque *
+DequeFromList(
+    Container *svObj
+) {
+    Tcl_Size i, objc;
+    Tcl_Obj **objv;
+    Deque *dqPtr;
+
+    if (svObj->arrayPtr->psPtr || svObj->arrayPtr->policy != SV_EVICT_NONE
+	    || Tcl_ListObjGetElements(NULL, svObj->tclObj, &objc,
+		    &objv) != TCL_OK) {
+	return NULL;
+    }
+
+    dqPtr = (Deque *)Tcl_Alloc(sizeof(Deque));
+    for (dqPtr->size = DEQUE_MIN_SIZE; dqPtr->size <= objc; ) {
+	dqPtr->size *= 2;
+    }
+    dqPtr->elems = (Tcl_Obj **)Tcl_Alloc(dqPtr->size * sizeof(Tcl_Obj *));
+    dqPtr->first = 0;
+    dqPtr->count = objc;
+    for (i = 0; i < objc; i++) {
+	dqPtr->elems[i] = objv[i];
+	Tcl_IncrRefCount(objv[i]);
+    }
+
+    Tcl_DecrRefCount(svObj->tclObj);
+    svObj->tclObj = Tcl_NewObj();
+    Tcl_IncrRefCount(svObj->tclObj);
+    svObj->repTypePtr = &dequeRepType;
+    svObj->repPtr = dqPtr;
+
+    return dqPtr;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * DequePush, DequePop --
+ *
+ *      Add an element at, and remove one from, either end of the ring.
+ *      The ring grows as needed. The reference to the element is
+ *      handed over from the caller to the ring and back.
+ *
+ * Results:
+ *      DequePop returns the element, the ring must not be empty.
+ *
+ * Side effects:
+ *      Memory may be allocated.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+DequePush(
+    Deque *dqPtr,
+    Tcl_Obj *objPtr,
+    int atHead
+) {
+    Tcl_Obj **elems;
+    Tcl_Size i;
+
+    if (dqPtr->count == dqPtr->size) {
+	elems = (Tcl_Obj **)Tcl_Alloc(2 * dqPtr->size * sizeof(Tcl_Obj *));
+	for (i = 0; i < dqPtr->count; i++) {
+	    elems[i] = DEQUE_SLOT(dqPtr, i);
+	}
+	Tcl_Free(dqPtr->elems);
+	dqPtr->elems = elems;
+	dqPtr->first = 0;
+	dqPtr->size *= 2;
+    }
+    if (atHead) {
+	dqPtr->first = (dqPtr->first - 1) & (dqPtr->size - 1);
+	dqPtr->elems[dqPtr->first] = objPtr;
+    } else {
+	DEQUE_SLOT(dqPtr, dqPtr->count) = objPtr;
+    }
+    dqPtr->count++;
+    Tcl_IncrRefCount(objPtr);
+}
+
+static Tcl_Obj *
+DequePop(
+    Deque *dqPtr,
+    int atHead
+) {
+    Tcl_Obj *objPtr;
+
+    if (atHead) {
+	objPtr = dqPtr->elems[dqPtr->first];
+	dqPtr->first = (dqPtr->first + 1) & (dqPtr->size - 1);
+    } else {
+	objPtr = DEQUE_SLOT(dqPtr, dqPtr->count - 1);
+    }
+    dqPtr->count--;
+
+    return objPtr;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * DequeUpdateProc, DequeFreeProc, DequeValueProc, DequeSizeProc --
+ *
+ *      Procedures of the deque representation.
+ *
+ * Results:
+ *      DequeValueProc returns a new list with copies of the elements.
+ *      DequeSizeProc returns the estimated size of the ring.
+ *
+ * Side effects:
+ *      DequeUpdateProc stores the elements in the Tcl object of the
+ *      container. DequeFreeProc frees the ring.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+DequeUpdateProc(
+    Container *svObj
+) {
+    Deque *dqPtr = (Deque *)svObj->repPtr;
+    Tcl_Obj *listObj = Tcl_NewListObj(0, NULL);
+    Tcl_Size i;
+
+    for (i = 0; i < dqPtr->count; i++) {
+	Tcl_ListObjAppendElement(NULL, listObj, DEQUE_SLOT(dqPtr, i));
+    }
+    Tcl_DecrRefCount(svObj->tclObj);
+    svObj->tclObj = listObj;
+    Tcl_IncrRefCount(svObj->tclObj);
+}
+
+static void
+DequeFreeProc(
+    Container *svObj
+) {
+    Deque *dqPtr = (Deque *)svObj->repPtr;
+    Tcl_Size i;
+
+    for (i = 0; i < dqPtr->count; i++) {
+	Tcl_DecrRefCount(DEQUE_SLOT(dqPtr, i));
+    }
+    Tcl_Free(dqPtr->elems);
+    Tcl_Free(dqPtr);
+}
+
+static Tcl_Obj *
+DequeValueProc(
+    Container *svObj
+) {
+    Deque *dqPtr = (Deque *)svObj->repPtr;
+    Tcl_Obj *listObj = Tcl_NewListObj(0, NULL);
+    Tcl_Size i;
+
+    for (i = 0; i < dqPtr->count; i++) {
+	Tcl_ListObjAppendElement(NULL, listObj,
+		Sv_DuplicateObj(DEQUE_SLOT(dqPtr, i)));
+    }
+
+    return listObj;
+}
+
+static Tcl_Size
+DequeSizeProc(
+    Container *svObj
+) {
+    Deque *dqPtr = (Deque *)svObj->repPtr;
+
+    return sizeof(Deque) + dqPtr->size * sizeof(Tcl_Obj *)
+	    + dqPtr->count * sizeof(Tcl_Obj);
+}
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -897,9 +1270,9 @@ SvLsetObjCmd(
  *      None.
  *
  * Side effects;
- *      This is not a very efficient implementation, but that's all what's
- *      available to Tcl API programmer. We could include the tclInt.h and
- *      get the copy more efficient using list internals, but ...
+ *      The elements are fetched all at once with Tcl_ListObjGetElements,
+ *      which does not modify the source list, so this is safe to call
+ *      for shared lists read by many threads at the same time.
  *
  *-----------------------------------------------------------------------------
  */
@@ -910,15 +1283,14 @@ DupListObjShared(
     Tcl_Obj *copyPtr           /* Object with internal rep to set. */
 ) {
     Tcl_Size i, llen;
-    Tcl_Obj *elObj, **newObjList;
+    Tcl_Obj **elObjs, **newObjList;
     Tcl_Obj *buf[16];
 
-    Tcl_ListObjLength(NULL, srcPtr, &llen);
+    Tcl_ListObjGetElements(NULL, srcPtr, &llen, &elObjs);
     newObjList = (llen > 16) ? (Tcl_Obj**)Tcl_Alloc(llen*sizeof(Tcl_Obj *)) : &buf[0];
 
     for (i = 0; i < llen; i++) {
-	Tcl_ListObjIndex(NULL, srcPtr, i, &elObj);
-	newObjList[i] = Sv_DuplicateObj(elObj);
+	newObjList[i] = Sv_DuplicateObj(elObjs[i]);
     }
 
     Tcl_SetListObj(copyPtr, llen, newObjList);
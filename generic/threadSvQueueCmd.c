@@ -0,0 +1,782 @@
+/*
+ * threadSvQueueCmd.c --
+ *
+ * This file implements bounded message queues shared between threads
+ * as part of the thread shared variable implementation.
+ *
+ * Each queue is a ring of cells, each with its own sequence number,
+ * which producers and consumers claim by advancing a head and a tail
+ * position with compare-and-swap. No lock is taken to enqueue or
+ * dequeue a value, so neither the bucket locks of shared arrays nor
+ * other queues get in the way. The algorithm is the bounded MPMC
+ * queue of Dmitry Vyukov.
+ *
+ * See the file "license.txt" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * ---------------------------------------------------------------------------
+ */
+
+#include "tclThreadInt.h"
+#include "threadSvCmd.h"
+#include "threadSvQueueCmd.h"
+
+/*
+ * One slot of the ring. The sequence number tells whether the cell
+ * is free for the producer at position seq, or holds the value for
+ * the consumer at position seq - 1.
+ */
+
+typedef struct QueueCell {
+    Tcl_WideInt seq;           /* Sequence number of the cell */
+    Tcl_Obj *objPtr;           /* Value, owned by the queue */
+} QueueCell;
+
+/*
+ * The queue. Head and tail are written by producers and consumers
+ * respectively and live in cache lines of their own.
+ */
+
+typedef struct Queue {
+    Tcl_WideInt head;          /* Next position to enqueue at */
+    char pad1[CACHELINE_SIZE - sizeof(Tcl_WideInt)];
+    Tcl_WideInt tail;          /* Next position to dequeue from */
+    char pad2[CACHELINE_SIZE - sizeof(Tcl_WideInt)];
+    Tcl_WideInt mask;          /* Number of cells - 1 */
+    Tcl_WideInt refCount;      /* Registry, name objects and waiters */
+    Tcl_WideInt deleted;       /* Set once removed from the registry */
+    Tcl_WideInt numWaiters;    /* Threads blocked in QueueWait */
+    Tcl_WideInt gen;           /* Bumped on changes seen by waiters */
+    Tcl_Mutex lock;            /* Protects gen, for the condition */
+    Tcl_Condition cond;        /* Signalled when gen changes */
+    void *memPtr;              /* Allocated memory, for alignment */
+    QueueCell cells[1];        /* The ring, mask + 1 cells */
+} Queue;
+
+#define QUEUE_CAPACITY     1024 /* Default number of cells */
+#define QUEUE_MAX_CAPACITY (1 << 30)
+
+/*
+ * Registry of queues by name. Commands find their queue through the
+ * internal representation of the name object and lock the registry
+ * only the first time a name is used.
+ */
+
+static Tcl_Mutex queueMutex;
+static Tcl_HashTable queueTable;
+static int queueTableInit = 0;
+
+static void FreeQueueInternalRep(Tcl_Obj *);
+static void DupQueueInternalRep(Tcl_Obj *, Tcl_Obj *);
+
+static const Tcl_ObjType queueObjType = {
+    "tsv::queue",              /* name */
+    FreeQueueInternalRep,      /* freeIntRepProc */
+    DupQueueInternalRep,       /* dupIntRepProc */
+    NULL,                      /* updateStringProc */
+    NULL,                      /* setFromAnyProc */
+#if TCL_MAJOR_VERSION >= 9
+    TCL_OBJTYPE_V0
+#endif
+};
+
+static Tcl_ObjCmdProc2 SvQueueObjCmd;
+
+static int GetQueueFromObj(Tcl_Interp *, Tcl_Obj *, Queue **);
+static void ReleaseQueue(Queue *);
+static int QueuePush(Queue *, Tcl_Obj *);
+static Tcl_Obj *QueuePop(Queue *);
+static Tcl_WideInt QueueSize(Queue *);
+static void QueueSignal(Queue *);
+static void QueueWake(Queue *);
+static int QueueWait(Queue *, Tcl_WideInt *, Tcl_WideInt);
+
+/*
+ * This mutex protects a static variable which tracks
+ * registration of commands.
+ */
+
+static Tcl_Mutex initMutex;
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * Sv_RegisterQueueCommands --
+ *
+ *      Register queue commands with shared variable module.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Memory gets allocated
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+Sv_RegisterQueueCommands(void)
+{
+    static int initialized = 0;
+
+    if (initialized == 0) {
+	Tcl_MutexLock(&initMutex);
+	if (initialized == 0) {
+	    Sv_RegisterCommand("queue", SvQueueObjCmd, NULL, 0);
+	    initialized = 1;
+	}
+	Tcl_MutexUnlock(&initMutex);
+    }
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * Sv_FinalizeQueues --
+ *
+ *      Removes all queues from the registry. Called when the last
+ *      thread using shared variables exits.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Queues not referenced elsewhere are freed with their values.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+Sv_FinalizeQueues(void)
+{
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+    Queue *queuePtr;
+
+    Tcl_MutexLock(&queueMutex);
+    if (queueTableInit) {
+	for (hPtr = Tcl_FirstHashEntry(&queueTable, &search); hPtr;
+		hPtr = Tcl_NextHashEntry(&search)) {
+	    queuePtr = (Queue *)Tcl_GetHashValue(hPtr);
+	    SvAtomicStore(&queuePtr->deleted, 1);
+	    ReleaseQueue(queuePtr);
+	}
+	Tcl_DeleteHashTable(&queueTable);
+	queueTableInit = 0;
+    }
+    Tcl_MutexUnlock(&queueMutex);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvQueueObjCmd --
+ *
+ *      This procedure is invoked to process the "tsv::queue" command.
+ *      See the user documentation for details on what it does.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      See the user documentation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SvQueueObjCmd(
+	      TCL_UNUSED(void *),
+	      Tcl_Interp *interp,             /* Current interpreter. */
+	      Tcl_Size objc,                  /* Number of arguments. */
+	      Tcl_Obj *const objv[])          /* Argument objects. */
+{
+    int ret = TCL_OK, index, isNew, waiting = 0;
+    Tcl_Size i;
+    Tcl_WideInt capacity, count, deadline = 0, gen = 0;
+    Tcl_Obj *objPtr, *resObj, *args[SV_MAXARGS];
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+    Queue *queuePtr = NULL;
+    const char *name, *pattern;
+    void *memPtr;
+
+    static const char *const opts[] = {
+	"create", "delete", "enqueue", "dequeue", "drain", "size",
+	"names", NULL
+    };
+    enum options {
+	QCREATE, QDELETE, QENQUEUE, QDEQUEUE, QDRAIN, QSIZE,
+	QNAMES
+    };
+
+    /*
+     * Syntax:
+     *          tsv::queue create name ?-capacity n?
+     *          tsv::queue delete name
+     *          tsv::queue enqueue ?-wait? ?-timeout ms? name value
+     *          tsv::queue dequeue ?-wait? ?-timeout ms? name ?var?
+     *          tsv::queue drain name ?max?
+     *          tsv::queue size name
+     *          tsv::queue names ?pattern?
+     */
+
+    if (objc < 2) {
+	Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObjStruct(interp, objv[1], opts, sizeof(char *),
+	    "option", 0, &index) != TCL_OK) {
+	return TCL_ERROR;
+    }
+
+    switch ((enum options)index) {
+    case QCREATE:
+	if (objc != 3 && objc != 5) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "name ?-capacity n?");
+	    return TCL_ERROR;
+	}
+	capacity = QUEUE_CAPACITY;
+	if (objc == 5) {
+	    if (strcmp(Tcl_GetString(objv[3]), "-capacity")) {
+		Tcl_AppendResult(interp, "bad option \"",
+			Tcl_GetString(objv[3]), "\": must be -capacity",
+			(void *)NULL);
+		return TCL_ERROR;
+	    }
+	    if (Tcl_GetWideIntFromObj(interp, objv[4], &capacity) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if (capacity < 1 || capacity > QUEUE_MAX_CAPACITY) {
+		Tcl_SetObjResult(interp, Tcl_NewStringObj(
+			"capacity out of range", TCL_INDEX_NONE));
+		return TCL_ERROR;
+	    }
+	}
+
+	/*
+	 * The ring is indexed with a mask, so
+	 * round up to the next power of two.
+	 */
+
+	for (count = 1; count < capacity; count <<= 1) {
+	    continue;
+	}
+	memPtr = Tcl_Alloc(sizeof(Queue) + (count - 1) * sizeof(QueueCell)
+		+ CACHELINE_SIZE);
+	queuePtr = (Queue *)(((size_t)memPtr + CACHELINE_SIZE - 1)
+		& ~(size_t)(CACHELINE_SIZE - 1));
+	memset(queuePtr, 0, sizeof(Queue));
+	queuePtr->memPtr   = memPtr;
+	queuePtr->mask     = count - 1;
+	queuePtr->refCount = 1;
+	for (i = 0; i < count; i++) {
+	    queuePtr->cells[i].seq = i;
+	    queuePtr->cells[i].objPtr = NULL;
+	}
+
+	name = Tcl_GetString(objv[2]);
+	Tcl_MutexLock(&queueMutex);
+	if (!queueTableInit) {
+	    Tcl_InitHashTable(&queueTable, TCL_STRING_KEYS);
+	    queueTableInit = 1;
+	}
+	hPtr = Tcl_CreateHashEntry(&queueTable, name, &isNew);
+	if (isNew) {
+	    Tcl_SetHashValue(hPtr, queuePtr);
+	}
+	Tcl_MutexUnlock(&queueMutex);
+	if (!isNew) {
+	    Tcl_Free(memPtr);
+	    Tcl_AppendResult(interp, "queue \"", name, "\" already exists",
+		    (void *)NULL);
+	    return TCL_ERROR;
+	}
+	Tcl_SetObjResult(interp, objv[2]);
+	return TCL_OK;
+
+    case QDELETE:
+	if (objc != 3) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "name");
+	    return TCL_ERROR;
+	}
+	name = Tcl_GetString(objv[2]);
+	Tcl_MutexLock(&queueMutex);
+	hPtr = queueTableInit ? Tcl_FindHashEntry(&queueTable, name) : NULL;
+	if (hPtr) {
+	    queuePtr = (Queue *)Tcl_GetHashValue(hPtr);
+	    Tcl_DeleteHashEntry(hPtr);
+	    SvAtomicStore(&queuePtr->deleted, 1);
+	}
+	Tcl_MutexUnlock(&queueMutex);
+	if (queuePtr == NULL) {
+	    Tcl_AppendResult(interp, "no such queue \"", name, "\"",
+		    (void *)NULL);
+	    return TCL_ERROR;
+	}
+	QueueWake(queuePtr);
+	ReleaseQueue(queuePtr);
+	return TCL_OK;
+
+    case QENQUEUE:
+    case QDEQUEUE:
+	if (Sv_WaitOptions(interp, &objc, &objv, 2, args,
+		&deadline) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if (index == QENQUEUE && objc != 4) {
+	    Tcl_WrongNumArgs(interp, 2, objv,
+		    "?-wait? ?-timeout ms? name value");
+	    return TCL_ERROR;
+	}
+	if (index == QDEQUEUE && objc != 3 && objc != 4) {
+	    Tcl_WrongNumArgs(interp, 2, objv,
+		    "?-wait? ?-timeout ms? name ?var?");
+	    return TCL_ERROR;
+	}
+	if (GetQueueFromObj(interp, objv[2], &queuePtr) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	objPtr = NULL;
+	if (index == QENQUEUE) {
+	    objPtr = Sv_DuplicateObj(objv[3]);
+	    Tcl_IncrRefCount(objPtr);
+	}
+
+	while (1) {
+	    if (index == QENQUEUE) {
+		if (QueuePush(queuePtr, objPtr)) {
+		    objPtr = NULL;
+		    break;
+		}
+	    } else if ((objPtr = QueuePop(queuePtr)) != NULL) {
+		break;
+	    }
+	    if (!deadline) {
+		break;
+	    }
+	    if (!waiting) {
+
+		/*
+		 * Register as waiter and try once more, so that a change
+		 * made before the registration is not missed.
+		 */
+
+		SvAtomicAddSync(&queuePtr->refCount, 1);
+		SvAtomicAddSync(&queuePtr->numWaiters, 1);
+		Tcl_MutexLock(&queuePtr->lock);
+		gen = queuePtr->gen;
+		Tcl_MutexUnlock(&queuePtr->lock);
+		waiting = 1;
+		continue;
+	    }
+	    if (SvAtomicGet(&queuePtr->deleted)) {
+		Tcl_AppendResult(interp, "queue \"", Tcl_GetString(objv[2]),
+			"\" has been deleted", (void *)NULL);
+		ret = TCL_ERROR;
+		break;
+	    }
+	    if (!QueueWait(queuePtr, &gen, deadline)) {
+		break;
+	    }
+	}
+
+	if (index == QENQUEUE) {
+	    if (objPtr) {
+		Tcl_DecrRefCount(objPtr); /* Queue full */
+	    } else {
+		QueueSignal(queuePtr);
+	    }
+	    if (ret == TCL_OK) {
+		Tcl_SetObjResult(interp, Tcl_NewIntObj(objPtr == NULL));
+	    }
+	} else if (objPtr) {
+	    QueueSignal(queuePtr);
+	    if (objc == 3) {
+		Tcl_SetObjResult(interp, objPtr);
+	    } else if (Tcl_ObjSetVar2(interp, objv[3], NULL, objPtr,
+		    TCL_LEAVE_ERR_MSG) == NULL) {
+		ret = TCL_ERROR;
+	    } else {
+		Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
+	    }
+	    Tcl_DecrRefCount(objPtr);
+	} else if (ret == TCL_OK) {
+	    if (objc == 3) {
+		Tcl_AppendResult(interp, "queue \"", Tcl_GetString(objv[2]),
+			"\" is empty", (void *)NULL);
+		ret = TCL_ERROR;
+	    } else {
+		Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+	    }
+	}
+
+	if (waiting) {
+	    SvAtomicAddSync(&queuePtr->numWaiters, -1);
+	    ReleaseQueue(queuePtr);
+	}
+	return ret;
+
+    case QDRAIN:
+	if (objc != 3 && objc != 4) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "name ?max?");
+	    return TCL_ERROR;
+	}
+	count = -1;
+	if (objc == 4 && Tcl_GetWideIntFromObj(interp, objv[3],
+		&count) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if (GetQueueFromObj(interp, objv[2], &queuePtr) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	resObj = Tcl_NewListObj(0, NULL);
+	while (count-- != 0 && (objPtr = QueuePop(queuePtr)) != NULL) {
+	    Tcl_ListObjAppendElement(NULL, resObj, objPtr);
+	    Tcl_DecrRefCount(objPtr);
+	}
+	QueueSignal(queuePtr);
+	Tcl_SetObjResult(interp, resObj);
+	return TCL_OK;
+
+    case QSIZE:
+	if (objc != 3) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "name");
+	    return TCL_ERROR;
+	}
+	if (GetQueueFromObj(interp, objv[2], &queuePtr) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	Tcl_SetObjResult(interp, Tcl_NewWideIntObj(QueueSize(queuePtr)));
+	return TCL_OK;
+
+    case QNAMES:
+	if (objc > 3) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "?pattern?");
+	    return TCL_ERROR;
+	}
+	pattern = (objc == 3) ? Tcl_GetString(objv[2]) : NULL;
+	resObj = Tcl_NewListObj(0, NULL);
+	Tcl_MutexLock(&queueMutex);
+	if (queueTableInit) {
+	    for (hPtr = Tcl_FirstHashEntry(&queueTable, &search); hPtr;
+		    hPtr = Tcl_NextHashEntry(&search)) {
+		name = (char *)Tcl_GetHashKey(&queueTable, hPtr);
+		if (pattern == NULL || Tcl_StringCaseMatch(name, pattern, 0)) {
+		    Tcl_ListObjAppendElement(NULL, resObj,
+			    Tcl_NewStringObj(name, TCL_INDEX_NONE));
+		}
+	    }
+	}
+	Tcl_MutexUnlock(&queueMutex);
+	Tcl_SetObjResult(interp, resObj);
+	return TCL_OK;
+    }
+
+    return TCL_ERROR; /* Should never be reached */
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * GetQueueFromObj --
+ *
+ *      Finds the queue named by the object. The queue is remembered in
+ *      the internal representation of the object, which holds a
+ *      reference to it, so later lookups need not lock the registry.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      The object may be converted to a queue name.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+GetQueueFromObj(
+		Tcl_Interp *interp,           /* Current interpreter. */
+		Tcl_Obj *objPtr,              /* Name of the queue */
+		Queue **queuePtrPtr)          /* OUT: the queue */
+{
+    const char *name;
+    Tcl_HashEntry *hPtr;
+    Queue *queuePtr;
+
+    if (objPtr->typePtr == &queueObjType) {
+	queuePtr = (Queue *)objPtr->internalRep.twoPtrValue.ptr1;
+	if (!SvAtomicGet(&queuePtr->deleted)) {
+	    *queuePtrPtr = queuePtr;
+	    return TCL_OK;
+	}
+    }
+
+    name = Tcl_GetString(objPtr);
+    Tcl_MutexLock(&queueMutex);
+    hPtr = queueTableInit ? Tcl_FindHashEntry(&queueTable, name) : NULL;
+    if (hPtr == NULL) {
+	Tcl_MutexUnlock(&queueMutex);
+	Tcl_AppendResult(interp, "no such queue \"", name, "\"", (void *)NULL);
+	return TCL_ERROR;
+    }
+    queuePtr = (Queue *)Tcl_GetHashValue(hPtr);
+    SvAtomicAddSync(&queuePtr->refCount, 1);
+    Tcl_MutexUnlock(&queueMutex);
+
+    if (objPtr->typePtr != NULL && objPtr->typePtr->freeIntRepProc != NULL) {
+	(*objPtr->typePtr->freeIntRepProc)(objPtr);
+    }
+    objPtr->internalRep.twoPtrValue.ptr1 = queuePtr;
+    objPtr->typePtr = &queueObjType;
+
+    *queuePtrPtr = queuePtr;
+    return TCL_OK;
+}
+
+static void
+FreeQueueInternalRep(
+		     Tcl_Obj *objPtr)
+{
+    ReleaseQueue((Queue *)objPtr->internalRep.twoPtrValue.ptr1);
+    objPtr->typePtr = NULL;
+}
+
+static void
+DupQueueInternalRep(
+		    Tcl_Obj *srcPtr,
+		    Tcl_Obj *copyPtr)
+{
+    Queue *queuePtr = (Queue *)srcPtr->internalRep.twoPtrValue.ptr1;
+
+    SvAtomicAddSync(&queuePtr->refCount, 1);
+    copyPtr->internalRep.twoPtrValue.ptr1 = queuePtr;
+    copyPtr->typePtr = &queueObjType;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * ReleaseQueue --
+ *
+ *      Drops a reference to the queue and frees it, together with
+ *      the values still queued, once the last one is gone.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Memory may be freed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+ReleaseQueue(
+	     Queue *queuePtr)
+{
+    Tcl_Obj *objPtr;
+
+    if (SvAtomicAddSync(&queuePtr->refCount, -1) > 0) {
+	return;
+    }
+    while ((objPtr = QueuePop(queuePtr)) != NULL) {
+	Tcl_DecrRefCount(objPtr);
+    }
+    Tcl_ConditionFinalize(&queuePtr->cond);
+    Tcl_MutexFinalize(&queuePtr->lock);
+    Tcl_Free(queuePtr->memPtr);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * QueuePush, QueuePop --
+ *
+ *      Append a value to the queue and take the oldest one off it.
+ *      The caller claims a position by advancing the head (tail)
+ *      once the cell at that position is free (filled), and then
+ *      hands the cell over by bumping its sequence number.
+ *
+ * Results:
+ *      QueuePush returns 1 if the value was queued, 0 if the queue is
+ *      full. QueuePop returns the value, with the reference held by
+ *      the queue, or NULL if the queue is empty.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+QueuePush(
+	  Queue *queuePtr,
+	  Tcl_Obj *objPtr)
+{
+    QueueCell *cellPtr;
+    Tcl_WideInt pos = SvAtomicGet(&queuePtr->head), diff;
+
+    while (1) {
+	cellPtr = &queuePtr->cells[pos & queuePtr->mask];
+	diff = SvAtomicLoad(&cellPtr->seq) - pos;
+	if (diff == 0) {
+	    if (SvAtomicCas(&queuePtr->head, &pos, pos + 1)) {
+		break;
+	    }
+	} else if (diff < 0) {
+	    return 0;
+	} else {
+	    pos = SvAtomicGet(&queuePtr->head);
+	}
+    }
+
+    cellPtr->objPtr = objPtr;
+    SvAtomicStore(&cellPtr->seq, pos + 1);
+
+    return 1;
+}
+
+static Tcl_Obj *
+QueuePop(
+	 Queue *queuePtr)
+{
+    QueueCell *cellPtr;
+    Tcl_Obj *objPtr;
+    Tcl_WideInt pos = SvAtomicGet(&queuePtr->tail), diff;
+
+    while (1) {
+	cellPtr = &queuePtr->cells[pos & queuePtr->mask];
+	diff = SvAtomicLoad(&cellPtr->seq) - (pos + 1);
+	if (diff == 0) {
+	    if (SvAtomicCas(&queuePtr->tail, &pos, pos + 1)) {
+		break;
+	    }
+	} else if (diff < 0) {
+	    return NULL;
+	} else {
+	    pos = SvAtomicGet(&queuePtr->tail);
+	}
+    }
+
+    objPtr = cellPtr->objPtr;
+    cellPtr->objPtr = NULL;
+    SvAtomicStore(&cellPtr->seq, pos + queuePtr->mask + 1);
+
+    return objPtr;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * QueueSize --
+ *
+ *      Computes the number of values in the queue. With concurrent
+ *      producers and consumers, this is only a snapshot.
+ *
+ * Results:
+ *      Number of values queued.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Tcl_WideInt
+QueueSize(
+	  Queue *queuePtr)
+{
+    Tcl_WideInt tail = SvAtomicLoad(&queuePtr->tail);
+    Tcl_WideInt size = SvAtomicLoad(&queuePtr->head) - tail;
+
+    if (size < 0) {
+	return 0;
+    }
+    if (size > queuePtr->mask + 1) {
+	return queuePtr->mask + 1;
+    }
+    return size;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * QueueSignal, QueueWake, QueueWait --
+ *
+ *      Let producers wait for room and consumers for values. Waiters
+ *      register with numWaiters and read the generation before they
+ *      try once more, while those changing the queue look at
+ *      numWaiters after the change. The full fence in between makes
+ *      sure that one of them sees the other, so no wakeup gets lost.
+ *      Without waiters, a change costs the fence and nothing more.
+ *
+ * Results:
+ *      QueueWait returns 1 if the queue has changed, 0 if the deadline
+ *      passed first.
+ *
+ * Side effects:
+ *      The calling thread may block, waiting threads are woken up.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+QueueSignal(
+	    Queue *queuePtr)
+{
+    SvAtomicFence();
+    if (SvAtomicGet(&queuePtr->numWaiters)) {
+	QueueWake(queuePtr);
+    }
+}
+
+static void
+QueueWake(
+	  Queue *queuePtr)
+{
+    Tcl_MutexLock(&queuePtr->lock);
+    queuePtr->gen++;
+    Tcl_ConditionNotify(&queuePtr->cond);
+    Tcl_MutexUnlock(&queuePtr->lock);
+}
+
+static int
+QueueWait(
+	  Queue *queuePtr,
+	  Tcl_WideInt *genPtr,                /* IN/OUT: generation seen */
+	  Tcl_WideInt deadline)               /* End of the wait or -1 */
+{
+    Tcl_WideInt left;
+    Tcl_Time now, timeout;
+    int changed = 1;
+
+    Tcl_MutexLock(&queuePtr->lock);
+    while (queuePtr->gen == *genPtr) {
+	if (deadline < 0) {
+	    Tcl_ConditionWait(&queuePtr->cond, &queuePtr->lock, NULL);
+	    continue;
+	}
+	Tcl_GetTime(&now);
+	left = deadline - ((Tcl_WideInt)now.sec * 1000 + now.usec / 1000);
+	if (left <= 0) {
+	    changed = 0;
+	    break;
+	}
+	timeout.sec  = (long)(left / 1000);
+	timeout.usec = (long)(left % 1000) * 1000;
+	Tcl_ConditionWait(&queuePtr->cond, &queuePtr->lock, &timeout);
+    }
+    *genPtr = queuePtr->gen;
+    Tcl_MutexUnlock(&queuePtr->lock);
+
+    return changed;
+}
+
+/* EOF $RCSfile: threadSvQueueCmd.c,v $ */
+
+/* Emacs Setup Variables */
+/* Local Variables:      */
+/* mode: C               */
+/* indent-tabs-mode: nil */
+/* c-basic-offset: 4     */
+/* End:                  */
@@ -0,0 +1,26 @@
+/*
+ * threadSvQueueCmd.h --
+ *
+ * See the file "license.txt" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * ---------------------------------------------------------------------------
+ */
+
+#ifndef _SV_QUEUE_H_
+#define _SV_QUEUE_H_
+
+#include "tclThreadInt.h"
+
+MODULE_SCOPE void Sv_RegisterQueueCommands(void);
+MODULE_SCOPE void Sv_FinalizeQueues(void);
+
+#endif /* _SV_QUEUE_H_ */
+
+/* EOF $RCSfile: threadSvQueueCmd.h,v $ */
+
+/* Emacs Setup Variables */
+/* Local Variables:      */
+/* mode: C               */
+/* indent-tabs-mode: nil */
+/* c-basic-offset: 4     */
+/* End:                  */
@@ -0,0 +1,608 @@
+/*
+ * threadSvSetCmd.c --
+ *
+ * Implementation of set commands for thread shared variables.
+ *
+ * A shared variable used as a set keeps its members in a hash table,
+ * as an alternative representation of the container, so that adding,
+ * removing and looking up a member takes constant time. Other commands
+ * see the set as a list of its members, in no particular order.
+ *
+ * See the file "license.txt" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * ---------------------------------------------------------------------------
+ */
+
+#include "tclThreadInt.h"
+#include "threadSvCmd.h"
+#include "threadSvSetCmd.h"
+
+static Tcl_ObjCmdProc2 SvSaddObjCmd;      /* sadd        */
+static Tcl_ObjCmdProc2 SvSremObjCmd;      /* srem        */
+static Tcl_ObjCmdProc2 SvSismemberObjCmd; /* sismember   */
+static Tcl_ObjCmdProc2 SvScardObjCmd;     /* scard       */
+static Tcl_ObjCmdProc2 SvSmembersObjCmd;  /* smembers    */
+
+/*
+ * The set representation.
+ */
+
+typedef struct SvSet {
+    Tcl_HashTable members;     /* Members, as string keys */
+    Tcl_Size bytes;            /* Length of all members */
+} SvSet;
+
+static void SetUpdateProc(Container*);
+static void SetFreeProc(Container*);
+static Tcl_Obj* SetValueProc(Container*);
+static Tcl_Size SetSizeProc(Container*);
+
+static const SvRepType setRepType = {
+    "set",
+    SetUpdateProc,
+    SetFreeProc,
+    SetValueProc,
+    SetSizeProc
+};
+
+static SvSet *GetSet(Tcl_Interp*, Container*);
+static int PutSet(Tcl_Interp*, Container*, int);
+
+/*
+ * This mutex protects a static variable which tracks
+ * registration of commands.
+ */
+
+static Tcl_Mutex initMutex;
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * Sv_RegisterSetCommands --
+ *
+ *      Register set commands with shared variable module.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Memory gets allocated
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+Sv_RegisterSetCommands(void)
+{
+    static int initialized = 0;
+
+    if (initialized == 0) {
+	Tcl_MutexLock(&initMutex);
+	if (initialized == 0) {
+	    Sv_RegisterCommand("sadd",      SvSaddObjCmd,      NULL, 0);
+	    Sv_RegisterCommand("srem",      SvSremObjCmd,      NULL, 0);
+	    Sv_RegisterCommand("sismember", SvSismemberObjCmd, NULL, 0);
+	    Sv_RegisterCommand("scard",     SvScardObjCmd,     NULL, 0);
+	    Sv_RegisterCommand("smembers",  SvSmembersObjCmd,  NULL, 0);
+	    initialized = 1;
+	}
+	Tcl_MutexUnlock(&initMutex);
+    }
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvSaddObjCmd --
+ *
+ *      This procedure is invoked to process the "tsv::sadd" command.
+ *      See the user documentation for details on what it does.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      See the user documentation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SvSaddObjCmd(
+    void *arg,
+    Tcl_Interp *interp,
+    Tcl_Size objc,
+    Tcl_Obj *const objv[]
+) {
+    int ret, flg, isNew;
+    Tcl_Size i, off, len, added = 0;
+    const char *member;
+    SvSet *setPtr;
+    Container *svObj = (Container*)arg;
+
+    /*
+     * Syntax:
+     *          tsv::sadd array key member ?member ...?
+     *          $set sadd member ?member ...?
+     */
+
+    flg = FLAGS_CREATEARRAY | FLAGS_CREATEVAR | FLAGS_KEEPREP;
+    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, flg);
+    if (ret != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (objc < 1 + off) {
+	Tcl_WrongNumArgs(interp, off, objv, "member ?member ...?");
+	goto cmd_err;
+    }
+    setPtr = GetSet(interp, svObj);
+    if (setPtr == NULL) {
+	goto cmd_err;
+    }
+    for (i = off; i < objc; i++) {
+	member = Tcl_GetStringFromObj(objv[i], &len);
+	Tcl_CreateHashEntry(&setPtr->members, member, &isNew);
+	if (isNew) {
+	    setPtr->bytes += len;
+	    added++;
+	}
+    }
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(added));
+
+    return PutSet(interp, svObj, added ? SV_CHANGED : SV_UNCHANGED);
+
+ cmd_err:
+    return Sv_PutContainer(interp, svObj, SV_ERROR);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvSremObjCmd --
+ *
+ *      This procedure is invoked to process the "tsv::srem" command.
+ *      See the user documentation for details on what it does.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      See the user documentation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SvSremObjCmd(
+    void *arg,
+    Tcl_Interp *interp,
+    Tcl_Size objc,
+    Tcl_Obj *const objv[]
+) {
+    int ret;
+    Tcl_Size i, off, len, removed = 0;
+    const char *member;
+    Tcl_HashEntry *hPtr;
+    SvSet *setPtr;
+    Container *svObj = (Container*)arg;
+
+    /*
+     * Syntax:
+     *          tsv::srem array key member ?member ...?
+     *          $set srem member ?member ...?
+     */
+
+    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, FLAGS_KEEPREP);
+    if (ret == TCL_BREAK) {
+	Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+	return TCL_OK;
+    } else if (ret != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (objc < 1 + off) {
+	Tcl_WrongNumArgs(interp, off, objv, "member ?member ...?");
+	goto cmd_err;
+    }
+    setPtr = GetSet(interp, svObj);
+    if (setPtr == NULL) {
+	goto cmd_err;
+    }
+    for (i = off; i < objc; i++) {
+	member = Tcl_GetStringFromObj(objv[i], &len);
+	hPtr = Tcl_FindHashEntry(&setPtr->members, member);
+	if (hPtr) {
+	    Tcl_DeleteHashEntry(hPtr);
+	    setPtr->bytes -= len;
+	    removed++;
+	}
+    }
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(removed));
+
+    return PutSet(interp, svObj, removed ? SV_CHANGED : SV_UNCHANGED);
+
+ cmd_err:
+    return Sv_PutContainer(interp, svObj, SV_ERROR);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvSismemberObjCmd --
+ *
+ *      This procedure is invoked to process the "tsv::sismember" command.
+ *      See the user documentation for details on what it does.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      See the user documentation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SvSismemberObjCmd(
+    void *arg,
+    Tcl_Interp *interp,
+    Tcl_Size objc,
+    Tcl_Obj *const objv[]
+) {
+    int ret, flags = FLAGS_READONLY|FLAGS_KEEPREP;
+    Tcl_Size off;
+    SvSet *setPtr;
+    Container *svObj;
+
+    /*
+     * Syntax:
+     *          tsv::sismember array key member
+     *          $set sismember member
+     */
+
+    while (1) {
+	svObj = (Container*)arg;
+	ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, flags);
+	if (ret == TCL_BREAK) {
+	    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+	    return TCL_OK;
+	} else if (ret != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if (objc != 1 + off) {
+	    Tcl_WrongNumArgs(interp, off, objv, "member");
+	    goto cmd_err;
+	}
+	if (svObj->repTypePtr == &setRepType || !(flags & FLAGS_READONLY)) {
+	    break;
+	}
+
+	/*
+	 * The value is not a set yet. Make it one
+	 * holding the exclusive lock.
+	 */
+
+	Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+	flags = FLAGS_KEEPREP;
+    }
+    setPtr = GetSet(interp, svObj);
+    if (setPtr == NULL) {
+	goto cmd_err;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(
+	    Tcl_FindHashEntry(&setPtr->members, Tcl_GetString(objv[off])) != NULL));
+
+    return Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+
+ cmd_err:
+    return Sv_PutContainer(interp, svObj, SV_ERROR);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvScardObjCmd --
+ *
+ *      This procedure is invoked to process the "tsv::scard" command.
+ *      See the user documentation for details on what it does.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      See the user documentation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SvScardObjCmd(
+    void *arg,
+    Tcl_Interp *interp,
+    Tcl_Size objc,
+    Tcl_Obj *const objv[]
+) {
+    int ret;
+    Tcl_Size off, llen;
+    Container *svObj = (Container*)arg;
+
+    /*
+     * Syntax:
+     *          tsv::scard array key
+     *          $set scard
+     */
+
+    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off,
+	    FLAGS_READONLY|FLAGS_KEEPREP);
+    if (ret == TCL_BREAK) {
+	Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+	return TCL_OK;
+    } else if (ret != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (objc != off) {
+	Tcl_WrongNumArgs(interp, off, objv, NULL);
+	goto cmd_err;
+    }
+    if (svObj->repTypePtr == &setRepType) {
+	llen = ((SvSet *)svObj->repPtr)->members.numEntries;
+    } else {
+
+	/*
+	 * Counting the distinct members of a list would need a set.
+	 * Leave that to the writers; the value must not be changed.
+	 */
+
+	Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+	svObj = (Container*)arg;
+	ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, FLAGS_KEEPREP);
+	if (ret == TCL_BREAK) {
+	    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+	    return TCL_OK;
+	} else if (ret != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if (GetSet(interp, svObj) == NULL) {
+	    goto cmd_err;
+	}
+	llen = ((SvSet *)svObj->repPtr)->members.numEntries;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(llen));
+
+    return Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+
+ cmd_err:
+    return Sv_PutContainer(interp, svObj, SV_ERROR);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvSmembersObjCmd --
+ *
+ *      This procedure is invoked to process the "tsv::smembers" command.
+ *      See the user documentation for details on what it does.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      See the user documentation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SvSmembersObjCmd(
+    void *arg,
+    Tcl_Interp *interp,
+    Tcl_Size objc,
+    Tcl_Obj *const objv[]
+) {
+    int ret, flags = FLAGS_READONLY|FLAGS_KEEPREP;
+    Tcl_Size off;
+    SvSet *setPtr;
+    Container *svObj;
+
+    /*
+     * Syntax:
+     *          tsv::smembers array key
+     *          $set smembers
+     */
+
+    while (1) {
+	svObj = (Container*)arg;
+	ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, flags);
+	if (ret == TCL_BREAK) {
+	    Tcl_ResetResult(interp);
+	    return TCL_OK;
+	} else if (ret != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if (objc != off) {
+	    Tcl_WrongNumArgs(interp, off, objv, NULL);
+	    goto cmd_err;
+	}
+	if (svObj->repTypePtr == &setRepType || !(flags & FLAGS_READONLY)) {
+	    break;
+	}
+	Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+	flags = FLAGS_KEEPREP;
+    }
+    setPtr = GetSet(interp, svObj);
+    if (setPtr == NULL) {
+	goto cmd_err;
+    }
+    Tcl_SetObjResult(interp, SetValueProc(svObj));
+
+    return Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+
+ cmd_err:
+    return Sv_PutContainer(interp, svObj, SV_ERROR);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * GetSet --
+ *
+ *      Returns the set held in the container, turning the value into
+ *      a set first if needed. Any value which is a list can be turned
+ *      into a set of its elements. The container must be locked for
+ *      writing, unless it already is a set.
+ *
+ * Results:
+ *      The set, or NULL if the value is no list.
+ *
+ * Side effects:
+ *      The container may get the set representation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static SvSet *
+GetSet(
+    Tcl_Interp *interp,
+    Container *svObj
+) {
+    Tcl_Size i, objc, len;
+    Tcl_Obj **objv;
+    const char *member;
+    SvSet *setPtr;
+    int isNew;
+
+    if (svObj->repTypePtr == &setRepType) {
+	return (SvSet *)svObj->repPtr;
+    }
+    Sv_UpdateContainer(svObj);
+    if (Tcl_ListObjGetElements(interp, svObj->tclObj, &objc,
+	    &objv) != TCL_OK) {
+	return NULL;
+    }
+
+    setPtr = (SvSet *)Tcl_Alloc(sizeof(SvSet));
+    Tcl_InitHashTable(&setPtr->members, TCL_STRING_KEYS);
+    setPtr->bytes = 0;
+    for (i = 0; i < objc; i++) {
+	member = Tcl_GetStringFromObj(objv[i], &len);
+	Tcl_CreateHashEntry(&setPtr->members, member, &isNew);
+	if (isNew) {
+	    setPtr->bytes += len;
+	}
+    }
+
+    Tcl_DecrRefCount(svObj->tclObj);
+    svObj->tclObj = Tcl_NewObj();
+    Tcl_IncrRefCount(svObj->tclObj);
+    svObj->repTypePtr = &setRepType;
+    svObj->repPtr = setPtr;
+
+    return setPtr;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * PutSet --
+ *
+ *      Puts the container holding a set back. Arrays bound to a
+ *      persistent store or evicting keys need the Tcl object of the
+ *      container after every change, the set is converted back to
+ *      a list for them.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      The container is unlocked.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+PutSet(
+    Tcl_Interp *interp,
+    Container *svObj,
+    int mode
+) {
+    if (mode == SV_CHANGED && (svObj->arrayPtr->psPtr
+	    || svObj->arrayPtr->policy != SV_EVICT_NONE)) {
+	Sv_UpdateContainer(svObj);
+    }
+
+    return Sv_PutContainer(interp, svObj, mode);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SetUpdateProc, SetFreeProc, SetValueProc, SetSizeProc --
+ *
+ *      Procedures of the set representation.
+ *
+ * Results:
+ *      SetValueProc returns a new list of the members. SetSizeProc
+ *      returns the estimated size of the hash table.
+ *
+ * Side effects:
+ *      SetUpdateProc stores the members in the Tcl object of the
+ *      container. SetFreeProc frees the hash table.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+SetUpdateProc(
+    Container *svObj
+) {
+    Tcl_DecrRefCount(svObj->tclObj);
+    svObj->tclObj = SetValueProc(svObj);
+    Tcl_IncrRefCount(svObj->tclObj);
+}
+
+static void
+SetFreeProc(
+    Container *svObj
+) {
+    SvSet *setPtr = (SvSet *)svObj->repPtr;
+
+    Tcl_DeleteHashTable(&setPtr->members);
+    Tcl_Free(setPtr);
+}
+
+static Tcl_Obj *
+SetValueProc(
+    Container *svObj
+) {
+    SvSet *setPtr = (SvSet *)svObj->repPtr;
+    Tcl_Obj *listObj = Tcl_NewListObj(0, NULL);
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+
+    for (hPtr = Tcl_FirstHashEntry(&setPtr->members, &search); hPtr;
+	    hPtr = Tcl_NextHashEntry(&search)) {
+	Tcl_ListObjAppendElement(NULL, listObj, Tcl_NewStringObj(
+		(char *)Tcl_GetHashKey(&setPtr->members, hPtr), TCL_INDEX_NONE));
+    }
+
+    return listObj;
+}
+
+static Tcl_Size
+SetSizeProc(
+    Container *svObj
+) {
+    SvSet *setPtr = (SvSet *)svObj->repPtr;
+
+    return sizeof(SvSet) + setPtr->bytes
+	    + setPtr->members.numEntries * sizeof(Tcl_HashEntry)
+	    + setPtr->members.numBuckets * sizeof(Tcl_HashEntry *);
+}
+
+/* EOF $RCSfile: threadSvSetCmd.c,v $ */
+
+/* Emacs Setup Variables */
+/* Local Variables:      */
+/* mode: C               */
+/* indent-tabs-mode: nil */
+/* c-basic-offset: 4     */
+/* End:                  */
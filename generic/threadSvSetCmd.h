@@ -0,0 +1,25 @@
+/*
+ * threadSvSetCmd.h --
+ *
+ * See the file "license.txt" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * ---------------------------------------------------------------------------
+ */
+
+#ifndef _SV_SET_H_
+#define _SV_SET_H_
+
+#include "tclThreadInt.h"
+
+MODULE_SCOPE void Sv_RegisterSetCommands(void);
+
+#endif /* _SV_SET_H_ */
+
+/* EOF $RCSfile: threadSvSetCmd.h,v $ */
+
+/* Emacs Setup Variables */
+/* Local Variables:      */
+/* mode: C               */
+/* indent-tabs-mode: nil */
+/* c-basic-offset: 4     */
+/* End:                  */
@@ -0,0 +1,1033 @@
+/*
+ * threadSvZsetCmd.c --
+ *
+ * Implementation of sorted set commands for thread shared variables.
+ *
+ * A sorted set holds unique members, each with a floating point score,
+ * ordered by score and, for equal scores, by member. The members are
+ * kept in a skiplist, where inserting, removing and finding a member by
+ * score or by rank takes logarithmic time, and in a hash table mapping
+ * each member to its node. The sorted set is an alternative
+ * representation of the container. Other commands see it as a list of
+ * members and scores, in order, which is also a valid dict.
+ *
+ * See the file "license.txt" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * ---------------------------------------------------------------------------
+ */
+
+#include "tclThreadInt.h"
+#include "threadSvCmd.h"
+#include "threadSvZsetCmd.h"
+
+static Tcl_ObjCmdProc2 SvZaddObjCmd;          /* zadd          */
+static Tcl_ObjCmdProc2 SvZpopminObjCmd;       /* zpopmin       */
+static Tcl_ObjCmdProc2 SvZrangeObjCmd;        /* zrange        */
+static Tcl_ObjCmdProc2 SvZrangebyscoreObjCmd; /* zrangebyscore */
+
+/*
+ * Nodes of the skiplist. Each link also counts the nodes it skips,
+ * so the rank of a node can be found on the way down the list.
+ */
+
+#define ZSET_MAXLEVEL 32
+
+typedef struct ZsetNode {
+    double score;              /* Score of the member */
+    Tcl_HashEntry *hPtr;       /* Hash entry of the member */
+    int level;                 /* Number of links */
+    struct ZsetLink {
+	struct ZsetNode *nextPtr;  /* Next node on this level */
+	Tcl_Size span;             /* Distance to the next node */
+    } link[1];                 /* Links, actually "level" of them */
+} ZsetNode;
+
+typedef struct SvZset {
+    Tcl_HashTable members;     /* Members, mapped to their nodes */
+    ZsetNode *headPtr;         /* Head of the skiplist, no member */
+    int level;                 /* Highest level in use */
+    unsigned int seed;         /* State of the level generator */
+    Tcl_Size bytes;            /* Length of all members */
+} SvZset;
+
+#define ZSET_MEMBER(zsPtr, nodePtr) \
+    ((const char *)Tcl_GetHashKey(&(zsPtr)->members, (nodePtr)->hPtr))
+
+static ZsetNode *ZsetNewNode(int, double, Tcl_HashEntry*);
+static int ZsetBefore(SvZset*, ZsetNode*, double, const char*);
+static void ZsetInsert(SvZset*, double, Tcl_HashEntry*);
+static void ZsetDelete(SvZset*, ZsetNode*);
+static ZsetNode *ZsetByRank(SvZset*, Tcl_Size);
+static ZsetNode *ZsetByScore(SvZset*, double);
+static void ZsetAppend(SvZset*, Tcl_Obj*, ZsetNode*, int);
+static int ZsetAdd(SvZset*, double, const char*, Tcl_Size);
+static int ZsetStripDue(Tcl_Size*, Tcl_Obj*const**, Tcl_Size, Tcl_Obj**);
+
+static void ZsetUpdateProc(Container*);
+static void ZsetFreeProc(Container*);
+static Tcl_Obj* ZsetValueProc(Container*);
+static Tcl_Size ZsetSizeProc(Container*);
+
+static const SvRepType zsetRepType = {
+    "zset",
+    ZsetUpdateProc,
+    ZsetFreeProc,
+    ZsetValueProc,
+    ZsetSizeProc
+};
+
+static SvZset *GetZset(Tcl_Interp*, Container*);
+static int GetZsetReadable(Tcl_Interp*, void*, Tcl_Size, Tcl_Obj*const[],
+	Container**, Tcl_Size*);
+static int PutZset(Tcl_Interp*, Container*, int);
+
+/*
+ * This mutex protects a static variable which tracks
+ * registration of commands.
+ */
+
+static Tcl_Mutex initMutex;
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * Sv_RegisterZsetCommands --
+ *
+ *      Register sorted set commands with shared variable module.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Memory gets allocated
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+Sv_RegisterZsetCommands(void)
+{
+    static int initialized = 0;
+
+    if (initialized == 0) {
+	Tcl_MutexLock(&initMutex);
+	if (initialized == 0) {
+	    Sv_RegisterCommand("zadd",          SvZaddObjCmd,          NULL, 0);
+	    Sv_RegisterCommand("zpopmin",       SvZpopminObjCmd,       NULL, 0);
+	    Sv_RegisterCommand("zrange",        SvZrangeObjCmd,        NULL, 0);
+	    Sv_RegisterCommand("zrangebyscore", SvZrangebyscoreObjCmd, NULL, 0);
+	    initialized = 1;
+	}
+	Tcl_MutexUnlock(&initMutex);
+    }
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvZaddObjCmd --
+ *
+ *      This procedure is invoked to process the "tsv::zadd" command.
+ *      See the user documentation for details on what it does.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      See the user documentation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SvZaddObjCmd(
+    void *arg,
+    Tcl_Interp *interp,
+    Tcl_Size objc,
+    Tcl_Obj *const objv[]
+) {
+    int ret, flg, changed = 0;
+    Tcl_Size i, off, len, added = 0;
+    const char *member;
+    double score;
+    SvZset *zsPtr;
+    Container *svObj = (Container*)arg;
+
+    /*
+     * Syntax:
+     *          tsv::zadd array key score member ?score member ...?
+     *          $zset zadd score member ?score member ...?
+     */
+
+    flg = FLAGS_CREATEARRAY | FLAGS_CREATEVAR | FLAGS_KEEPREP;
+    ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, flg);
+    if (ret != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (objc < 2 + off || (objc - off) % 2) {
+	Tcl_WrongNumArgs(interp, off, objv, "score member ?score member ...?");
+	goto cmd_err;
+    }
+    for (i = off; i < objc; i += 2) {
+	if (Tcl_GetDoubleFromObj(interp, objv[i], &score) != TCL_OK) {
+	    goto cmd_err;
+	}
+    }
+    zsPtr = GetZset(interp, svObj);
+    if (zsPtr == NULL) {
+	goto cmd_err;
+    }
+    for (i = off; i < objc; i += 2) {
+	Tcl_GetDoubleFromObj(NULL, objv[i], &score);
+	member = Tcl_GetStringFromObj(objv[i+1], &len);
+	switch (ZsetAdd(zsPtr, score, member, len)) {
+	case 2: added++; /* fallthrough */
+	case 1: changed = 1;
+	}
+    }
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(added));
+
+    return PutZset(interp, svObj, changed ? SV_CHANGED : SV_UNCHANGED);
+
+ cmd_err:
+    return Sv_PutContainer(interp, svObj, SV_ERROR);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvZpopminObjCmd --
+ *
+ *      This procedure is invoked to process the "tsv::zpopmin" command.
+ *      See the user documentation for details on what it does.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      See the user documentation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SvZpopminObjCmd(
+    void *arg,
+    Tcl_Interp *interp,
+    Tcl_Size objc,
+    Tcl_Obj *const objv[]
+) {
+    int ret, due;
+    Tcl_Size off, first = arg ? 2 : 1;
+    Tcl_WideInt i, count = 1, deadline, until;
+    SvWait wait;
+    double now = 0.0;
+    Tcl_Obj *listObj, *args[SV_MAXARGS];
+    Tcl_HashEntry *hPtr;
+    ZsetNode *nodePtr;
+    SvZset *zsPtr = NULL;
+    Container *svObj = (Container*)arg;
+    Tcl_Time time;
+
+    /*
+     * Syntax:
+     *          tsv::zpopmin ?-wait? ?-timeout ms? ?-due? array key ?count?
+     *          $zset zpopmin ?-wait? ?-timeout ms? ?-due? ?count?
+     */
+
+    due = ZsetStripDue(&objc, &objv, first, args);
+    if (Sv_WaitOptions(interp, &objc, &objv, first, args,
+	    &deadline) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (!due) {
+	due = ZsetStripDue(&objc, &objv, first, args);
+    }
+    if (deadline) {
+	Sv_WaitBegin(&wait, objc, objv, (Container*)arg);
+    }
+
+    while (1) {
+	ret = Sv_GetContainer(interp, objc, objv, &svObj, &off, FLAGS_KEEPREP);
+	if (ret == TCL_OK) {
+	    if (objc > 1 + off) {
+		Tcl_WrongNumArgs(interp, off, objv, "?count?");
+		goto cmd_err;
+	    }
+	    if (objc == 1 + off) {
+		if (Tcl_GetWideIntFromObj(interp, objv[off], &count) != TCL_OK) {
+		    goto cmd_err;
+		}
+	    }
+	    zsPtr = GetZset(interp, svObj);
+	    if (zsPtr == NULL) {
+		goto cmd_err;
+	    }
+	    nodePtr = zsPtr->headPtr->link[0].nextPtr;
+	    if (due) {
+		Tcl_GetTime(&time);
+		now = (double)time.sec * 1000 + time.usec / 1000;
+	    }
+	    if ((nodePtr && (!due || nodePtr->score <= now)) || !deadline) {
+		break;
+	    }
+	    Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+	} else if (ret == TCL_ERROR || arg) {
+	    ret = TCL_ERROR;
+	    goto cmd_exit;
+	} else if (!deadline) {
+	    Tcl_ResetResult(interp);
+	    ret = TCL_OK;
+	    goto cmd_exit;
+	} else {
+	    nodePtr = NULL;
+	}
+
+	/*
+	 * Nothing to pop yet. Wait for somebody to change anything,
+	 * or for the first member to become due, and look again.
+	 */
+
+	Tcl_ResetResult(interp);
+	until = deadline;
+	if (nodePtr && nodePtr->score < 9.0e15
+		&& (deadline < 0 || nodePtr->score < (double)deadline)) {
+	    until = (Tcl_WideInt)nodePtr->score + 1;
+	}
+	if (!Sv_WaitChange(&wait, until) && until == deadline) {
+	    ret = TCL_OK;
+	    goto cmd_exit;
+	}
+	svObj = (Container*)arg;
+    }
+
+    listObj = Tcl_NewListObj(0, NULL);
+    for (i = 0; i < count; i++) {
+	nodePtr = zsPtr->headPtr->link[0].nextPtr;
+	if (nodePtr == NULL || (due && nodePtr->score > now)) {
+	    break;
+	}
+	ZsetAppend(zsPtr, listObj, nodePtr, 1);
+	hPtr = nodePtr->hPtr;
+	zsPtr->bytes -= strlen(ZSET_MEMBER(zsPtr, nodePtr));
+	ZsetDelete(zsPtr, nodePtr);
+	Tcl_DeleteHashEntry(hPtr);
+    }
+    Tcl_SetObjResult(interp, listObj);
+    ret = PutZset(interp, svObj, i ? SV_CHANGED : SV_UNCHANGED);
+    goto cmd_exit;
+
+ cmd_err:
+    ret = Sv_PutContainer(interp, svObj, SV_ERROR);
+
+ cmd_exit:
+    if (deadline) {
+	Sv_WaitEnd(&wait);
+    }
+    return ret;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvZrangeObjCmd --
+ *
+ *      This procedure is invoked to process the "tsv::zrange" command.
+ *      See the user documentation for details on what it does.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      See the user documentation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SvZrangeObjCmd(
+    void *arg,
+    Tcl_Interp *interp,
+    Tcl_Size objc,
+    Tcl_Obj *const objv[]
+) {
+    int ret, withScores = 0;
+    Tcl_Size off, llen, first, last;
+    Tcl_Obj *listObj;
+    ZsetNode *nodePtr;
+    SvZset *zsPtr;
+    Container *svObj = (Container*)arg;
+
+    /*
+     * Syntax:
+     *          tsv::zrange array key first last ?-withscores?
+     *          $zset zrange first last ?-withscores?
+     */
+
+    ret = GetZsetReadable(interp, arg, objc, objv, &svObj, &off);
+    if (ret == TCL_BREAK) {
+	return TCL_OK;
+    } else if (ret != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (objc == 3 + off
+	    && !strcmp(Tcl_GetString(objv[off+2]), "-withscores")) {
+	withScores = 1;
+    } else if (objc != 2 + off) {
+	Tcl_WrongNumArgs(interp, off, objv, "first last ?-withscores?");
+	goto cmd_err;
+    }
+    zsPtr = (SvZset *)svObj->repPtr;
+    llen = zsPtr->members.numEntries;
+    ret = Tcl_GetIntForIndex(interp, objv[off], llen-1, &first);
+    if (ret != TCL_OK) {
+	goto cmd_err;
+    }
+    ret = Tcl_GetIntForIndex(interp, objv[off+1], llen-1, &last);
+    if (ret != TCL_OK) {
+	goto cmd_err;
+    }
+    if (first < 0)  {
+	first = 0;
+    }
+    if (last >= llen) {
+	last = llen - 1;
+    }
+    listObj = Tcl_NewListObj(0, NULL);
+    if (first <= last) {
+	nodePtr = ZsetByRank(zsPtr, first);
+	for (; first <= last; first++, nodePtr = nodePtr->link[0].nextPtr) {
+	    ZsetAppend(zsPtr, listObj, nodePtr, withScores);
+	}
+    }
+    Tcl_SetObjResult(interp, listObj);
+
+    return Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+
+ cmd_err:
+    return Sv_PutContainer(interp, svObj, SV_ERROR);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SvZrangebyscoreObjCmd --
+ *
+ *      This procedure is invoked to process the "tsv::zrangebyscore"
+ *      command. See the user documentation for details on what it does.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      See the user documentation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SvZrangebyscoreObjCmd(
+    void *arg,
+    Tcl_Interp *interp,
+    Tcl_Size objc,
+    Tcl_Obj *const objv[]
+) {
+    int ret, withScores = 0;
+    Tcl_Size off;
+    double min, max;
+    Tcl_Obj *listObj;
+    ZsetNode *nodePtr;
+    SvZset *zsPtr;
+    Container *svObj = (Container*)arg;
+
+    /*
+     * Syntax:
+     *          tsv::zrangebyscore array key min max ?-withscores?
+     *          $zset zrangebyscore min max ?-withscores?
+     */
+
+    ret = GetZsetReadable(interp, arg, objc, objv, &svObj, &off);
+    if (ret == TCL_BREAK) {
+	return TCL_OK;
+    } else if (ret != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (objc == 3 + off
+	    && !strcmp(Tcl_GetString(objv[off+2]), "-withscores")) {
+	withScores = 1;
+    } else if (objc != 2 + off) {
+	Tcl_WrongNumArgs(interp, off, objv, "min max ?-withscores?");
+	goto cmd_err;
+    }
+    if (Tcl_GetDoubleFromObj(interp, objv[off], &min) != TCL_OK
+	    || Tcl_GetDoubleFromObj(interp, objv[off+1], &max) != TCL_OK) {
+	goto cmd_err;
+    }
+    zsPtr = (SvZset *)svObj->repPtr;
+    listObj = Tcl_NewListObj(0, NULL);
+    for (nodePtr = ZsetByScore(zsPtr, min);
+	    nodePtr && nodePtr->score <= max;
+	    nodePtr = nodePtr->link[0].nextPtr) {
+	ZsetAppend(zsPtr, listObj, nodePtr, withScores);
+    }
+    Tcl_SetObjResult(interp, listObj);
+
+    return Sv_PutContainer(interp, svObj, SV_UNCHANGED);
+
+ cmd_err:
+    return Sv_PutContainer(interp, svObj, SV_ERROR);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * GetZset --
+ *
+ *      Returns the sorted set held in the container, turning the value
+ *      into a sorted set first if needed. Any list of members and
+ *      scores can be turned into a sorted set. The container must be
+ *      locked for writing, unless it already is a sorted set.
+ *
+ * Results:
+ *      The sorted set, or NULL if the value is no such list.
+ *
+ * Side effects:
+ *      The container may get the sorted set representation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static SvZset *
+GetZset(
+    Tcl_Interp *interp,
+    Container *svObj
+) {
+    Tcl_Size i, objc, len;
+    Tcl_Obj **objv;
+    const char *member;
+    double score;
+    SvZset *zsPtr;
+
+    if (svObj->repTypePtr == &zsetRepType) {
+	return (SvZset *)svObj->repPtr;
+    }
+    Sv_UpdateContainer(svObj);
+    if (Tcl_ListObjGetElements(interp, svObj->tclObj, &objc,
+	    &objv) != TCL_OK) {
+	return NULL;
+    }
+    if (objc % 2) {
+	Tcl_SetObjResult(interp, Tcl_NewStringObj(
+		"missing score to go with member", TCL_INDEX_NONE));
+	return NULL;
+    }
+    for (i = 1; i < objc; i += 2) {
+	if (Tcl_GetDoubleFromObj(interp, objv[i], &score) != TCL_OK) {
+	    return NULL;
+	}
+    }
+
+    zsPtr = (SvZset *)Tcl_Alloc(sizeof(SvZset));
+    Tcl_InitHashTable(&zsPtr->members, TCL_STRING_KEYS);
+    zsPtr->headPtr = ZsetNewNode(ZSET_MAXLEVEL, 0.0, NULL);
+    zsPtr->level = 1;
+    zsPtr->seed = (unsigned int)(size_t)zsPtr | 1;
+    zsPtr->bytes = 0;
+    for (i = 0; i < objc; i += 2) {
+	Tcl_GetDoubleFromObj(NULL, objv[i+1], &score);
+	member = Tcl_GetStringFromObj(objv[i], &len);
+	ZsetAdd(zsPtr, score, member, len);
+    }
+
+    Tcl_DecrRefCount(svObj->tclObj);
+    svObj->tclObj = Tcl_NewObj();
+    Tcl_IncrRefCount(svObj->tclObj);
+    svObj->repTypePtr = &zsetRepType;
+    svObj->repPtr = zsPtr;
+
+    return zsPtr;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * GetZsetReadable --
+ *
+ *      Locks the container for reading, if it already holds a sorted
+ *      set, or else for writing and turns its value into one.
+ *
+ * Results:
+ *      A standard Tcl result, TCL_BREAK if there is no such key. The
+ *      result of the interpreter is left empty in that case.
+ *
+ * Side effects:
+ *      The container is locked. It may get the sorted set representation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+GetZsetReadable(
+    Tcl_Interp *interp,
+    void *arg,
+    Tcl_Size objc,
+    Tcl_Obj *const objv[],
+    Container **svObjPtr,
+    Tcl_Size *offPtr
+) {
+    int ret, flags = FLAGS_READONLY|FLAGS_KEEPREP;
+
+    while (1) {
+	*svObjPtr = (Container*)arg;
+	ret = Sv_GetContainer(interp, objc, objv, svObjPtr, offPtr, flags);
+	if (ret == TCL_BREAK) {
+	    Tcl_ResetResult(interp);
+	    return TCL_BREAK;
+	} else if (ret != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if ((*svObjPtr)->repTypePtr == &zsetRepType) {
+	    return TCL_OK;
+	}
+	if (!(flags & FLAGS_READONLY)) {
+	    break;
+	}
+	Sv_PutContainer(interp, *svObjPtr, SV_UNCHANGED);
+	flags = FLAGS_KEEPREP;
+    }
+    if (GetZset(interp, *svObjPtr) == NULL) {
+	Sv_PutContainer(interp, *svObjPtr, SV_ERROR);
+	return TCL_ERROR;
+    }
+
+    return TCL_OK;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * PutZset --
+ *
+ *      Puts the container holding a sorted set back. Arrays bound to
+ *      a persistent store or evicting keys need the Tcl object of the
+ *      container after every change, the sorted set is converted back
+ *      to a list for them.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      The container is unlocked.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+PutZset(
+    Tcl_Interp *interp,
+    Container *svObj,
+    int mode
+) {
+    if (mode == SV_CHANGED && (svObj->arrayPtr->psPtr
+	    || svObj->arrayPtr->policy != SV_EVICT_NONE)) {
+	Sv_UpdateContainer(svObj);
+    }
+
+    return Sv_PutContainer(interp, svObj, mode);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * ZsetStripDue --
+ *
+ *      Removes the -due option of the "zpopmin" command from the
+ *      argument list, if it is at the given index. The shortened
+ *      argument list is built in the given buffer, which must hold
+ *      at least SV_MAXARGS elements.
+ *
+ * Results:
+ *      1 if the option was found, 0 otherwise.
+ *
+ * Side effects:
+ *      Argument count and list may be replaced.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+ZsetStripDue(
+    Tcl_Size *objcPtr,
+    Tcl_Obj *const **objvPtr,
+    Tcl_Size first,
+    Tcl_Obj **buffer
+) {
+    Tcl_Size objc = *objcPtr;
+    Tcl_Obj *const *objv = *objvPtr;
+
+    if (objc <= first || objc > SV_MAXARGS + 1
+	    || strcmp(Tcl_GetString(objv[first]), "-due")) {
+	return 0;
+    }
+    memmove(buffer, objv, first * sizeof(Tcl_Obj *));
+    memmove(buffer + first, objv + first + 1,
+	    (objc - first - 1) * sizeof(Tcl_Obj *));
+    *objcPtr = objc - 1;
+    *objvPtr = buffer;
+
+    return 1;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * ZsetAdd --
+ *
+ *      Adds a member to the sorted set or changes its score.
+ *
+ * Results:
+ *      2 if the member was added, 1 if its score was changed,
+ *      0 if it already had the score.
+ *
+ * Side effects:
+ *      Memory gets allocated.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+ZsetAdd(
+    SvZset *zsPtr,
+    double score,
+    const char *member,
+    Tcl_Size len
+) {
+    int isNew;
+    Tcl_HashEntry *hPtr;
+    ZsetNode *nodePtr;
+
+    hPtr = Tcl_CreateHashEntry(&zsPtr->members, member, &isNew);
+    if (!isNew) {
+	nodePtr = (ZsetNode *)Tcl_GetHashValue(hPtr);
+	if (nodePtr->score == score) {
+	    return 0;
+	}
+	ZsetDelete(zsPtr, nodePtr);
+    } else {
+	zsPtr->bytes += len;
+    }
+    ZsetInsert(zsPtr, score, hPtr);
+
+    return isNew ? 2 : 1;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * ZsetNewNode, ZsetBefore, ZsetInsert, ZsetDelete --
+ *
+ *      Manage the nodes of the skiplist. ZsetBefore tells if a node
+ *      sorts before the given score and member. ZsetInsert adds a node
+ *      for the member in the hash entry, ZsetDelete removes and frees
+ *      the node, leaving the hash entry alone.
+ *
+ * Results:
+ *      ZsetNewNode returns the new node.
+ *
+ * Side effects:
+ *      Memory gets allocated or freed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static ZsetNode *
+ZsetNewNode(
+    int level,
+    double score,
+    Tcl_HashEntry *hPtr
+) {
+    ZsetNode *nodePtr;
+
+    nodePtr = (ZsetNode *)Tcl_Alloc(sizeof(ZsetNode)
+	    + (level - 1) * sizeof(struct ZsetLink));
+    memset(nodePtr->link, 0, level * sizeof(struct ZsetLink));
+    nodePtr->score = score;
+    nodePtr->hPtr = hPtr;
+    nodePtr->level = level;
+
+    return nodePtr;
+}
+
+static int
+ZsetBefore(
+    SvZset *zsPtr,
+    ZsetNode *nodePtr,
+    double score,
+    const char *member
+) {
+    return nodePtr->score < score || (nodePtr->score == score
+	    && strcmp(ZSET_MEMBER(zsPtr, nodePtr), member) < 0);
+}
+
+static void
+ZsetInsert(
+    SvZset *zsPtr,
+    double score,
+    Tcl_HashEntry *hPtr
+) {
+    ZsetNode *update[ZSET_MAXLEVEL], *nodePtr, *nextPtr;
+    Tcl_Size rank[ZSET_MAXLEVEL];
+    const char *member = (const char *)Tcl_GetHashKey(&zsPtr->members, hPtr);
+    int i, level;
+
+    nodePtr = zsPtr->headPtr;
+    for (i = zsPtr->level - 1; i >= 0; i--) {
+	rank[i] = (i == zsPtr->level - 1) ? 0 : rank[i+1];
+	while ((nextPtr = nodePtr->link[i].nextPtr) != NULL
+		&& ZsetBefore(zsPtr, nextPtr, score, member)) {
+	    rank[i] += nodePtr->link[i].span;
+	    nodePtr = nextPtr;
+	}
+	update[i] = nodePtr;
+    }
+
+    /*
+     * Every fourth node reaches one level higher.
+     */
+
+    level = 1;
+    do {
+	zsPtr->seed ^= zsPtr->seed << 13;
+	zsPtr->seed ^= zsPtr->seed >> 17;
+	zsPtr->seed ^= zsPtr->seed << 5;
+    } while ((zsPtr->seed & 3) == 0 && ++level < ZSET_MAXLEVEL);
+
+    if (level > zsPtr->level) {
+	for (i = zsPtr->level; i < level; i++) {
+	    rank[i] = 0;
+	    update[i] = zsPtr->headPtr;
+	    update[i]->link[i].span = zsPtr->members.numEntries - 1;
+	}
+	zsPtr->level = level;
+    }
+
+    nodePtr = ZsetNewNode(level, score, hPtr);
+    for (i = 0; i < level; i++) {
+	nodePtr->link[i].nextPtr = update[i]->link[i].nextPtr;
+	update[i]->link[i].nextPtr = nodePtr;
+	nodePtr->link[i].span = update[i]->link[i].span - (rank[0] - rank[i]);
+	update[i]->link[i].span = (rank[0] - rank[i]) + 1;
+    }
+    for (i = level; i < zsPtr->level; i++) {
+	update[i]->link[i].span++;
+    }
+    Tcl_SetHashValue(hPtr, nodePtr);
+}
+
+static void
+ZsetDelete(
+    SvZset *zsPtr,
+    ZsetNode *delPtr
+) {
+    ZsetNode *update[ZSET_MAXLEVEL], *nodePtr, *nextPtr;
+    const char *member = ZSET_MEMBER(zsPtr, delPtr);
+    int i;
+
+    nodePtr = zsPtr->headPtr;
+    for (i = zsPtr->level - 1; i >= 0; i--) {
+	while ((nextPtr = nodePtr->link[i].nextPtr) != NULL
+		&& ZsetBefore(zsPtr, nextPtr, delPtr->score, member)) {
+	    nodePtr = nextPtr;
+	}
+	update[i] = nodePtr;
+    }
+    for (i = 0; i < zsPtr->level; i++) {
+	if (update[i]->link[i].nextPtr == delPtr) {
+	    update[i]->link[i].span += delPtr->link[i].span - 1;
+	    update[i]->link[i].nextPtr = delPtr->link[i].nextPtr;
+	} else {
+	    update[i]->link[i].span--;
+	}
+    }
+    while (zsPtr->level > 1
+	    && zsPtr->headPtr->link[zsPtr->level - 1].nextPtr == NULL) {
+	zsPtr->level--;
+    }
+    Tcl_Free(delPtr);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * ZsetByRank, ZsetByScore --
+ *
+ *      Find nodes of the skiplist.
+ *
+ * Results:
+ *      ZsetByRank returns the node at the given rank, counted from 0.
+ *      ZsetByScore returns the first node with at least the given
+ *      score. Both return NULL if there is no such node.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static ZsetNode *
+ZsetByRank(
+    SvZset *zsPtr,
+    Tcl_Size rank
+) {
+    ZsetNode *nodePtr = zsPtr->headPtr;
+    Tcl_Size traversed = 0;
+    int i;
+
+    rank++;
+    for (i = zsPtr->level - 1; i >= 0; i--) {
+	while (nodePtr->link[i].nextPtr
+		&& traversed + nodePtr->link[i].span <= rank) {
+	    traversed += nodePtr->link[i].span;
+	    nodePtr = nodePtr->link[i].nextPtr;
+	}
+	if (traversed == rank) {
+	    return nodePtr;
+	}
+    }
+
+    return NULL;
+}
+
+static ZsetNode *
+ZsetByScore(
+    SvZset *zsPtr,
+    double score
+) {
+    ZsetNode *nodePtr = zsPtr->headPtr;
+    int i;
+
+    for (i = zsPtr->level - 1; i >= 0; i--) {
+	while (nodePtr->link[i].nextPtr
+		&& nodePtr->link[i].nextPtr->score < score) {
+	    nodePtr = nodePtr->link[i].nextPtr;
+	}
+    }
+
+    return nodePtr->link[0].nextPtr;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * ZsetAppend --
+ *
+ *      Appends the member of the node, and optionally its score,
+ *      to the list.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The list object is modified.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+ZsetAppend(
+    SvZset *zsPtr,
+    Tcl_Obj *listObj,
+    ZsetNode *nodePtr,
+    int withScore
+) {
+    Tcl_ListObjAppendElement(NULL, listObj, Tcl_NewStringObj(
+	    ZSET_MEMBER(zsPtr, nodePtr), TCL_INDEX_NONE));
+    if (withScore) {
+	Tcl_ListObjAppendElement(NULL, listObj,
+		Tcl_NewDoubleObj(nodePtr->score));
+    }
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * ZsetUpdateProc, ZsetFreeProc, ZsetValueProc, ZsetSizeProc --
+ *
+ *      Procedures of the sorted set representation.
+ *
+ * Results:
+ *      ZsetValueProc returns a new list of the members and scores.
+ *      ZsetSizeProc returns the estimated size of the sorted set.
+ *
+ * Side effects:
+ *      ZsetUpdateProc stores the members and scores in the Tcl object
+ *      of the container. ZsetFreeProc frees the sorted set.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+ZsetUpdateProc(
+    Container *svObj
+) {
+    Tcl_DecrRefCount(svObj->tclObj);
+    svObj->tclObj = ZsetValueProc(svObj);
+    Tcl_IncrRefCount(svObj->tclObj);
+}
+
+static void
+ZsetFreeProc(
+    Container *svObj
+) {
+    SvZset *zsPtr = (SvZset *)svObj->repPtr;
+    ZsetNode *nodePtr, *nextPtr;
+
+    for (nodePtr = zsPtr->headPtr; nodePtr; nodePtr = nextPtr) {
+	nextPtr = nodePtr->link[0].nextPtr;
+	Tcl_Free(nodePtr);
+    }
+    Tcl_DeleteHashTable(&zsPtr->members);
+    Tcl_Free(zsPtr);
+}
+
+static Tcl_Obj *
+ZsetValueProc(
+    Container *svObj
+) {
+    SvZset *zsPtr = (SvZset *)svObj->repPtr;
+    Tcl_Obj *listObj = Tcl_NewListObj(0, NULL);
+    ZsetNode *nodePtr;
+
+    for (nodePtr = zsPtr->headPtr->link[0].nextPtr; nodePtr;
+	    nodePtr = nodePtr->link[0].nextPtr) {
+	ZsetAppend(zsPtr, listObj, nodePtr, 1);
+    }
+
+    return listObj;
+}
+
+static Tcl_Size
+ZsetSizeProc(
+    Container *svObj
+) {
+    SvZset *zsPtr = (SvZset *)svObj->repPtr;
+    Tcl_Size numEntries = zsPtr->members.numEntries;
+
+    /*
+     * Nodes have 4/3 links on average.
+     */
+
+    return sizeof(SvZset) + zsPtr->bytes
+	    + numEntries * (sizeof(Tcl_HashEntry) + sizeof(ZsetNode))
+	    + numEntries / 3 * sizeof(struct ZsetLink)
+	    + zsPtr->members.numBuckets * sizeof(Tcl_HashEntry *);
+}
+
+/* EOF $RCSfile: threadSvZsetCmd.c,v $ */
+
+/* Emacs Setup Variables */
+/* Local Variables:      */
+/* mode: C               */
+/* indent-tabs-mode: nil */
+/* c-basic-offset: 4     */
+/* End:                  */
@@ -0,0 +1,83 @@
+#!/usr/bin/env tclsh
+
+lappend auto_path .
+package require thread
+
+if {[llength $argv] < 1 || [llength $argv] > 4} {
+    puts "Usage: $argv0 threads ?arrays? ?iterations? ?shards?"
+    puts {
+    threads
+	The number of worker threads to start.
+    arrays
+	The number of distinct shared arrays the workers operate on.
+	Worker N uses array "bench[expr {N % arrays}]". Defaults to the
+	number of threads, i.e. every thread has its own array.
+    iterations
+	The number of tsv::set/tsv::get pairs each worker performs.
+	Defaults to 100000.
+    shards
+	The number of shards of each array, see "tsv::array create".
+	Defaults to 0, i.e. plain, unsharded arrays.
+
+    This script measures the aggregate throughput of tsv::set and
+    tsv::get issued concurrently from many threads. With one array per
+    thread, the only contention left is the one caused by unrelated
+    arrays sharing the same bucket lock. With a single array, sharding
+    spreads the keys of that array over several locks.
+    }
+    exit 1
+}
+
+lassign $argv threads arrays iterations shards
+if {$arrays eq ""} {
+    set arrays $threads
+}
+if {$iterations eq ""} {
+    set iterations 100000
+}
+if {$shards eq ""} {
+    set shards 0
+}
+for {set i 0} {$i < $arrays} {incr i} {
+    tsv::array create bench$i -shards $shards
+}
+
+### Start the workers and let them wait for the go signal
+set workers {}
+for {set i 0} {$i < $threads} {incr i} {
+    lappend workers [thread::create {
+	proc run {array iterations} {
+	    for {set i 0} {$i < $iterations} {incr i} {
+		tsv::set $array k$i $i
+		tsv::get $array k$i
+	    }
+	}
+	thread::wait
+    }]
+}
+
+### Run
+set start [clock microseconds]
+set i 0
+foreach t $workers {
+    thread::send -async $t [list run bench[expr {$i % $arrays}] $iterations] done($t)
+    incr i
+}
+foreach t $workers {
+    if {![info exists done($t)]} {
+	vwait done($t)
+    }
+}
+set usec [expr {[clock microseconds] - $start}]
+
+set ops [expr {2 * $threads * $iterations}]
+puts [format "%d threads, %d arrays, %d shards: %d ops in %.3f s, %.0f ops/s" \
+	$threads $arrays $shards $ops [expr {$usec / 1e6}] [expr {$ops * 1e6 / $usec}]]
+
+### Cleanup
+foreach t $workers {
+    thread::release $t
+}
+for {set i 0} {$i < $arrays} {incr i} {
+    tsv::unset bench$i
+}